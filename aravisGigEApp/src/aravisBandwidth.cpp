@@ -0,0 +1,261 @@
+/* aravisBandwidth.cpp
+ *
+ * Shared bandwidth budget for GigE cameras that stream through the same
+ * host interface.
+ *
+ * Each camera attaches to the link (host interface address) it streams on
+ * and reports its payload and frame rate whenever they change. The link
+ * budget is then divided between the cameras in proportion to their demand,
+ * and each camera is given an inter-packet delay (GevSCPD) that paces its
+ * frames to its share instead of bursting at wire speed, a frame transmission
+ * delay (GevSCFTD) that interleaves its packets with the other cameras, and
+ * the frame rate ceiling it can sustain inside that share.
+ *
+ * The allocator never calls back into a driver. Drivers poll
+ * aravisBandwidthGeneration() and fetch their share when it changes, so
+ * there is no lock ordering between the allocator and the asyn port locks.
+ *
+ */
+
+/* System includes */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* EPICS includes */
+#include <iocsh.h>
+#include <epicsExport.h>
+#include <epicsMutex.h>
+#include <epicsString.h>
+#include <epicsThread.h>
+
+/* glib includes */
+#include <glib.h>
+
+#include "aravisBandwidth.h"
+
+/** A host interface that one or more cameras stream through */
+struct aravisBandwidthLink {
+    char *name;
+    double linkRate;      /* bytes/s on the wire */
+    double budget;        /* fraction of linkRate cameras may use */
+    GList *clients;
+};
+
+/** A camera attached to a link */
+struct aravisBandwidthClient {
+    struct aravisBandwidthLink *link;
+    char *portName;
+    double payload;
+    double fps;
+    int packetSize;
+    aravisBandwidthShare share;
+};
+
+static GHashTable *links = NULL;
+static epicsMutexId linksLock = NULL;
+static epicsThreadOnceId linksOnce = EPICS_THREAD_ONCE_INIT;
+
+static void linksInit(void *arg) {
+    links = g_hash_table_new(g_str_hash, g_str_equal);
+    linksLock = epicsMutexMustCreate();
+}
+
+/** Find or create a link, called with linksLock taken */
+static struct aravisBandwidthLink *findLink(const char *name) {
+    struct aravisBandwidthLink *link;
+    link = (struct aravisBandwidthLink *) g_hash_table_lookup(links, name);
+    if (link == NULL) {
+        link = (struct aravisBandwidthLink *) calloc(1, sizeof(struct aravisBandwidthLink));
+        link->name = epicsStrDup(name);
+        link->linkRate = ARAVIS_BW_DEFAULT_LINK_MBPS * 1e6 / 8;
+        link->budget = ARAVIS_BW_DEFAULT_BUDGET;
+        g_hash_table_insert(links, link->name, link);
+    }
+    return link;
+}
+
+/** Bytes on the wire for one frame, including leader, trailer and framing */
+static double wireBytesPerFrame(struct aravisBandwidthClient *client) {
+    int packetSize = client->packetSize;
+    if (packetSize <= ARAVIS_BW_GVSP_OVERHEAD) packetSize = 1500;
+    double packets = ceil(client->payload / (packetSize - ARAVIS_BW_GVSP_OVERHEAD));
+    /* leader and trailer are minimum size ethernet frames */
+    return packets * (packetSize + ARAVIS_BW_ETHERNET_OVERHEAD) + 2 * (64 + 20);
+}
+
+/** Divide the link budget between its cameras, called with linksLock taken */
+static void recompute(struct aravisBandwidthLink *link) {
+    double budget = link->linkRate * link->budget;
+    double total = 0;
+    GList *iter;
+    int slot = 0;
+
+    for (iter = link->clients; iter != NULL; iter = iter->next) {
+        struct aravisBandwidthClient *client = (struct aravisBandwidthClient *) iter->data;
+        total += wireBytesPerFrame(client) * client->fps;
+    }
+
+    for (iter = link->clients; iter != NULL; iter = iter->next) {
+        struct aravisBandwidthClient *client = (struct aravisBandwidthClient *) iter->data;
+        aravisBandwidthShare *share = &client->share;
+        double frameBytes = wireBytesPerFrame(client);
+        double demand = frameBytes * client->fps;
+        double packetBytes = (client->packetSize > ARAVIS_BW_GVSP_OVERHEAD ? client->packetSize : 1500)
+                             + ARAVIS_BW_ETHERNET_OVERHEAD;
+
+        share->budget = budget;
+        share->utilisation = budget > 0 ? total / budget : 0;
+        if (demand <= 0) {
+            /* Not streaming, so it can have the whole link when it starts */
+            share->allocated = 0;
+            share->fpsMax = frameBytes > 0 ? budget / frameBytes : 0;
+            share->packetDelay = 0;
+            share->frameDelay = 0;
+        } else {
+            /* Spare capacity is handed out in proportion to demand, so the sum of
+             * shares is always the budget and paced cameras can never overflow it */
+            share->allocated = budget * demand / total;
+            share->fpsMax = share->allocated / frameBytes;
+            /* Stretch each packet slot from wire speed to the allocated rate */
+            share->packetDelay = 1e9 * packetBytes / share->allocated - 1e9 * packetBytes / link->linkRate;
+            if (share->packetDelay < 0) share->packetDelay = 0;
+            /* Offset each camera by one packet slot so that simultaneously triggered
+             * cameras interleave their packets rather than colliding */
+            share->frameDelay = 1e9 * slot * packetBytes / link->linkRate;
+            slot++;
+        }
+        share->generation++;
+    }
+}
+
+/** Attach a camera to the link it streams on */
+aravisBandwidthClient *aravisBandwidthAttach(const char *link, const char *portName) {
+    struct aravisBandwidthClient *client;
+    epicsThreadOnce(&linksOnce, linksInit, NULL);
+    client = (struct aravisBandwidthClient *) calloc(1, sizeof(struct aravisBandwidthClient));
+    client->portName = epicsStrDup(portName);
+    epicsMutexMustLock(linksLock);
+    client->link = findLink(link);
+    client->link->clients = g_list_append(client->link->clients, client);
+    recompute(client->link);
+    epicsMutexUnlock(linksLock);
+    return client;
+}
+
+/** Detach a camera, the rest of the link gets its share */
+void aravisBandwidthDetach(aravisBandwidthClient *client) {
+    if (client == NULL) return;
+    epicsMutexMustLock(linksLock);
+    client->link->clients = g_list_remove(client->link->clients, client);
+    recompute(client->link);
+    epicsMutexUnlock(linksLock);
+    free(client->portName);
+    free(client);
+}
+
+/** Report a new payload, frame rate or packet size, fps=0 when not streaming */
+void aravisBandwidthUpdate(aravisBandwidthClient *client, double payload, double fps, int packetSize) {
+    if (client == NULL) return;
+    epicsMutexMustLock(linksLock);
+    if (client->payload != payload || client->fps != fps || client->packetSize != packetSize) {
+        client->payload = payload;
+        client->fps = fps;
+        client->packetSize = packetSize;
+        recompute(client->link);
+    }
+    epicsMutexUnlock(linksLock);
+}
+
+/** Cheap check for whether the share has changed since it was last fetched */
+unsigned aravisBandwidthGeneration(aravisBandwidthClient *client) {
+    unsigned generation;
+    if (client == NULL) return 0;
+    epicsMutexMustLock(linksLock);
+    generation = client->share.generation;
+    epicsMutexUnlock(linksLock);
+    return generation;
+}
+
+/** Copy out the current share, returns its generation */
+unsigned aravisBandwidthGetShare(aravisBandwidthClient *client, aravisBandwidthShare *share) {
+    if (client == NULL) return 0;
+    epicsMutexMustLock(linksLock);
+    *share = client->share;
+    epicsMutexUnlock(linksLock);
+    return share->generation;
+}
+
+/** Set the speed of a link and the percentage of it cameras may use */
+int aravisBandwidthSetBudget(const char *link, double linkMbps, double budgetPercent) {
+    struct aravisBandwidthLink *pLink;
+    if (link == NULL || linkMbps <= 0 || budgetPercent <= 0 || budgetPercent > 100) {
+        printf("aravisBandwidthConfig: usage: aravisBandwidthConfig(interfaceIP, linkMbps, budgetPercent)\n");
+        return -1;
+    }
+    epicsThreadOnce(&linksOnce, linksInit, NULL);
+    epicsMutexMustLock(linksLock);
+    pLink = findLink(link);
+    pLink->linkRate = linkMbps * 1e6 / 8;
+    pLink->budget = budgetPercent / 100;
+    recompute(pLink);
+    epicsMutexUnlock(linksLock);
+    return 0;
+}
+
+/** Print every link and its cameras */
+void aravisBandwidthReport(FILE *fp) {
+    GList *keys, *iter, *citer;
+    epicsThreadOnce(&linksOnce, linksInit, NULL);
+    epicsMutexMustLock(linksLock);
+    keys = g_hash_table_get_keys(links);
+    for (iter = keys; iter != NULL; iter = iter->next) {
+        struct aravisBandwidthLink *link = (struct aravisBandwidthLink *) g_hash_table_lookup(links, iter->data);
+        double demand = 0;
+        for (citer = link->clients; citer != NULL; citer = citer->next) {
+            struct aravisBandwidthClient *client = (struct aravisBandwidthClient *) citer->data;
+            demand += wireBytesPerFrame(client) * client->fps;
+        }
+        fprintf(fp, "Link %s: %.0f Mbit/s, budget %.0f%%, demand %.1f Mbit/s (%.1f%% of budget)\n",
+                link->name, link->linkRate * 8 / 1e6, link->budget * 100, demand * 8 / 1e6,
+                100 * demand / (link->linkRate * link->budget));
+        for (citer = link->clients; citer != NULL; citer = citer->next) {
+            struct aravisBandwidthClient *client = (struct aravisBandwidthClient *) citer->data;
+            fprintf(fp, "  %-16s payload %8.0f B  %7.2f fps  share %7.1f Mbit/s  max %7.2f fps  "
+                        "GevSCPD %8.0f ns  GevSCFTD %8.0f ns\n",
+                    client->portName, client->payload, client->fps, client->share.allocated * 8 / 1e6,
+                    client->share.fpsMax, client->share.packetDelay, client->share.frameDelay);
+        }
+    }
+    g_list_free(keys);
+    epicsMutexUnlock(linksLock);
+}
+
+/** Code for iocsh registration */
+static const iocshArg aravisBandwidthConfigArg0 = {"Interface IP", iocshArgString};
+static const iocshArg aravisBandwidthConfigArg1 = {"Link Mbit/s", iocshArgDouble};
+static const iocshArg aravisBandwidthConfigArg2 = {"Budget percent", iocshArgDouble};
+static const iocshArg * const aravisBandwidthConfigArgs[] = {&aravisBandwidthConfigArg0,
+                                                            &aravisBandwidthConfigArg1,
+                                                            &aravisBandwidthConfigArg2};
+static const iocshFuncDef configAravisBandwidth = {"aravisBandwidthConfig", 3, aravisBandwidthConfigArgs};
+static void configAravisBandwidthCallFunc(const iocshArgBuf *args)
+{
+    aravisBandwidthSetBudget(args[0].sval, args[1].dval, args[2].dval);
+}
+
+static const iocshFuncDef reportAravisBandwidth = {"aravisBandwidthReport", 0, NULL};
+static void reportAravisBandwidthCallFunc(const iocshArgBuf *args)
+{
+    aravisBandwidthReport(stdout);
+}
+
+static void aravisBandwidthRegister(void)
+{
+    iocshRegister(&configAravisBandwidth, configAravisBandwidthCallFunc);
+    iocshRegister(&reportAravisBandwidth, reportAravisBandwidthCallFunc);
+}
+
+extern "C" {
+    epicsExportRegistrar(aravisBandwidthRegister);
+}
@@ -0,0 +1,44 @@
+/* aravisBandwidth.h
+ *
+ * Shared bandwidth budget for GigE cameras that stream through the same
+ * host interface.
+ *
+ */
+#ifndef ARAVIS_BANDWIDTH_H
+#define ARAVIS_BANDWIDTH_H
+
+#include <stdio.h>
+
+/** Ethernet framing added to every GVSP packet on the wire:
+    14 header + 4 FCS + 8 preamble + 12 inter-frame gap */
+#define ARAVIS_BW_ETHERNET_OVERHEAD 38
+
+/** IP + UDP + GVSP headers inside a packet of GevSCPS bytes */
+#define ARAVIS_BW_GVSP_OVERHEAD 36
+
+/** Default link speed in Mbit/s and the fraction of it we allow cameras to use */
+#define ARAVIS_BW_DEFAULT_LINK_MBPS 1000.0
+#define ARAVIS_BW_DEFAULT_BUDGET 0.9
+
+/** What the allocator has granted a single camera */
+typedef struct aravisBandwidthShare {
+    double allocated;     /**< Bytes/s granted to this camera */
+    double fpsMax;        /**< Frame rate this camera can sustain within its share */
+    double packetDelay;   /**< GevSCPD in ns that paces packets to the share */
+    double frameDelay;    /**< GevSCFTD in ns that staggers this camera against the others */
+    double utilisation;   /**< Demand of all cameras on the link as a fraction of the budget */
+    double budget;        /**< Bytes/s available on the link */
+    unsigned generation;  /**< Bumped every time this share is recomputed */
+} aravisBandwidthShare;
+
+typedef struct aravisBandwidthClient aravisBandwidthClient;
+
+aravisBandwidthClient *aravisBandwidthAttach(const char *link, const char *portName);
+void aravisBandwidthDetach(aravisBandwidthClient *client);
+void aravisBandwidthUpdate(aravisBandwidthClient *client, double payload, double fps, int packetSize);
+unsigned aravisBandwidthGeneration(aravisBandwidthClient *client);
+unsigned aravisBandwidthGetShare(aravisBandwidthClient *client, aravisBandwidthShare *share);
+int aravisBandwidthSetBudget(const char *link, double linkMbps, double budgetPercent);
+void aravisBandwidthReport(FILE *fp);
+
+#endif
@@ -18,11 +18,15 @@
 /* EPICS includes */
 #include <iocsh.h>
 #include <epicsExport.h>
+#include <epicsAtomic.h>
 #include <epicsExit.h>
 #include <epicsEndian.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
 #include <epicsString.h>
 #include <epicsThread.h>
 #include <initHooks.h>
+#include <osiSock.h>
 
 /* areaDetector includes */
 #include <ADDriver.h>
@@ -32,21 +36,118 @@ extern "C" {
     #include <arv.h>
 }
 
+/* This driver */
+#include "aravisBandwidth.h"
+#include "aravisDiscovery.h"
+#include "aravisRecorder.h"
+#include "aravisPreprocess.h"
+#include "aravisShm.h"
+#include "aravisStats.h"
+#include "aravisTrace.h"
+
 #define DRIVER_VERSION "2.2.0"
 #define ARAVIS_VERSION "0.5.13"
 
 /* number of raw buffers in our queue */
 #define NRAW 20
 
-/* maximum number of custom features that we support */
-#define NFEATURES 1000
+/* how often the stream auto-tuner looks at the statistics, and how many frames it needs */
+#define TUNE_PERIOD 1.0
+#define TUNE_MIN_FRAMES 10
+
+/* how often the frame rate throttle looks at the backlog, and the backlog
+ * fractions above which it slows the camera and below which it speeds it up */
+#define THROTTLE_PERIOD 0.5
+#define THROTTLE_HIGH 0.5
+#define THROTTLE_LOW 0.2
+
+/* how far over its bandwidth share's frame rate a paced camera may run before it is
+ * clamped, so that cameras rounding the rate up don't chase the share forever */
+#define BW_FPS_TOLERANCE 0.01
+
+/* what the stream thread does when our frame queue is full */
+#define ARAVIS_OVERFLOW_DROP_NEWEST 0
+#define ARAVIS_OVERFLOW_DROP_OLDEST 1
+#define ARAVIS_OVERFLOW_KEEP_NTH    2
+
+/* how often the background logger reports dropped frames */
+#define LOG_PERIOD 5.0
+
+/* maximum number of chunks we parse from each frame */
+#define NCHUNKS 32
+
+/* maximum number of software triggers waiting for their frame */
+#define NTRIGGERS 16
+
+/* maximum number of frames held before a ring trigger */
+#define NRING 1000
+
+/* maximum number of events we subscribe to */
+#define NEVENTS 32
+
+/* maximum number of nodes made stale by one batch of writes */
+#define MAX_CHANGED_NODES 128
+
+/* GigE Vision bootstrap registers for the message channel */
+#define GVBS_MCP      0x0B00    /* message channel port, 0 disables the channel */
+#define GVBS_MCDA     0x0B10    /* message channel destination address */
+#define GVBS_MCTT     0x0B14    /* message channel transmission timeout, ms */
+#define GVBS_MCRC     0x0B18    /* message channel retry count */
+
+/* GVCP commands sent to us on the message channel */
+#define GVCP_EVENT_CMD      0x00C0
+#define GVCP_EVENT_ACK      0x00C1
+#define GVCP_EVENTDATA_CMD  0x00C2
+#define GVCP_FLAG_ACK       0x01
+
+/* polled features whose registers are this close are read in one ReadMem,
+ * which carries at most BLOCK_MAX bytes of data in a single round trip */
+#define BLOCK_MAX 512
+#define BLOCK_GAP 64
+
+/* feature writes that can wait for the command thread */
+#define NCOMMANDS 64
+
+/* how a registered feature is polled */
+#define ARAVIS_POLL_SINGLE 0    /* read on its own through aravis */
+#define ARAVIS_POLL_BLOCK  1    /* decoded from a block read */
+#define ARAVIS_POLL_NEVER  2    /* a command, or not on this camera */
+
+/* what the auto-exposure controller may adjust */
+#define ARAVIS_AE_OFF      0
+#define ARAVIS_AE_EXPOSURE 1
+#define ARAVIS_AE_GAIN     2
+#define ARAVIS_AE_BOTH     3
+
+/* what the auto-exposure controller is doing */
+#define ARAVIS_AE_STATE_OFF       0
+#define ARAVIS_AE_STATE_SETTLING  1
+#define ARAVIS_AE_STATE_ADJUSTING 2
+#define ARAVIS_AE_STATE_CONVERGED 3
+#define ARAVIS_AE_STATE_LIMITED   4
+
+/* what the next frames are being averaged into */
+#define ARAVIS_PRE_CAPTURE_NONE 0
+#define ARAVIS_PRE_CAPTURE_DARK 1
+#define ARAVIS_PRE_CAPTURE_FLAT 2
+
+/* auto-exposure meters every AE_METER_STEP'th pixel of every AE_METER_STEP'th row */
+#define AE_METER_STEP 2
 
 /* driver name for asyn trace prints */
 static const char *driverName = "aravisCamera";
 
+/* written by setGeometry, their dependents are refreshed together */
+static const char *geometryFeatures[] = {
+    "PixelFormat", "BinningHorizontal", "BinningVertical", "OffsetX", "OffsetY", "Width", "Height"
+};
+
 /* flag to say IOC is running */
 static int iocRunning = 0;
 
+/* every camera we have made, so iocsh commands can find them by port name */
+static GList *cameras = NULL;
+
 /* lookup for binning mode strings */
 struct bin_lookup {
     const char * mode;
@@ -90,6 +191,22 @@ static const struct pix_lookup pix_lookup[] = {
     { ARV_PIXEL_FORMAT_BAYER_BG_12,   NDColorModeBayer, NDUInt16, NDBayerBGGR }
 };
    
+/* A block ID that goes back by more than this is the camera starting again, not a wrap */
+#define FRAME_ID_WRAP_WINDOW 1024
+
+/* Number of frames missing between two GVSP block IDs. GigE Vision block
+ * IDs are 16 bit and skip 0 when they wrap, so 65535 is followed by 1. An ID
+ * that goes backwards anywhere else means the camera restarted its count,
+ * after a reset or another client restarting acquisition, so nothing is
+ * counted and the caller takes the new ID as its baseline */
+static unsigned int frameIdGap(guint32 last, guint32 id, int isGigE)
+{
+    if (id > last) return id - last - 1;
+    if (id == last || !isGigE) return 0;
+    if (last < 65535 - FRAME_ID_WRAP_WINDOW || id == 0 || id > FRAME_ID_WRAP_WINDOW) return 0;
+    return (65535 - last) + (id - 1);
+}
+
 /* Convert ArvBufferStatus enum to string */
 const char * ArvBufferStatusToString( ArvBufferStatus buffer_status )
 {
@@ -110,6 +227,93 @@ const char * ArvBufferStatusToString( ArvBufferStatus buffer_status )
     return pString;
 }
 
+/** What the aravis stream thread passes to our processing thread */
+struct frame_msg {
+    ArvBuffer *buffer;
+    gint64 received;    /* g_get_real_time() when the buffer completed, us */
+    gint64 monotonic;   /* g_get_monotonic_time() at the same moment, us */
+};
+
+/** A polled feature that can be decoded from a block read */
+struct block_reg {
+    int index;          /* parameter it is stored in */
+    ArvGcNode *node;    /* feature node, decides how the value is stored */
+    guint64 address;
+    int length;
+    int bigEndian;
+    int isSigned;
+    int isFloat;        /* FloatReg */
+    int shift, width;   /* bit field of a MaskedIntReg, width 0 for the whole register */
+    int block;          /* index into blocks */
+};
+
+/** A contiguous register range read in one go */
+struct block_read {
+    guint64 address;
+    guint32 length;
+    int failed;         /* read its features one at a time from now on */
+};
+
+/** A camera feature bound to an asyn parameter */
+struct aravis_feature {
+    int reason;             /* asyn parameter, also its index in the registry */
+    char *name;             /* genicam feature name */
+    asynParamType type;
+    ArvGcNode *node;        /* resolved once per connection, NULL if the camera doesn't have it */
+    int pollClass;
+    struct block_reg *reg;  /* where it is decoded from when pollClass is ARAVIS_POLL_BLOCK */
+    epicsFloat64 lastValue; /* last numeric value read */
+    int lastValid;
+    /* enum choices as last sent to clients, and what they were built from */
+    char **enumStrings;
+    int *enumValues;
+    int *enumSeverities;
+    size_t nEnums;
+    int enumValid;
+    int enumAvailable;
+    int enumStale;              /* a node it depends on has been written since they were built */
+    unsigned int refreshStamp;  /* last dependency refresh that read it */
+};
+
+/** A feature write queued for the command thread */
+struct feature_cmd {
+    int function;
+    int isFloat;
+    epicsFloat64 value;
+    epicsTimeStamp queued;
+};
+
+/** A chunk that we turn into an NDAttribute on every frame */
+struct chunk_lookup {
+    char *name;        /* ChunkSelector entry, e.g. ExposureTime */
+    char *feature;     /* GenICam feature holding the value, e.g. ChunkExposureTime */
+    int isFloat;
+    NDAttribute *attr; /* its entry in the frame attribute template */
+};
+
+/** An event we have enabled on the message channel */
+struct event_lookup {
+    char *name;        /* EventSelector entry, e.g. ExposureEnd */
+    int id;            /* value of the Event<name> feature, as sent in the event packet */
+};
+
+/** Features that an event tells us have changed, beyond its own Event<name>... features */
+struct event_depends {
+    const char *event;
+    const char *feature;
+};
+static const struct event_depends event_depends[] = {
+    { "AcquisitionStart",         "AcquisitionStatus"       },
+    { "AcquisitionEnd",           "AcquisitionStatus"       },
+    { "AcquisitionTransferStart", "AcquisitionStatus"       },
+    { "AcquisitionTransferEnd",   "AcquisitionStatus"       },
+    { "FrameTriggerMissed",       "AcquisitionStatus"       },
+    { "OverTemperature",          "DeviceTemperature"       },
+    { "OverTemperature",          "DeviceTemperatureStatus" },
+    { "DeviceTemperatureStatusChanged", "DeviceTemperature"       },
+    { "DeviceTemperatureStatusChanged", "DeviceTemperatureStatus" }
+};
+
 /** Aravis GigE detector driver */
 class aravisCamera : public ADDriver, epicsThreadRunable {
 public:
@@ -121,15 +325,26 @@ public:
     /* These are the methods that we override from ADDriver */
     virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+    virtual asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual);
     virtual asynStatus drvUserCreate(asynUser *pasynUser, const char *drvInfo,
                                      const char **pptypeName, size_t *psize);
     virtual asynStatus readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[], 
                                 size_t nElements, size_t *nIn);
     void report(FILE *fp, int details);
+    virtual asynStatus lock();
+    virtual asynStatus unlock();
 
     /* This is the method we override from epicsThreadRunable */
     void run();
 
+    /* These should be private, but are run from C thread functions so must be public */
+    void eventTask();
+    void connectTask();
+    void commandTask();
+
+    /* Send a software trigger from outside the port thread */
+    asynStatus softwareTrigger();
+
     /* This should be private, but is used in the aravis callback so must be public */
     epicsMessageQueueId msgQId;
 
@@ -139,6 +354,26 @@ public:
     /** Used by connection lost callback */
     int connectionValid;
 
+    /** Frame accounting, updated by the aravis stream thread */
+    int isGigE;
+    int frameIdValid;
+    guint32 lastFrameId;
+    int lastMissingId;
+    size_t nDroppedWire;    /* never arrived, from gaps in the GVSP block ID */
+    size_t nDroppedQueue;   /* arrived but our message queue was full */
+    size_t nBadFrames;      /* arrived with a bad status */
+    size_t nDroppedNewest;  /* queue full, new frame discarded */
+    size_t nDroppedOldest;  /* queue full, oldest queued frame discarded */
+    size_t nDecimated;      /* queue filling, frame skipped to keep every Nth */
+    int lastBadStatus;
+    /** Overflow policy, read by the aravis stream thread */
+    int overflowPolicy;
+    int keepNth;
+    unsigned int overflowSeq;
+
+    /* This should be private, but is run from a C thread function so must be public */
+    void logTask();
+
 protected:
     int AravisCompleted;
     #define FIRST_ARAVIS_CAMERA_PARAM AravisCompleted
@@ -153,14 +388,185 @@ protected:
     int AravisConnection;
     int AravisGetFeatures;
     int AravisHWImageMode;
+    int AravisSocketBuffer;
+    int AravisSocketBufferSize;
+    int AravisAutoPktSize;
+    int AravisPktSize;
+    int AravisPktDelay;
+    int AravisBwPacing;
+    int AravisBwLink;
+    int AravisBwBudget;
+    int AravisBwUtilisation;
+    int AravisBwAllocated;
+    int AravisBwFpsMax;
+    int AravisBwFrameDelay;
+    int AravisBwLimited;
+    int AravisAutoTune;
+    int AravisPktTimeoutMin;
+    int AravisPktTimeoutMax;
+    int AravisFrameRetentionMin;
+    int AravisFrameRetentionMax;
+    int AravisFrameCompletion;
+    int AravisPktGap;
+    int AravisAutoTuneMsg;
+    int AravisChunkMode;
+    int AravisChunks;
+    int AravisFrameId;
+    int AravisDroppedWire;
+    int AravisDroppedQueue;
+    int AravisBadFrames;
+    int AravisLastMissingId;
+    int AravisEventMode;
+    int AravisEvents;
+    int AravisEventCount;
+    int AravisLastEvent;
+    int AravisLastEventTime;
+    int AravisTriggerMissed;
+    int AravisTrigger;
+    int AravisTriggerCount;
+    int AravisTriggerPending;
+    int AravisTriggerSendTime;
+    int AravisTriggerLatency;
+    int AravisTriggerLatencyMean;
+    int AravisTriggerLatencyMin;
+    int AravisTriggerLatencyMax;
+    int AravisRingMode;
+    int AravisRingPreCount;
+    int AravisRingPostCount;
+    int AravisRingTrigger;
+    int AravisRingTriggerEvent;
+    int AravisRingFill;
+    int AravisRingPostRemaining;
+    int AravisRingFlushes;
+    int AravisThrottle;
+    int AravisThrottleMinFps;
+    int AravisThrottleFps;
+    int AravisThrottled;
+    int AravisBackpressure;
+    int AravisOverflowPolicy;
+    int AravisKeepNth;
+    int AravisDroppedNewest;
+    int AravisDroppedOldest;
+    int AravisDecimated;
+    int AravisRecord;
+    int AravisRecordFile;
+    int AravisRecordPreview;
+    int AravisRecordFrames;
+    int AravisRecordDropped;
+    int AravisRecordRate;
+    int AravisRecordBacklog;
+    int AravisRecordDirect;
+    int AravisShm;
+    int AravisShmName;
+    int AravisShmSlots;
+    int AravisShmFrames;
+    int AravisConnectTime;
+    int AravisAddress;
+    int AravisAsyncWrites;
+    int AravisCmdQueue;
+    int AravisCmdLatency;
+    int AravisCmdLatencyMax;
+    int AravisCmdWriteTime;
+    int AravisBlockReads;
+    int AravisSweepRoundTrips;
+    int AravisSweepBlocks;
+    int AravisSweepBlockFeatures;
+    int AravisSweepTime;
+    int AravisEnumRebuilds;
+    int AravisEnumCallbacks;
+    int AravisDepRefreshes;
+    int AravisDepRefreshTime;
+    int AravisStats;
+    int AravisStatsMin;
+    int AravisStatsMax;
+    int AravisStatsMean;
+    int AravisStatsSigma;
+    int AravisStatsSaturated;
+    int AravisStatsHistogram;
+    int AravisStatsTime;
+    int AravisAEMode;
+    int AravisAETarget;
+    int AravisAETolerance;
+    int AravisAERoiX;
+    int AravisAERoiY;
+    int AravisAERoiW;
+    int AravisAERoiH;
+    int AravisAEExposureMin;
+    int AravisAEExposureMax;
+    int AravisAEGainMin;
+    int AravisAEGainMax;
+    int AravisAEMaxStep;
+    int AravisAESettle;
+    int AravisAEState;
+    int AravisAEMeasured;
+    int AravisAEError;
+    int AravisAEFrames;
+    int AravisAEAdjustments;
+    int AravisCentroid;
+    int AravisCentroidRoiX;
+    int AravisCentroidRoiY;
+    int AravisCentroidRoiW;
+    int AravisCentroidRoiH;
+    int AravisCentroidThreshold;
+    int AravisCentroidX;
+    int AravisCentroidY;
+    int AravisCentroidSigmaX;
+    int AravisCentroidSigmaY;
+    int AravisCentroidTotal;
+    int AravisCentroidTime;
+    int AravisCentroidLatency;
+    int AravisCentroidLatencyMax;
+    int AravisTimingAttrs;
+    int AravisPreDark;
+    int AravisPreFlat;
+    int AravisPreFlipX;
+    int AravisPreFlipY;
+    int AravisPreDarkFile;
+    int AravisPreFlatFile;
+    int AravisPreLoadDark;
+    int AravisPreLoadFlat;
+    int AravisPreSaveDark;
+    int AravisPreSaveFlat;
+    int AravisPreCapture;
+    int AravisPreCaptureFrames;
+    int AravisPreCaptured;
+    int AravisPreMsg;
+    int AravisPreTime;
     int AravisReset;
     #define LAST_ARAVIS_CAMERA_PARAM AravisReset
-    int features[NFEATURES];
-    #define NUM_ARAVIS_CAMERA_PARAMS (&LAST_ARAVIS_CAMERA_PARAM - &FIRST_ARAVIS_CAMERA_PARAM + 1 + NFEATURES)
+    /* ARVx_ features are created by drvUserCreate, the parameter table grows to hold them */
+    #define NUM_ARAVIS_CAMERA_PARAMS (&LAST_ARAVIS_CAMERA_PARAM - &FIRST_ARAVIS_CAMERA_PARAM + 1)
 
 private:
     asynStatus allocBuffer();
-    asynStatus processBuffer(ArvBuffer *buffer);
+    asynStatus processBuffer(ArvBuffer *buffer, gint64 received, gint64 monotonic);
+    void resetStreamTuning();
+    void autoTuneStream();
+    asynStatus setChunks();
+    void freeChunks();
+    asynStatus setEvents();
+    void freeEvents();
+    void handleEvent(int eventId, guint64 timestamp);
+    asynStatus sendTrigger();
+    void resetTriggerStats();
+    void matchTrigger(NDArray *pRaw, gint64 received);
+    int holdFrame(NDArray *pRaw);
+    void flushRing();
+    void clearRing();
+    void throttleFrameRate();
+    asynStatus startRecording();
+    asynStatus stopRecording();
+    void reportRecording();
+    asynStatus setShm();
+    void buildFrameAttributes();
+    double computeStatistics(NDArray *pRaw, size_t nsamples, int bits, int shift);
+    void autoExposure(NDArray *pRaw, int width, int height, int samplesPerPixel, double fullScale, double frameMean);
+    void publishCentroid(NDArray *pRaw, int width, int height, gint64 received);
+    int preprocessStages();
+    void preprocessFrame(NDArray *pRaw, int width, int height, int stages, int shift);
+    void captureCalibration(NDArray *pRaw, int width, int height);
+    asynStatus loadCalibration(int flat);
+    asynStatus saveCalibration(int flat);
     asynStatus start();
     asynStatus stop();    
     asynStatus getBinning(int *binx, int *biny);
@@ -169,32 +575,176 @@ private:
     asynStatus setGeometry();
     asynStatus lookupColorMode(ArvPixelFormat fmt, int *colorMode, int *dataType, int *bayerFormat);
     asynStatus lookupPixelFormat(int colorMode, int dataType, int bayerFormat, ArvPixelFormat *fmt);
+    asynStatus writeFeature(int function, int isFloat, epicsFloat64 value);
+    asynStatus queueFeature(int function, int isFloat, epicsFloat64 value);
+    asynStatus executeFeature(struct feature_cmd *cmd);
+    void drainCommands();
+    void lockPort();
+    void unlockPort();
+    void deferWrite(int function, int isFloat, epicsFloat64 value);
+    void replayWrites();
+    asynStatus writeIntegerFeature(int function, epicsInt32 value);
+    asynStatus writeFloatFeature(int function, epicsFloat64 value);
     asynStatus setIntegerValue(const char *feature, epicsInt32 value, epicsInt32 *rbv);
     asynStatus setFloatValue(const char *feature, epicsFloat64 value, epicsFloat64 *rbv);
     asynStatus connectToCamera();
     asynStatus makeCameraObject();
     asynStatus makeStreamObject();
+    asynStatus setStreamProperties();
+    asynStatus getTransport();
+    asynStatus setTransport();
+    void updateBandwidth();
+    void applyBandwidthShare(int force);
+    asynStatus reportStatistics();
     asynStatus getAllFeatures();
+    struct aravis_feature *findFeature(int reason);
+    struct aravis_feature *addFeature(int reason, const char *featureName, asynParamType type);
+    void bindFeature(struct aravis_feature *feature);
+    void bindFeatures();
+    void addDependencies(struct aravis_feature *feature, ArvGcNode *node, GHashTable *visited, int depth);
+    void buildDependencies();
+    void refreshDependents(ArvGcNode * const *written, int nWritten, struct aravis_feature *skip);
+    void refreshDependents(const char * const *featureNames, int nNames);
+    void invalidateEnums(ArvGcNode *written);
+    void invalidateEnums(const char *featureName);
+    asynStatus getFeature(struct aravis_feature *feature);
     asynStatus getNextFeature();
+    int refreshEnumChoices(struct aravis_feature *feature);
+    void freeEnumChoices(struct aravis_feature *feature);
+    void updateEnumChoices(struct aravis_feature *feature);
+    asynStatus setFloatFeatureParam(int index, epicsFloat64 floatValue);
+    asynStatus setIntegerFeatureParam(int index, epicsInt32 integerValue);
+    int resolveRegister(ArvGcNode *node, struct block_reg *reg);
+    void planBlocks();
+    void freeBlocks();
+    asynStatus readBlocks();
+    void setBlockFeature(struct block_reg *reg, const guint8 *data);
     int hasEnumString(const char* feature, const char *value);
     gboolean hasFeature(const char *feature);
-    asynStatus tryAddFeature(int *ADIdx, const char *featureString);
+    asynStatus tryAddFeature(int reason, const char *featureString);
 
     ArvStream *stream;
     ArvDevice *device;
     ArvGc *genicam;
     char *cameraName;
-    GHashTable* featureLookup;
-    GList *featureKeys;
-    unsigned int featureIndex;
+    /* camera features indexed by asyn reason, NULL where a parameter isn't a feature */
+    GPtrArray *featureByReason;
+    /* the same features in the order they were registered, for polling */
+    GPtrArray *featureList;
+    unsigned int pollIndex;
+    int polling;
+    int nEnumRebuilds, nEnumCallbacks;
+    /* registered features that depend on each genicam node, built from its p* references */
+    GHashTable *dependents;
+    int dependencyValid;
+    unsigned int refreshGeneration;
+    /* polled features grouped into block reads, rebuilt when the feature set changes */
+    struct block_reg *blockRegs;
+    int nBlockRegs;
+    struct block_read *blocks;
+    int nBlocks;
+    int blockPlanValid;
+    guint8 blockData[BLOCK_MAX];
+    /* round trips and time for the current polling sweep */
+    int sweepRoundTrips, sweepBlocks, sweepBlockFeatures;
+    epicsTimeStamp sweepStart;
     int payload;
+    aravisBandwidthClient *bandwidth;
+    unsigned bandwidthGeneration;
+    /* stream auto-tuning window */
+    int tuneFrames;
+    double tuneCompletionSum, tuneCompletionMax;
+    guint64 tuneResent, tuneMissing, tuneFailures;
+    epicsTimeStamp lastTune;
+    /* chunk data parsing */
+    ArvChunkParser *chunkParser;
+    struct chunk_lookup chunks[NCHUNKS];
+    int nChunks;
+    /* message channel events */
+    SOCKET eventSocket;
+    struct event_lookup events[NEVENTS];
+    int nEvents;
+    int lastEventReqId;
+    /* software trigger, resolved once per connection */
+    ArvGcNode *triggerNode;
+    gint64 triggerTimes[NTRIGGERS];
+    int triggerHead, triggerTail;
+    int triggerMatched;
+    double triggerLatencySum;
+    /* pre-trigger ring of frames held back from the plugins */
+    NDArray *ring[NRING];
+    int ringHead, ringFill;
+    /* backpressure frame rate throttle, throttleRequested is 0 when not throttling */
+    double throttleRequested;
+    size_t throttleDropped;
+    epicsTimeStamp lastThrottle;
+    /* rate to go back to once the bandwidth share allows it, 0 when not limited */
+    double paceRequested;
+    /* direct to disk recording */
+    aravisRecorder *recorder;
+    int recordPreviewCount;
+    /* shared memory export */
+    aravisShmWriter *shm;
+    /* feature writes waiting for the command thread */
+    epicsMessageQueueId cmdQId;
+    epicsEventId cmdEvent;
+    /* serialises genicam and GVCP access, taken before the port lock by lock() */
+    epicsMutexId deviceLock;
+    /* camera opened by the connect thread for connectToCamera to pick up, and when it started */
+    ArvCamera *openedCamera;
+    epicsTimeStamp connectStart;
+    /* set until the connect thread has finished, writes made before then are kept to replay */
+    int connecting;
+    GList *pendingWrites;
+    /* attributes we add to every frame, and to frames that carry chunk data */
+    NDAttributeList *frameAttributes, *chunkAttributes;
+    NDAttribute *attrBayerPattern, *attrColorMode, *attrFrameId;
+    /* full resolution histogram the statistics kernel counts into */
+    uint32_t *statsWork;
+    /* auto-exposure: frames still exposed with old settings, frames since it left its target */
+    int aeSettle, aeFrames, aeState;
+    /* calibration frames for the preprocessing pipeline, and the two lines it works through */
+    aravisCalibration darkCal, flatCal;
+    int preCapture, preCaptureStarted, preApplied;
+    void *preScratch;
+    size_t preScratchSize;
     epicsThread pollingLoop;
 };
 
+/** Attributes the in-driver statistics add to every frame */
+#define NSTATS_ATTRS 5
+static const struct {
+    const char *name;
+    const char *description;
+    NDAttrDataType_t type;
+} statsAttrs[NSTATS_ATTRS] = {
+    {"StatsMin",       "Minimum pixel value",            NDAttrFloat64},
+    {"StatsMax",       "Maximum pixel value",            NDAttrFloat64},
+    {"StatsMean",      "Mean pixel value",               NDAttrFloat64},
+    {"StatsSigma",     "Pixel value standard deviation", NDAttrFloat64},
+    {"StatsSaturated", "Saturated pixels",               NDAttrFloat64},
+};
+
+/** Attributes that record where each frame spent its time, all times are us */
+#define NTIMING_ATTRS 5
+static const struct {
+    const char *name;
+    const char *description;
+    NDAttrDataType_t type;
+} timingAttrs[NTIMING_ATTRS] = {
+    {"CameraTimestamp", "Camera time stamp, camera ticks (ns)",          NDAttrInt64},
+    {"HostReceiveTime", "Host monotonic time the frame completed",       NDAttrInt64},
+    {"QueueWait",       "Frame completed to processing started",         NDAttrFloat64},
+    {"ProcessTime",     "Processing started to plugin callbacks",        NDAttrFloat64},
+    {"CallbackStart",   "Host monotonic time of the plugin callbacks",   NDAttrInt64},
+};
+
 /** Called by epicsAtExit to shutdown camera */
 static void aravisShutdown(void* arg) {
     aravisCamera *pPvt = (aravisCamera *) arg;
     ArvCamera *cam = pPvt->camera;
+    /* Still connecting */
+    if (cam == NULL) return;
     printf("aravisCamera: Stopping %s... ", pPvt->portName);
     arv_camera_stop_acquisition(cam);
     pPvt->connectionValid = 0;
@@ -216,35 +766,74 @@ static void destroyBuffer(gpointer data){
 /** Called by aravis when a new buffer is produced */
 static void newBufferCallback (ArvStream *stream, aravisCamera *pPvt) {
     ArvBuffer *buffer;
+    struct frame_msg msg;
     int status;
-    static int  nConsecutiveBadFrames   = 0;
     buffer = arv_stream_try_pop_buffer(stream);
     if (buffer == NULL)    return;
+
+    /* Every buffer, good or bad, carries its block ID, so any gap is a frame that never arrived */
+    guint32 frameId = arv_buffer_get_frame_id(buffer);
+    ARAVIS_TRACE3(buffer_enter, pPvt->portName, frameId, (int) arv_buffer_get_status(buffer));
+    if (pPvt->frameIdValid) {
+        unsigned int gap = frameIdGap(pPvt->lastFrameId, frameId, pPvt->isGigE);
+        if (gap) {
+            epicsAtomicAddSizeT(&pPvt->nDroppedWire, gap);
+            epicsAtomicSetIntT(&pPvt->lastMissingId, (int) (frameId > 1 ? frameId - 1 : 65535));
+        }
+    }
+    pPvt->lastFrameId = frameId;
+    pPvt->frameIdValid = 1;
+
+    /* This runs on the aravis stream thread, so only count here; logTask does the printing */
     ArvBufferStatus buffer_status = arv_buffer_get_status(buffer);
     if (buffer_status == ARV_BUFFER_STATUS_SUCCESS /*|| buffer->status == ARV_BUFFER_STATUS_MISSING_PACKETS*/) {
-        nConsecutiveBadFrames = 0;
+        msg.buffer = buffer;
+        msg.received = g_get_real_time();
+        msg.monotonic = g_get_monotonic_time();
+        int policy = epicsAtomicGetIntT(&pPvt->overflowPolicy);
+        if (policy == ARAVIS_OVERFLOW_KEEP_NTH && epicsMessageQueuePending(pPvt->msgQId) >= NRAW / 2) {
+            /* The queue is filling up, so thin the frames out rather than lose a run of them */
+            int nth = epicsAtomicGetIntT(&pPvt->keepNth);
+            if (nth > 1 && (pPvt->overflowSeq++ % nth) != 0) {
+                epicsAtomicIncrSizeT(&pPvt->nDecimated);
+                epicsAtomicIncrSizeT(&pPvt->nDroppedQueue);
+                arv_stream_push_buffer (stream, buffer);
+                ARAVIS_TRACE3(queue_drop, pPvt->portName, frameId, ARAVIS_OVERFLOW_KEEP_NTH);
+                ARAVIS_TRACE2(buffer_exit, pPvt->portName, frameId);
+                return;
+            }
+        } else {
+            pPvt->overflowSeq = 0;
+        }
         status = epicsMessageQueueTrySend(pPvt->msgQId,
-                &buffer,
-                sizeof(&buffer));
+                &msg,
+                sizeof(msg));
+        if (status && policy == ARAVIS_OVERFLOW_DROP_OLDEST) {
+            /* Make room by giving the oldest queued frame back to the stream */
+            struct frame_msg oldest;
+            if (epicsMessageQueueTryReceive(pPvt->msgQId, &oldest, sizeof(oldest)) == (int) sizeof(oldest)) {
+                arv_stream_push_buffer (stream, oldest.buffer);
+                ARAVIS_TRACE3(queue_drop, pPvt->portName, arv_buffer_get_frame_id(oldest.buffer),
+                              ARAVIS_OVERFLOW_DROP_OLDEST);
+                epicsAtomicIncrSizeT(&pPvt->nDroppedOldest);
+                epicsAtomicIncrSizeT(&pPvt->nDroppedQueue);
+                status = epicsMessageQueueTrySend(pPvt->msgQId, &msg, sizeof(msg));
+            }
+        }
         if (status) {
-            // printf as pPvt->pasynUserSelf for asynPrint is protected
-            printf("Message queue full, dropped buffer\n");
+            epicsAtomicIncrSizeT(&pPvt->nDroppedNewest);
+            epicsAtomicIncrSizeT(&pPvt->nDroppedQueue);
             arv_stream_push_buffer (stream, buffer);
+            ARAVIS_TRACE3(queue_drop, pPvt->portName, frameId, ARAVIS_OVERFLOW_DROP_NEWEST);
+        } else {
+            ARAVIS_TRACE3(queue_send, pPvt->portName, frameId, epicsMessageQueuePending(pPvt->msgQId));
         }
     } else {
-        // printf as pPvt->pasynUserSelf for asynPrint is protected
         arv_stream_push_buffer (stream, buffer);
-
-        nConsecutiveBadFrames++;
-        if ( nConsecutiveBadFrames < 10 )
-            printf("Bad frame status: %s\n", ArvBufferStatusToString(buffer_status) );
-        else if ( ((nConsecutiveBadFrames-10) % 1000) == 0 ) {
-            static int  nBadFramesPrior = 0;
-            printf("Bad frame status: %s, %d msgs suppressed.\n", ArvBufferStatusToString(buffer_status),
-                    nConsecutiveBadFrames - nBadFramesPrior );
-            nBadFramesPrior = nConsecutiveBadFrames;
-        }
+        epicsAtomicSetIntT(&pPvt->lastBadStatus, (int) buffer_status);
+        epicsAtomicIncrSizeT(&pPvt->nBadFrames);
     }
+    ARAVIS_TRACE2(buffer_exit, pPvt->portName, frameId);
 }
 
 /** Called by aravis when control signal is lost */
@@ -252,6 +841,30 @@ static void controlLostCallback(ArvDevice *device, aravisCamera *pPvt) {
     pPvt->connectionValid = 0;
 }
 
+/** Thread function that listens on the message channel */
+static void eventTaskC(void *drvPvt) {
+    aravisCamera *pPvt = (aravisCamera *) drvPvt;
+    pPvt->eventTask();
+}
+
+/** Thread function that runs queued feature writes */
+static void commandTaskC(void *drvPvt) {
+    aravisCamera *pPvt = (aravisCamera *) drvPvt;
+    pPvt->commandTask();
+}
+
+/** Thread function that connects to the camera */
+static void connectTaskC(void *drvPvt) {
+    aravisCamera *pPvt = (aravisCamera *) drvPvt;
+    pPvt->connectTask();
+}
+
+/** Thread function that reports dropped frames */
+static void logTaskC(void *drvPvt) {
+    aravisCamera *pPvt = (aravisCamera *) drvPvt;
+    pPvt->logTask();
+}
+
 /** Init hook that sets iocRunning flag */
 static void setIocRunningFlag(initHookState state) {
     switch(state) {
@@ -267,7 +880,8 @@ static void setIocRunningFlag(initHookState state) {
   * After calling the base class constructor this method creates a thread to compute the GigE detector data,
   * and sets reasonable default values for parameters defined in this class, asynNDArrayDriver and ADDriver.
   * \param[in] portName The name of the asyn port driver to be created.
-  * \param[in] cameraName The name of the camera, \<vendor\>-\<serial#\>, as returned by arv-show-devices
+  * \param[in] cameraName The name of the camera, \<vendor\>-\<serial#\>, as returned by arv-show-devices,
+  *            or its IP address to connect directly without discovery
   * \param[in] maxBuffers The maximum number of NDArray buffers that the NDArrayPool for this driver is
   *            allowed to allocate. Set this to -1 to allow an unlimited number of buffers.
   * \param[in] maxMemory The maximum amount of memory that the NDArrayPool for this driver is
@@ -284,11 +898,83 @@ aravisCamera::aravisCamera(const char *portName, const char *cameraName,
                priority, stackSize),
        camera(NULL),
        connectionValid(0),
+       isGigE(0),
+       frameIdValid(0),
+       lastFrameId(0),
+       lastMissingId(0),
+       nDroppedWire(0),
+       nDroppedQueue(0),
+       nBadFrames(0),
+       nDroppedNewest(0),
+       nDroppedOldest(0),
+       nDecimated(0),
+       lastBadStatus(ARV_BUFFER_STATUS_SUCCESS),
+       overflowPolicy(ARAVIS_OVERFLOW_DROP_NEWEST),
+       keepNth(2),
+       overflowSeq(0),
        stream(NULL),
        device(NULL),
        genicam(NULL),
-       featureKeys(NULL),
+       pollIndex(0),
+       polling(0),
+       nEnumRebuilds(0),
+       nEnumCallbacks(0),
+       dependents(NULL),
+       dependencyValid(0),
+       refreshGeneration(0),
+       blockRegs(NULL),
+       nBlockRegs(0),
+       blocks(NULL),
+       nBlocks(0),
+       blockPlanValid(0),
+       sweepRoundTrips(0),
+       sweepBlocks(0),
+       sweepBlockFeatures(0),
        payload(0),
+       bandwidth(NULL),
+       bandwidthGeneration(0),
+       tuneFrames(0),
+       tuneCompletionSum(0),
+       tuneCompletionMax(0),
+       tuneResent(0),
+       tuneMissing(0),
+       tuneFailures(0),
+       chunkParser(NULL),
+       nChunks(0),
+       eventSocket(INVALID_SOCKET),
+       nEvents(0),
+       lastEventReqId(-1),
+       triggerNode(NULL),
+       triggerHead(0),
+       triggerTail(0),
+       triggerMatched(0),
+       triggerLatencySum(0),
+       ringHead(0),
+       ringFill(0),
+       throttleRequested(0),
+       throttleDropped(0),
+       paceRequested(0),
+       recorder(NULL),
+       recordPreviewCount(0),
+       shm(NULL),
+       deviceLock(epicsMutexMustCreate()),
+       openedCamera(NULL),
+       connecting(1),
+       pendingWrites(NULL),
+       frameAttributes(NULL),
+       chunkAttributes(NULL),
+       attrBayerPattern(NULL),
+       attrColorMode(NULL),
+       attrFrameId(NULL),
+       statsWork(NULL),
+       aeSettle(0),
+       aeFrames(0),
+       aeState(ARAVIS_AE_STATE_OFF),
+       preCapture(ARAVIS_PRE_CAPTURE_NONE),
+       preCaptureStarted(0),
+       preApplied(0),
+       preScratch(NULL),
+       preScratchSize(0),
        pollingLoop(*this, "aravisPoll", stackSize, epicsThreadPriorityHigh)
 {
     const char *functionName = "aravisCamera";
@@ -299,16 +985,25 @@ aravisCamera::aravisCamera(const char *portName, const char *cameraName,
     /* Duplicate camera name so we can use it if we reconnect */
     this->cameraName = epicsStrDup(cameraName);
 
-    /* Create a lookup table from AD id to feature name string */
-    this->featureLookup = g_hash_table_new(g_int_hash, g_int_equal);
+    /* Create the registry of camera features */
+    this->featureByReason = g_ptr_array_new();
+    this->featureList = g_ptr_array_new();
 
     /* Create a message queue to hold completed frames */
-    this->msgQId = epicsMessageQueueCreate(NRAW, sizeof(ArvBuffer*));
+    this->msgQId = epicsMessageQueueCreate(NRAW, sizeof(struct frame_msg));
     if (!this->msgQId) {
         printf("%s:%s: epicsMessageQueueCreate failure\n", driverName, functionName);
         return;
     }
 
+    /* Create a message queue to hold feature writes for the command thread */
+    this->cmdQId = epicsMessageQueueCreate(NCOMMANDS, sizeof(struct feature_cmd));
+    if (!this->cmdQId) {
+        printf("%s:%s: epicsMessageQueueCreate failure\n", driverName, functionName);
+        return;
+    }
+    this->cmdEvent = epicsEventMustCreate(epicsEventEmpty);
+
     /* Create some custom parameters */
     createParam("ARAVIS_COMPLETED",      asynParamFloat64, &AravisCompleted);
     createParam("ARAVIS_FAILURES",       asynParamFloat64, &AravisFailures);
@@ -322,6 +1017,150 @@ aravisCamera::aravisCamera(const char *portName, const char *cameraName,
     createParam("ARAVIS_CONNECTION",     asynParamInt32,   &AravisConnection);
     createParam("ARAVIS_GETFEATURES",    asynParamInt32,   &AravisGetFeatures);
     createParam("ARAVIS_HWIMAGEMODE",    asynParamInt32,   &AravisHWImageMode);
+    createParam("ARAVIS_SOCKET_BUFFER",  asynParamInt32,   &AravisSocketBuffer);
+    createParam("ARAVIS_SOCKET_BUFFER_SIZE", asynParamInt32, &AravisSocketBufferSize);
+    createParam("ARAVIS_AUTO_PKT_SIZE",  asynParamInt32,   &AravisAutoPktSize);
+    createParam("ARAVIS_PKT_SIZE",       asynParamInt32,   &AravisPktSize);
+    createParam("ARAVIS_PKT_DELAY",      asynParamInt32,   &AravisPktDelay);
+    createParam("ARAVIS_BW_PACING",      asynParamInt32,   &AravisBwPacing);
+    createParam("ARAVIS_BW_LINK",        asynParamOctet,   &AravisBwLink);
+    createParam("ARAVIS_BW_BUDGET",      asynParamFloat64, &AravisBwBudget);
+    createParam("ARAVIS_BW_UTILISATION", asynParamFloat64, &AravisBwUtilisation);
+    createParam("ARAVIS_BW_ALLOCATED",   asynParamFloat64, &AravisBwAllocated);
+    createParam("ARAVIS_BW_FPS_MAX",     asynParamFloat64, &AravisBwFpsMax);
+    createParam("ARAVIS_BW_FRAME_DELAY", asynParamInt32,   &AravisBwFrameDelay);
+    createParam("ARAVIS_BW_LIMITED",     asynParamInt32,   &AravisBwLimited);
+    createParam("ARAVIS_AUTO_TUNE",      asynParamInt32,   &AravisAutoTune);
+    createParam("ARAVIS_PKT_TIMEOUT_MIN",asynParamInt32,   &AravisPktTimeoutMin);
+    createParam("ARAVIS_PKT_TIMEOUT_MAX",asynParamInt32,   &AravisPktTimeoutMax);
+    createParam("ARAVIS_FRAME_RETENTION_MIN", asynParamInt32, &AravisFrameRetentionMin);
+    createParam("ARAVIS_FRAME_RETENTION_MAX", asynParamInt32, &AravisFrameRetentionMax);
+    createParam("ARAVIS_FRAME_COMPLETION", asynParamFloat64, &AravisFrameCompletion);
+    createParam("ARAVIS_PKT_GAP",        asynParamFloat64, &AravisPktGap);
+    createParam("ARAVIS_AUTO_TUNE_MSG",  asynParamOctet,   &AravisAutoTuneMsg);
+    createParam("ARAVIS_CHUNK_MODE",     asynParamInt32,   &AravisChunkMode);
+    createParam("ARAVIS_CHUNKS",         asynParamOctet,   &AravisChunks);
+    createParam("ARAVIS_FRAME_ID",       asynParamInt32,   &AravisFrameId);
+    createParam("ARAVIS_DROPPED_WIRE",   asynParamInt32,   &AravisDroppedWire);
+    createParam("ARAVIS_DROPPED_QUEUE",  asynParamInt32,   &AravisDroppedQueue);
+    createParam("ARAVIS_BAD_FRAMES",     asynParamInt32,   &AravisBadFrames);
+    createParam("ARAVIS_LAST_MISSING_ID",asynParamInt32,   &AravisLastMissingId);
+    createParam("ARAVIS_EVENT_MODE",     asynParamInt32,   &AravisEventMode);
+    createParam("ARAVIS_EVENTS",         asynParamOctet,   &AravisEvents);
+    createParam("ARAVIS_EVENT_COUNT",    asynParamInt32,   &AravisEventCount);
+    createParam("ARAVIS_LAST_EVENT",     asynParamOctet,   &AravisLastEvent);
+    createParam("ARAVIS_LAST_EVENT_TIME",asynParamFloat64, &AravisLastEventTime);
+    createParam("ARAVIS_TRIGGER_MISSED", asynParamInt32,   &AravisTriggerMissed);
+    createParam("ARAVIS_TRIGGER",        asynParamInt32,   &AravisTrigger);
+    createParam("ARAVIS_TRIGGER_COUNT",  asynParamInt32,   &AravisTriggerCount);
+    createParam("ARAVIS_TRIGGER_PENDING",asynParamInt32,   &AravisTriggerPending);
+    createParam("ARAVIS_TRIGGER_SEND_TIME", asynParamFloat64, &AravisTriggerSendTime);
+    createParam("ARAVIS_TRIGGER_LATENCY",asynParamFloat64, &AravisTriggerLatency);
+    createParam("ARAVIS_TRIGGER_LATENCY_MEAN", asynParamFloat64, &AravisTriggerLatencyMean);
+    createParam("ARAVIS_TRIGGER_LATENCY_MIN",  asynParamFloat64, &AravisTriggerLatencyMin);
+    createParam("ARAVIS_TRIGGER_LATENCY_MAX",  asynParamFloat64, &AravisTriggerLatencyMax);
+    createParam("ARAVIS_RING_MODE",      asynParamInt32,   &AravisRingMode);
+    createParam("ARAVIS_RING_PRE_COUNT", asynParamInt32,   &AravisRingPreCount);
+    createParam("ARAVIS_RING_POST_COUNT",asynParamInt32,   &AravisRingPostCount);
+    createParam("ARAVIS_RING_TRIGGER",   asynParamInt32,   &AravisRingTrigger);
+    createParam("ARAVIS_RING_TRIGGER_EVENT", asynParamOctet, &AravisRingTriggerEvent);
+    createParam("ARAVIS_RING_FILL",      asynParamInt32,   &AravisRingFill);
+    createParam("ARAVIS_RING_POST_REMAINING", asynParamInt32, &AravisRingPostRemaining);
+    createParam("ARAVIS_RING_FLUSHES",   asynParamInt32,   &AravisRingFlushes);
+    createParam("ARAVIS_THROTTLE",       asynParamInt32,   &AravisThrottle);
+    createParam("ARAVIS_THROTTLE_MIN_FPS", asynParamFloat64, &AravisThrottleMinFps);
+    createParam("ARAVIS_THROTTLE_FPS",   asynParamFloat64, &AravisThrottleFps);
+    createParam("ARAVIS_THROTTLED",      asynParamInt32,   &AravisThrottled);
+    createParam("ARAVIS_BACKPRESSURE",   asynParamFloat64, &AravisBackpressure);
+    createParam("ARAVIS_OVERFLOW_POLICY",asynParamInt32,   &AravisOverflowPolicy);
+    createParam("ARAVIS_KEEP_NTH",       asynParamInt32,   &AravisKeepNth);
+    createParam("ARAVIS_DROPPED_NEWEST", asynParamInt32,   &AravisDroppedNewest);
+    createParam("ARAVIS_DROPPED_OLDEST", asynParamInt32,   &AravisDroppedOldest);
+    createParam("ARAVIS_DECIMATED",      asynParamInt32,   &AravisDecimated);
+    createParam("ARAVIS_RECORD",         asynParamInt32,   &AravisRecord);
+    createParam("ARAVIS_RECORD_FILE",    asynParamOctet,   &AravisRecordFile);
+    createParam("ARAVIS_RECORD_PREVIEW", asynParamInt32,   &AravisRecordPreview);
+    createParam("ARAVIS_RECORD_FRAMES",  asynParamInt32,   &AravisRecordFrames);
+    createParam("ARAVIS_RECORD_DROPPED", asynParamInt32,   &AravisRecordDropped);
+    createParam("ARAVIS_RECORD_RATE",    asynParamFloat64, &AravisRecordRate);
+    createParam("ARAVIS_RECORD_BACKLOG", asynParamFloat64, &AravisRecordBacklog);
+    createParam("ARAVIS_RECORD_DIRECT",  asynParamInt32,   &AravisRecordDirect);
+    createParam("ARAVIS_SHM",            asynParamInt32,   &AravisShm);
+    createParam("ARAVIS_SHM_NAME",       asynParamOctet,   &AravisShmName);
+    createParam("ARAVIS_SHM_SLOTS",      asynParamInt32,   &AravisShmSlots);
+    createParam("ARAVIS_SHM_FRAMES",     asynParamInt32,   &AravisShmFrames);
+    createParam("ARAVIS_CONNECT_TIME",   asynParamFloat64, &AravisConnectTime);
+    createParam("ARAVIS_ADDRESS",        asynParamOctet,   &AravisAddress);
+    createParam("ARAVIS_ASYNC_WRITES",   asynParamInt32,   &AravisAsyncWrites);
+    createParam("ARAVIS_CMD_QUEUE",      asynParamInt32,   &AravisCmdQueue);
+    createParam("ARAVIS_CMD_LATENCY",    asynParamFloat64, &AravisCmdLatency);
+    createParam("ARAVIS_CMD_LATENCY_MAX", asynParamFloat64, &AravisCmdLatencyMax);
+    createParam("ARAVIS_CMD_WRITE_TIME", asynParamFloat64, &AravisCmdWriteTime);
+    createParam("ARAVIS_BLOCK_READS",    asynParamInt32,   &AravisBlockReads);
+    createParam("ARAVIS_SWEEP_ROUND_TRIPS", asynParamInt32, &AravisSweepRoundTrips);
+    createParam("ARAVIS_SWEEP_BLOCKS",   asynParamInt32,   &AravisSweepBlocks);
+    createParam("ARAVIS_SWEEP_BLOCK_FEATURES", asynParamInt32, &AravisSweepBlockFeatures);
+    createParam("ARAVIS_SWEEP_TIME",     asynParamFloat64, &AravisSweepTime);
+    createParam("ARAVIS_ENUM_REBUILDS",  asynParamInt32,   &AravisEnumRebuilds);
+    createParam("ARAVIS_ENUM_CALLBACKS", asynParamInt32,   &AravisEnumCallbacks);
+    createParam("ARAVIS_DEP_REFRESHES",  asynParamInt32,   &AravisDepRefreshes);
+    createParam("ARAVIS_DEP_REFRESH_TIME", asynParamFloat64, &AravisDepRefreshTime);
+    createParam("ARAVIS_STATS",          asynParamInt32,   &AravisStats);
+    createParam("ARAVIS_STATS_MIN",      asynParamFloat64, &AravisStatsMin);
+    createParam("ARAVIS_STATS_MAX",      asynParamFloat64, &AravisStatsMax);
+    createParam("ARAVIS_STATS_MEAN",     asynParamFloat64, &AravisStatsMean);
+    createParam("ARAVIS_STATS_SIGMA",    asynParamFloat64, &AravisStatsSigma);
+    createParam("ARAVIS_STATS_SATURATED", asynParamInt32,  &AravisStatsSaturated);
+    createParam("ARAVIS_STATS_HISTOGRAM", asynParamInt32Array, &AravisStatsHistogram);
+    createParam("ARAVIS_STATS_TIME",     asynParamFloat64, &AravisStatsTime);
+    createParam("ARAVIS_AE_MODE",        asynParamInt32,   &AravisAEMode);
+    createParam("ARAVIS_AE_TARGET",      asynParamFloat64, &AravisAETarget);
+    createParam("ARAVIS_AE_TOLERANCE",   asynParamFloat64, &AravisAETolerance);
+    createParam("ARAVIS_AE_ROI_X",       asynParamInt32,   &AravisAERoiX);
+    createParam("ARAVIS_AE_ROI_Y",       asynParamInt32,   &AravisAERoiY);
+    createParam("ARAVIS_AE_ROI_W",       asynParamInt32,   &AravisAERoiW);
+    createParam("ARAVIS_AE_ROI_H",       asynParamInt32,   &AravisAERoiH);
+    createParam("ARAVIS_AE_EXPOSURE_MIN", asynParamFloat64, &AravisAEExposureMin);
+    createParam("ARAVIS_AE_EXPOSURE_MAX", asynParamFloat64, &AravisAEExposureMax);
+    createParam("ARAVIS_AE_GAIN_MIN",    asynParamFloat64, &AravisAEGainMin);
+    createParam("ARAVIS_AE_GAIN_MAX",    asynParamFloat64, &AravisAEGainMax);
+    createParam("ARAVIS_AE_MAX_STEP",    asynParamFloat64, &AravisAEMaxStep);
+    createParam("ARAVIS_AE_SETTLE",      asynParamInt32,   &AravisAESettle);
+    createParam("ARAVIS_AE_STATE",       asynParamInt32,   &AravisAEState);
+    createParam("ARAVIS_AE_MEASURED",    asynParamFloat64, &AravisAEMeasured);
+    createParam("ARAVIS_AE_ERROR",       asynParamFloat64, &AravisAEError);
+    createParam("ARAVIS_AE_FRAMES",      asynParamInt32,   &AravisAEFrames);
+    createParam("ARAVIS_AE_ADJUSTMENTS", asynParamInt32,   &AravisAEAdjustments);
+    createParam("ARAVIS_CENTROID",       asynParamInt32,   &AravisCentroid);
+    createParam("ARAVIS_CENTROID_ROI_X", asynParamInt32,   &AravisCentroidRoiX);
+    createParam("ARAVIS_CENTROID_ROI_Y", asynParamInt32,   &AravisCentroidRoiY);
+    createParam("ARAVIS_CENTROID_ROI_W", asynParamInt32,   &AravisCentroidRoiW);
+    createParam("ARAVIS_CENTROID_ROI_H", asynParamInt32,   &AravisCentroidRoiH);
+    createParam("ARAVIS_CENTROID_THRESHOLD", asynParamFloat64, &AravisCentroidThreshold);
+    createParam("ARAVIS_CENTROID_X",     asynParamFloat64, &AravisCentroidX);
+    createParam("ARAVIS_CENTROID_Y",     asynParamFloat64, &AravisCentroidY);
+    createParam("ARAVIS_CENTROID_SIGMA_X", asynParamFloat64, &AravisCentroidSigmaX);
+    createParam("ARAVIS_CENTROID_SIGMA_Y", asynParamFloat64, &AravisCentroidSigmaY);
+    createParam("ARAVIS_CENTROID_TOTAL", asynParamFloat64, &AravisCentroidTotal);
+    createParam("ARAVIS_CENTROID_TIME",  asynParamFloat64, &AravisCentroidTime);
+    createParam("ARAVIS_CENTROID_LATENCY", asynParamFloat64, &AravisCentroidLatency);
+    createParam("ARAVIS_CENTROID_LATENCY_MAX", asynParamFloat64, &AravisCentroidLatencyMax);
+    createParam("ARAVIS_TIMING_ATTRS",   asynParamInt32,   &AravisTimingAttrs);
+    createParam("ARAVIS_PRE_DARK",       asynParamInt32,   &AravisPreDark);
+    createParam("ARAVIS_PRE_FLAT",       asynParamInt32,   &AravisPreFlat);
+    createParam("ARAVIS_PRE_FLIP_X",     asynParamInt32,   &AravisPreFlipX);
+    createParam("ARAVIS_PRE_FLIP_Y",     asynParamInt32,   &AravisPreFlipY);
+    createParam("ARAVIS_PRE_DARK_FILE",  asynParamOctet,   &AravisPreDarkFile);
+    createParam("ARAVIS_PRE_FLAT_FILE",  asynParamOctet,   &AravisPreFlatFile);
+    createParam("ARAVIS_PRE_LOAD_DARK",  asynParamInt32,   &AravisPreLoadDark);
+    createParam("ARAVIS_PRE_LOAD_FLAT",  asynParamInt32,   &AravisPreLoadFlat);
+    createParam("ARAVIS_PRE_SAVE_DARK",  asynParamInt32,   &AravisPreSaveDark);
+    createParam("ARAVIS_PRE_SAVE_FLAT",  asynParamInt32,   &AravisPreSaveFlat);
+    createParam("ARAVIS_PRE_CAPTURE",    asynParamInt32,   &AravisPreCapture);
+    createParam("ARAVIS_PRE_CAPTURE_FRAMES", asynParamInt32, &AravisPreCaptureFrames);
+    createParam("ARAVIS_PRE_CAPTURED",   asynParamInt32,   &AravisPreCaptured);
+    createParam("ARAVIS_PRE_MSG",        asynParamOctet,   &AravisPreMsg);
+    createParam("ARAVIS_PRE_TIME",       asynParamFloat64, &AravisPreTime);
     createParam("ARAVIS_RESET",          asynParamInt32,   &AravisReset);
 
     /* Set some initial values for other parameters */
@@ -341,17 +1180,198 @@ aravisCamera::aravisCamera(const char *portName, const char *cameraName,
     setIntegerParam(AravisResentPkts, 0);
     setIntegerParam(AravisLeftShift, 1);
     setIntegerParam(AravisHWImageMode, 0);
+    setIntegerParam(AravisSocketBuffer, ARV_GV_STREAM_SOCKET_BUFFER_AUTO);
+    setIntegerParam(AravisSocketBufferSize, 0);     // only used when socket buffer is fixed
+    setIntegerParam(AravisAutoPktSize, 1);
+    setIntegerParam(AravisPktSize, 1500);
+    setIntegerParam(AravisPktDelay, 0);
+    setIntegerParam(AravisBwPacing, 0);
+    setStringParam(AravisBwLink, "");
+    setDoubleParam(AravisBwBudget, 0);
+    setDoubleParam(AravisBwUtilisation, 0);
+    setDoubleParam(AravisBwAllocated, 0);
+    setDoubleParam(AravisBwFpsMax, 0);
+    setIntegerParam(AravisBwFrameDelay, 0);
+    setIntegerParam(AravisBwLimited, 0);
+    setIntegerParam(AravisAutoTune, 0);
+    setIntegerParam(AravisPktTimeoutMin, 1000);
+    setIntegerParam(AravisPktTimeoutMax, 100000);
+    setIntegerParam(AravisFrameRetentionMin, 10000);
+    setIntegerParam(AravisFrameRetentionMax, 1000000);
+    setDoubleParam(AravisFrameCompletion, 0);
+    setDoubleParam(AravisPktGap, 0);
+    setStringParam(AravisAutoTuneMsg, "");
+    setIntegerParam(AravisChunkMode, 0);
+    setStringParam(AravisChunks, "");
+    setIntegerParam(AravisFrameId, 0);
+    setIntegerParam(AravisDroppedWire, 0);
+    setIntegerParam(AravisDroppedQueue, 0);
+    setIntegerParam(AravisBadFrames, 0);
+    setIntegerParam(AravisLastMissingId, 0);
+    setIntegerParam(AravisEventMode, 0);
+    setStringParam(AravisEvents, "ExposureEnd,FrameTriggerMissed,AcquisitionEnd");
+    setIntegerParam(AravisEventCount, 0);
+    setStringParam(AravisLastEvent, "");
+    setDoubleParam(AravisLastEventTime, 0);
+    setIntegerParam(AravisTriggerMissed, 0);
+    setIntegerParam(AravisTrigger, 0);
+    setDoubleParam(AravisTriggerSendTime, 0);
+    this->resetTriggerStats();
+    setIntegerParam(AravisRingMode, 0);
+    setIntegerParam(AravisRingPreCount, 100);
+    setIntegerParam(AravisRingPostCount, 100);
+    setIntegerParam(AravisRingTrigger, 0);
+    setStringParam(AravisRingTriggerEvent, "");
+    setIntegerParam(AravisRingFill, 0);
+    setIntegerParam(AravisRingPostRemaining, 0);
+    setIntegerParam(AravisRingFlushes, 0);
+    setIntegerParam(AravisThrottle, 0);
+    setDoubleParam(AravisThrottleMinFps, 1.0);
+    setDoubleParam(AravisThrottleFps, 0);
+    setIntegerParam(AravisThrottled, 0);
+    setDoubleParam(AravisBackpressure, 0);
+    setIntegerParam(AravisOverflowPolicy, ARAVIS_OVERFLOW_DROP_NEWEST);
+    setIntegerParam(AravisKeepNth, 2);
+    setIntegerParam(AravisDroppedNewest, 0);
+    setIntegerParam(AravisDroppedOldest, 0);
+    setIntegerParam(AravisDecimated, 0);
+    setIntegerParam(AravisRecord, 0);
+    setStringParam(AravisRecordFile, "");
+    setIntegerParam(AravisRecordPreview, 10);
+    setIntegerParam(AravisRecordFrames, 0);
+    setIntegerParam(AravisRecordDropped, 0);
+    setDoubleParam(AravisRecordRate, 0);
+    setDoubleParam(AravisRecordBacklog, 0);
+    setIntegerParam(AravisRecordDirect, 0);
+    char shmName[64];
+    epicsSnprintf(shmName, sizeof(shmName), "/aravis_%s", portName);
+    setIntegerParam(AravisShm, 0);
+    setStringParam(AravisShmName, shmName);
+    setIntegerParam(AravisShmSlots, 8);
+    setIntegerParam(AravisShmFrames, 0);
+    this->buildFrameAttributes();
+    setDoubleParam(AravisConnectTime, 0);
+    setStringParam(AravisAddress, "");
+    setIntegerParam(AravisAsyncWrites, 0);
+    setIntegerParam(AravisCmdQueue, 0);
+    setDoubleParam(AravisCmdLatency, 0);
+    setDoubleParam(AravisCmdLatencyMax, 0);
+    setDoubleParam(AravisCmdWriteTime, 0);
+    setIntegerParam(AravisBlockReads, 1);
+    setIntegerParam(AravisSweepRoundTrips, 0);
+    setIntegerParam(AravisSweepBlocks, 0);
+    setIntegerParam(AravisSweepBlockFeatures, 0);
+    setDoubleParam(AravisSweepTime, 0);
+    setIntegerParam(AravisEnumRebuilds, 0);
+    setIntegerParam(AravisEnumCallbacks, 0);
+    setIntegerParam(AravisDepRefreshes, 0);
+    setDoubleParam(AravisDepRefreshTime, 0);
+    setIntegerParam(AravisStats, 0);
+    setDoubleParam(AravisStatsMin, 0);
+    setDoubleParam(AravisStatsMax, 0);
+    setDoubleParam(AravisStatsMean, 0);
+    setDoubleParam(AravisStatsSigma, 0);
+    setIntegerParam(AravisStatsSaturated, 0);
+    setDoubleParam(AravisStatsTime, 0);
+    setIntegerParam(AravisAEMode, ARAVIS_AE_OFF);
+    setDoubleParam(AravisAETarget, 50);
+    setDoubleParam(AravisAETolerance, 5);
+    setIntegerParam(AravisAERoiX, 0);
+    setIntegerParam(AravisAERoiY, 0);
+    setIntegerParam(AravisAERoiW, 0);
+    setIntegerParam(AravisAERoiH, 0);
+    setDoubleParam(AravisAEExposureMin, 0.00001);
+    setDoubleParam(AravisAEExposureMax, 0.1);
+    setDoubleParam(AravisAEGainMin, 0);
+    setDoubleParam(AravisAEGainMax, 20);
+    setDoubleParam(AravisAEMaxStep, 4);
+    setIntegerParam(AravisAESettle, 1);
+    setIntegerParam(AravisAEState, ARAVIS_AE_STATE_OFF);
+    setDoubleParam(AravisAEMeasured, 0);
+    setDoubleParam(AravisAEError, 0);
+    setIntegerParam(AravisAEFrames, 0);
+    setIntegerParam(AravisAEAdjustments, 0);
+    setIntegerParam(AravisCentroid, 0);
+    setIntegerParam(AravisCentroidRoiX, 0);
+    setIntegerParam(AravisCentroidRoiY, 0);
+    setIntegerParam(AravisCentroidRoiW, 0);
+    setIntegerParam(AravisCentroidRoiH, 0);
+    setDoubleParam(AravisCentroidThreshold, 0);
+    setDoubleParam(AravisCentroidX, 0);
+    setDoubleParam(AravisCentroidY, 0);
+    setDoubleParam(AravisCentroidSigmaX, 0);
+    setDoubleParam(AravisCentroidSigmaY, 0);
+    setDoubleParam(AravisCentroidTotal, 0);
+    setDoubleParam(AravisCentroidTime, 0);
+    setDoubleParam(AravisCentroidLatency, 0);
+    setDoubleParam(AravisCentroidLatencyMax, 0);
+    setIntegerParam(AravisTimingAttrs, 0);
+    setIntegerParam(AravisPreDark, 0);
+    setIntegerParam(AravisPreFlat, 0);
+    setIntegerParam(AravisPreFlipX, 0);
+    setIntegerParam(AravisPreFlipY, 0);
+    setStringParam(AravisPreDarkFile, "");
+    setStringParam(AravisPreFlatFile, "");
+    setIntegerParam(AravisPreCapture, ARAVIS_PRE_CAPTURE_NONE);
+    setIntegerParam(AravisPreCaptureFrames, 10);
+    setIntegerParam(AravisPreCaptured, 0);
+    setStringParam(AravisPreMsg, "");
+    setDoubleParam(AravisPreTime, 0);
+    memset(&this->darkCal, 0, sizeof(this->darkCal));
+    memset(&this->flatCal, 0, sizeof(this->flatCal));
     setIntegerParam(AravisReset, 0);
+    epicsTimeGetCurrent(&this->lastThrottle);
     
     /* Enable the fake camera for simulations */
     arv_enable_interface ("Fake");
 
-    /* Connect to the camera */
-    this->featureIndex = 0;
-    this->connectToCamera();
+    /* Open the socket that GigE cameras send events to. It is bound to any
+     * interface so that it survives reconnects, setEvents points the camera at it */
+    if (osiSockAttach()) {
+        osiSockAddr addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.ia.sin_family = AF_INET;
+        addr.ia.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.ia.sin_port = htons(0);
+        this->eventSocket = epicsSocketCreate(AF_INET, SOCK_DGRAM, 0);
+        if (this->eventSocket != INVALID_SOCKET &&
+                bind(this->eventSocket, &addr.sa, sizeof(addr.ia)) != 0) {
+            epicsSocketDestroy(this->eventSocket);
+            this->eventSocket = INVALID_SOCKET;
+        }
+    }
+    if (this->eventSocket == INVALID_SOCKET) {
+        printf("%s:%s: Unable to create event socket, events disabled\n", driverName, functionName);
+    }
+
+    /* Connect to the camera in the background, so that IOC boot doesn't wait for
+     * discovery and genicam download, and several cameras connect in parallel */
+    setIntegerParam(ADStatus, ADStatusInitializing);
+    setStringParam(ADStatusMessage, "Connecting");
+    epicsThreadCreate("aravisConnect", epicsThreadPriorityMedium,
+                      epicsThreadGetStackSize(epicsThreadStackBig),
+                      (EPICSTHREADFUNC) connectTaskC, this);
 
     /* Register the shutdown function for epicsAtExit */
     epicsAtExit(aravisShutdown, (void*)this);
+    cameras = g_list_append(cameras, this);
+
+    /* Report dropped frames from a thread that can afford to block on the console */
+    epicsThreadCreate("aravisLog", epicsThreadPriorityLow,
+                      epicsThreadGetStackSize(epicsThreadStackSmall),
+                      (EPICSTHREADFUNC) logTaskC, this);
+
+    /* Run feature writes off the record processing threads when asked to */
+    epicsThreadCreate("aravisCommand", epicsThreadPriorityMedium,
+                      epicsThreadGetStackSize(epicsThreadStackMedium),
+                      (EPICSTHREADFUNC) commandTaskC, this);
+
+    /* Listen for events */
+    if (this->eventSocket != INVALID_SOCKET) {
+        epicsThreadCreate("aravisEvent", epicsThreadPriorityHigh,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC) eventTaskC, this);
+    }
 
     /* Register the pollingLoop to start after iocInit */
     initHookRegister(setIocRunningFlag);
@@ -368,58 +1388,58 @@ asynStatus aravisCamera::drvUserCreate(asynUser *pasynUser, const char *drvInfo,
     // If parameter is of format ARVx_... where x is I for int, D for double, or S for string
     // then it is a camera parameter, so create it here
     if (findParam(drvInfo, &index) && strlen(drvInfo) > 5 && strncmp(drvInfo, "ARV", 3) == 0 && drvInfo[4] == '_') {
-        /* Check we have allocated enough space */
-        if (featureIndex > NFEATURES) {
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                        "%s:%s: Not enough space allocated to store all camera features, increase NFEATURES\n",
-                        driverName, functionName);
-            return asynError;
-        }
-        /* Check we have a feature */
-        if (!this->hasFeature(drvInfo+5)) {
+        /* The connect thread may be filling in the genicam and feature registry */
+        this->lock();
+        /* Check we have a feature, if the camera is still connecting then
+         * take it on trust and let connectToCamera fetch its value */
+        if (this->connectionValid == 1 && !this->hasFeature(drvInfo+5)) {
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                         "%s:%s: Parameter '%s' doesn't exist on camera\n",
                         driverName, functionName, drvInfo + 5);
+            this->unlock();
             return asynError;
         }
         /* Make parameter of the correct type and get initial value if camera is connected */
-        char *feature = epicsStrDup(drvInfo + 5);
+        const char *feature = drvInfo + 5;
         switch(drvInfo[3]) {
         case 'I':
-            createParam(drvInfo, asynParamInt32, &(this->features[featureIndex]));
+            createParam(drvInfo, asynParamInt32, &index);
             if (this->connectionValid == 1) {
-                ArvGcNode *featureNode = arv_device_get_feature(this->device, drvInfo + 5);
+                ArvGcNode *featureNode = arv_device_get_feature(this->device, feature);
                 int         curValue    = 0;
                 if (!ARV_IS_GC_COMMAND(featureNode)) {
                     curValue = arv_device_get_integer_feature_value(this->device, feature);
                 }
-                setIntegerParam(this->features[featureIndex], curValue);
+                setIntegerParam(index, curValue);
             }
+            this->addFeature(index, feature, asynParamInt32);
             break;
         case 'D':
-            createParam(drvInfo, asynParamFloat64, &(this->features[featureIndex]));
+            createParam(drvInfo, asynParamFloat64, &index);
             if (this->connectionValid == 1)
-                setDoubleParam(this->features[featureIndex], arv_device_get_float_feature_value(this->device, feature));
+                setDoubleParam(index, arv_device_get_float_feature_value(this->device, feature));
+            this->addFeature(index, feature, asynParamFloat64);
             break;
         case 'S':
-            createParam(drvInfo, asynParamOctet, &(this->features[featureIndex]));
+            createParam(drvInfo, asynParamOctet, &index);
             if (this->connectionValid == 1) {
                 const char *stringValue;
                 stringValue = arv_device_get_string_feature_value(this->device, feature);
                 if( stringValue == NULL )
                     stringValue = "(null)";
                 printf("aravisCamera: Adding feature %s with value: %s\n", feature, stringValue);
-                setStringParam(this->features[featureIndex], stringValue );
+                setStringParam(index, stringValue );
             }
+            this->addFeature(index, feature, asynParamOctet);
             break;
         default:
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                         "%s:%s: Expected ARVx_... where x is one of I, D or S. Got '%c'\n",
                         driverName, functionName, drvInfo[4]);
+            this->unlock();
             return asynError;
         }
-        g_hash_table_insert(this->featureLookup, (gpointer) &(this->features[featureIndex]), (gpointer) feature);
-        featureIndex++;
+        this->unlock();
     }
 
     // Now return baseclass result
@@ -433,13 +1453,19 @@ asynStatus aravisCamera::makeCameraObject() {
         g_object_unref(this->camera);
         this->camera = NULL;
     }
-    /* remove ref to device and genicam */
+    /* remove ref to device and genicam, and the feature nodes that belonged to them */
     this->device = NULL;
     this->genicam = NULL;
+    this->bindFeatures();
 
-    /* connect to camera */
-    printf ("aravisCamera: Looking for camera '%s'... \n", this->cameraName);
-    this->camera = arv_camera_new (this->cameraName);
+    /* connect to camera, unless the connect thread has already opened it */
+    if (this->openedCamera != NULL) {
+        this->camera = this->openedCamera;
+        this->openedCamera = NULL;
+    } else {
+        printf ("aravisCamera: Looking for camera '%s'... \n", this->cameraName);
+        this->camera = aravisDiscoveryOpen(this->cameraName);
+    }
     if (this->camera == NULL) {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                     "%s:%s: No camera found\n",
@@ -454,12 +1480,6 @@ asynStatus aravisCamera::makeCameraObject() {
                     driverName, functionName);
         return asynError;
     }
-    if (ARV_IS_GV_DEVICE(this->device)) {
-        // Automatically determine optimum packet size
-        arv_gv_device_auto_packet_size(ARV_GV_DEVICE(this->device));
-        // Uncomment this line to set jumbo packets
-        //arv_gv_device_set_packet_size(ARV_GV_DEVICE(this->device), 9000);
-    }
     /* Store genicam */
     this->genicam = arv_device_get_genicam (this->device);
     if (this->genicam == NULL) {
@@ -468,13 +1488,16 @@ asynStatus aravisCamera::makeCameraObject() {
                     driverName, functionName);
         return asynError;
     }
-    return asynSuccess;
+    this->bindFeatures();
+    /* Apply the packet size and inter-packet delay demands */
+    return this->setTransport();
 }
 
 asynStatus aravisCamera::makeStreamObject() {
     const char *functionName = "makeStreamObject";    
     asynStatus status = asynSuccess;
     
+    ARAVIS_TRACE1(stream_rebuild, this->portName);
     /* remove old stream if it exists */
     if (this->stream != NULL) {
         arv_stream_set_emit_signals (this->stream, FALSE);
@@ -500,8 +1523,23 @@ asynStatus aravisCamera::makeStreamObject() {
         return asynError;
     }
     
-    if (ARV_IS_GV_DEVICE(this->stream)) {
-        /* configure the stream */
+    /* configure the stream */
+    this->setStreamProperties();
+    this->resetStreamTuning();
+
+    // Enable callback on new buffers
+    arv_stream_set_emit_signals (this->stream, TRUE);
+    g_signal_connect (this->stream, "new-buffer", G_CALLBACK (newBufferCallback), this);
+    ARAVIS_TRACE1(stream_rebuild_done, this->portName);
+    return asynSuccess;
+}
+
+/** Push the stream tuning parameters to the stream object. The GigE stream
+    thread reads its properties on every frame, so this can be called on a live stream.
+    lock taken */
+asynStatus aravisCamera::setStreamProperties() {
+    if (this->stream == NULL) return asynError;
+    if (ARV_IS_GV_STREAM(this->stream)) {
         // Available stream options:
         //  socket-buffer:      ARV_GV_STREAM_SOCKET_BUFFER_FIXED, ARV_GV_STREAM_SOCKET_BUFFER_AUTO, defaults to auto which follows arvgvbuffer size
         //  socket-buffer-size: 64 bit int, Defaults to -1
@@ -509,175 +1547,1570 @@ asynStatus aravisCamera::makeStreamObject() {
         //  packet-timeout:     64 bit int, units us, ARV_GV_STREAM default 40000
         //  frame-retention:    64 bit int, units us, ARV_GV_STREAM default 200000
     
-        epicsInt32      FrameRetention, PktResend, PktTimeout;
+        epicsInt32      FrameRetention, PktResend, PktTimeout, SocketBuffer, SocketBufferSize;
         getIntegerParam(AravisFrameRetention,  &FrameRetention);
         getIntegerParam(AravisPktResend,       &PktResend);
         getIntegerParam(AravisPktTimeout,      &PktTimeout);
+        getIntegerParam(AravisSocketBuffer,    &SocketBuffer);
+        getIntegerParam(AravisSocketBufferSize,&SocketBufferSize);
+        /* a fixed socket buffer needs a size, so fall back to auto if we don't have one */
+        if (SocketBuffer == ARV_GV_STREAM_SOCKET_BUFFER_FIXED && SocketBufferSize <= 0)
+            SocketBuffer = ARV_GV_STREAM_SOCKET_BUFFER_AUTO;
         g_object_set (ARV_GV_STREAM (this->stream),
-                  "packet-resend",      (guint64) PktResend,
-                  "packet-timeout",     (guint64) PktTimeout,
-                  "frame-retention",    (guint64) FrameRetention,
+                  "packet-resend",      (ArvGvStreamPacketResend) PktResend,
+                  "packet-timeout",     (guint) PktTimeout,
+                  "frame-retention",    (guint) FrameRetention,
+                  "socket-buffer",      (ArvGvStreamSocketBuffer) SocketBuffer,
+                  "socket-buffer-size", (gint) SocketBufferSize,
+                  NULL);
+        /* read back what the stream thread will use */
+        guint streamTimeout, streamRetention;
+        g_object_get (ARV_GV_STREAM (this->stream),
+                  "packet-timeout",     &streamTimeout,
+                  "frame-retention",    &streamRetention,
                   NULL);
+        setIntegerParam(AravisPktTimeout,     (epicsInt32) streamTimeout);
+        setIntegerParam(AravisFrameRetention, (epicsInt32) streamRetention);
     }
-
-    // Enable callback on new buffers
-    arv_stream_set_emit_signals (this->stream, TRUE);
-    g_signal_connect (this->stream, "new-buffer", G_CALLBACK (newBufferCallback), this);
     return asynSuccess;
 }
 
+/** Forget the chunks we were parsing
+    lock taken */
+void aravisCamera::freeChunks() {
+    for (int i = 0; i < this->nChunks; i++) {
+        if (this->device != NULL && this->connectionValid == 1)
+            arv_camera_set_chunk_state(this->camera, this->chunks[i].name, FALSE);
+        free(this->chunks[i].name);
+        free(this->chunks[i].feature);
+    }
+    if (this->nChunks > 0) {
+        this->invalidateEnums("ChunkSelector");
+        this->invalidateEnums("ChunkEnable");
+    }
+    this->nChunks = 0;
+    if (this->chunkParser != NULL) {
+        g_object_unref(this->chunkParser);
+        this->chunkParser = NULL;
+    }
+}
 
-asynStatus aravisCamera::connectToCamera() {
-    const char *functionName = "connectToCamera";
-    int status = asynSuccess;
-    int w, h;
-    const char *vendor, *model, *deviceID, *firmwareVersion;
+/** Enable ChunkModeActive and the chunks listed in ARAVIS_CHUNKS, e.g.
+  * "ExposureTime,Gain,FrameID". Each chunk is resolved to its Chunk<name>
+  * feature once here, so processBuffer only has to read the values.
+  * The payload size changes, so acquisition is restarted if running.
+  * this->camera exists, lock taken */
+asynStatus aravisCamera::setChunks() {
+    const char *functionName = "setChunks";
+    asynStatus status = asynSuccess;
+    int chunkMode, acquiring;
+    char chunkList[256], *token, *save;
 
-    /* stop old camera if it exists */
-    this->connectionValid = 0;
-    if (this->camera != NULL) {
-        arv_camera_stop_acquisition(this->camera);
+    getIntegerParam(AravisChunkMode, &chunkMode);
+    getStringParam(AravisChunks, sizeof(chunkList), chunkList);
+
+    /* stop acquiring if we are acquiring */
+    getIntegerParam(ADAcquire, &acquiring);
+    if (acquiring) this->stop();
+
+    this->freeChunks();
+    if (!this->hasFeature("ChunkModeActive")) {
+        if (chunkMode) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: Camera does not support chunk data\n",
+                        driverName, functionName);
+            status = asynError;
+        }
+    } else {
+        arv_camera_set_chunk_mode(this->camera, chunkMode ? TRUE : FALSE);
     }
 
-    /* Tell areaDetector it is no longer acquiring */
-    setIntegerParam(ADAcquire, 0);
+    if (chunkMode && status == asynSuccess) {
+        for (token = epicsStrtok_r(chunkList, ", ", &save); token != NULL && this->nChunks < NCHUNKS;
+                token = epicsStrtok_r(NULL, ", ", &save)) {
+            char feature[128];
+            epicsSnprintf(feature, sizeof(feature), "Chunk%s", token);
+            ArvGcNode *node = arv_device_get_feature(this->device, feature);
+            if (node == NULL) {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                            "%s:%s: Camera has no chunk '%s'\n",
+                            driverName, functionName, token);
+                status = asynError;
+                continue;
+            }
+            arv_camera_set_chunk_state(this->camera, token, TRUE);
+            this->chunks[this->nChunks].name = epicsStrDup(token);
+            this->chunks[this->nChunks].feature = epicsStrDup(feature);
+            this->chunks[this->nChunks].isFloat =
+                arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(node)) == G_TYPE_DOUBLE;
+            this->nChunks++;
+        }
+        if (this->nChunks > 0) {
+            this->chunkParser = arv_camera_create_chunk_parser(this->camera);
+        }
+    }
+    this->buildFrameAttributes();
+    /* ChunkSelector and ChunkModeActive may have changed */
+    this->invalidateEnums("ChunkSelector");
+    this->invalidateEnums("ChunkEnable");
+    this->invalidateEnums("ChunkModeActive");
 
-    /* make the camera object */
-    status = this->makeCameraObject();
-    if (status) return (asynStatus) status;
+    /* Start camera again */
+    if (acquiring) this->start();
+    return status;
+}
 
-    /* Make sure it's stopped */
-    arv_camera_stop_acquisition(this->camera);
-    status |= setIntegerParam(ADStatus, ADStatusIdle);
-    
-    /* Check the tick frequency */
-    if (ARV_IS_GV_DEVICE(this->device)) {
-        guint64 freq = arv_gv_device_get_timestamp_tick_frequency(ARV_GV_DEVICE(this->device));
-        printf("aravisCamera: Your tick frequency is %" G_GUINT64_FORMAT "\n", freq);
-        if (freq > 0) {
-            printf("So your timestamp resolution is %f ns\n", 1.e9/freq);
-        } else {
-            printf("So your camera doesn't provide timestamps. Using system clock instead\n");
+/** Forget the events we were listening to
+    lock taken */
+void aravisCamera::freeEvents() {
+    for (int i = 0; i < this->nEvents; i++) {
+        if (this->device != NULL && this->connectionValid == 1) {
+            arv_device_set_string_feature_value(this->device, "EventSelector", this->events[i].name);
+            arv_device_set_string_feature_value(this->device, "EventNotification", "Off");
         }
+        free(this->events[i].name);
     }
-    
-    /* Make the stream */
-    status = this->makeStreamObject();
-    if (status) return (asynStatus) status;    
-    
-    /* connect connection lost signal to camera */
-    g_signal_connect (this->device, "control-lost", G_CALLBACK (controlLostCallback), this);
+    if (this->nEvents > 0) {
+        this->invalidateEnums("EventSelector");
+        this->invalidateEnums("EventNotification");
+    }
+    this->nEvents = 0;
+}
 
-    /* Set vendor and model number */
-    vendor = arv_camera_get_vendor_name(this->camera);
-    if (vendor) status |= setStringParam (ADManufacturer, vendor);
-    model = arv_camera_get_model_name(this->camera);
-    if (model) status |= setStringParam (ADModel, model);
-    deviceID = arv_camera_get_device_id(this->camera);
-    if (deviceID) status |= setStringParam (ADSerialNumber, deviceID);
-    firmwareVersion = arv_device_get_string_feature_value(this->device, "DeviceFirmwareVersion");
-    if (firmwareVersion) status |= setStringParam (ADFirmwareVersion, firmwareVersion);
+/** Point the GigE Vision message channel at our event socket and enable
+  * notification for the events listed in ARAVIS_EVENTS, e.g.
+  * "ExposureEnd,FrameTriggerMissed,AcquisitionEnd". Each event is resolved to
+  * the id the camera will send, from its Event<name> feature, once here.
+  * this->camera exists, lock taken */
+asynStatus aravisCamera::setEvents() {
+    const char *functionName = "setEvents";
+    asynStatus status = asynSuccess;
+    int eventMode;
+    char eventList[256], *token, *save;
 
-    /* Get sensor size */
-    arv_camera_get_sensor_size(this->camera, &w, &h);
-    status |= setIntegerParam(ADMaxSizeX, w);
-    status |= setIntegerParam(ADMaxSizeY, h);
+    getIntegerParam(AravisEventMode, &eventMode);
+    getStringParam(AravisEvents, sizeof(eventList), eventList);
 
-    /* Get geometry */
-    if(this->getGeometry()) {
-        /* If getting geometry failed, set some safe defaults */
-        setIntegerParam(ADBinX, 1);
-        setIntegerParam(ADBinY, 1);
-        setIntegerParam(NDColorMode, NDColorModeMono);
-        setIntegerParam(NDDataType, NDUInt8);
-        this->setGeometry();
+    this->freeEvents();
+    if (!ARV_IS_GV_DEVICE(this->device) || !this->hasFeature("EventSelector") ||
+            this->eventSocket == INVALID_SOCKET) {
+        if (eventMode) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: Camera does not support events\n",
+                        driverName, functionName);
+            status = asynError;
+        }
+        return status;
     }
 
-    /* Report if anything has failed */
-    if (status) {
+    if (!eventMode) {
+        /* Port 0 closes the message channel */
+        arv_device_write_register(this->device, GVBS_MCP, 0, NULL);
+        return status;
+    }
+
+    /* Tell the camera where to send events, the address is the interface it streams on */
+    GSocketAddress *ifAddress = arv_gv_device_get_interface_address(ARV_GV_DEVICE(this->device));
+    osiSockAddr addr;
+    osiSocklen_t addrLen = sizeof(addr);
+    if (ifAddress == NULL || getsockname(this->eventSocket, &addr.sa, &addrLen) != 0) {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s:%s: Unable to get all camera parameters\n",
+                    "%s:%s: Unable to find event socket address\n",
+                    driverName, functionName);
+        return asynError;
+    }
+    const guint8 *ip = g_inet_address_to_bytes(
+            g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(ifAddress)));
+    guint32 mcda = ((guint32) ip[0] << 24) | ((guint32) ip[1] << 16) | ((guint32) ip[2] << 8) | ip[3];
+    if (!arv_device_write_register(this->device, GVBS_MCDA, mcda, NULL) ||
+        !arv_device_write_register(this->device, GVBS_MCTT, 100, NULL) ||
+        !arv_device_write_register(this->device, GVBS_MCRC, 2, NULL) ||
+        !arv_device_write_register(this->device, GVBS_MCP, ntohs(addr.ia.sin_port), NULL)) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Unable to open message channel\n",
                     driverName, functionName);
+        return asynError;
     }
 
-    /* For Baumer cameras, AcquisitionFrameRate will not do anything until we set this
-     * NOTE: *no* d in AcquisitionFrameRateEnable */
-    if (this->hasFeature("AcquisitionFrameRateEnable")) {
-        arv_device_set_integer_feature_value (this->device, "AcquisitionFrameRateEnable", 1);
+    /* Older cameras call the notification GigEVision rather than On */
+    const char *notification = this->hasEnumString("EventNotification", "On") ? "On" : "GigEVision";
+    for (token = epicsStrtok_r(eventList, ", ", &save); token != NULL && this->nEvents < NEVENTS;
+            token = epicsStrtok_r(NULL, ", ", &save)) {
+        char feature[128];
+        epicsSnprintf(feature, sizeof(feature), "Event%s", token);
+        if (!this->hasFeature(feature) || !this->hasEnumString("EventSelector", token)) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: Camera has no event '%s'\n",
+                        driverName, functionName, token);
+            status = asynError;
+            continue;
+        }
+        arv_device_set_string_feature_value(this->device, "EventSelector", token);
+        arv_device_set_string_feature_value(this->device, "EventNotification", notification);
+        this->events[this->nEvents].name = epicsStrDup(token);
+        this->events[this->nEvents].id = (int) arv_device_get_integer_feature_value(this->device, feature);
+        this->nEvents++;
+        this->invalidateEnums("EventSelector");
+        this->invalidateEnums("EventNotification");
     }
+    return status;
+}
 
-    /* For Point Grey cameras, AcquisitionFrameRate will not do anything until we set this
-     * NOTE: there is a d in AcquisitionFrameRateEnabled */
-    if (this->hasFeature("AcquisitionFrameRateEnabled")) {
-        arv_device_set_integer_feature_value (this->device, "AcquisitionFrameRateEnabled", 1);
+/** Publish an event and refresh the features that depend on it
+    lock taken */
+void aravisCamera::handleEvent(int eventId, guint64 timestamp) {
+    const char *name = NULL;
+    int count;
+    for (int i = 0; i < this->nEvents; i++) {
+        if (this->events[i].id == eventId) {
+            name = this->events[i].name;
+            break;
+        }
+    }
+    if (name == NULL) return;
+
+    getIntegerParam(AravisEventCount, &count);
+    setIntegerParam(AravisEventCount, count + 1);
+    setStringParam(AravisLastEvent, name);
+    guint64 freq = arv_gv_device_get_timestamp_tick_frequency(ARV_GV_DEVICE(this->device));
+    setDoubleParam(AravisLastEventTime, freq > 0 ? (double) timestamp / freq : (double) timestamp);
+    if (strcmp(name, "FrameTriggerMissed") == 0) {
+        getIntegerParam(AravisTriggerMissed, &count);
+        setIntegerParam(AravisTriggerMissed, count + 1);
     }
-    /* Mark connection valid again */
-    this->connectionValid = 1;
-    printf("aravisCamera: Done.\n");
 
-    printf("aravisCamera: Getting feature list...\n");
-    /* Add gain lookup */
-    if (tryAddFeature(&ADGain, "Gain"))
-        if (tryAddFeature(&ADGain, "GainRaw"))
-            tryAddFeature(&ADGain, "GainRawChannelA");
+    /* A hardware input event can flush the pre-trigger ring */
+    char ringEvent[64];
+    getStringParam(AravisRingTriggerEvent, sizeof(ringEvent), ringEvent);
+    if (strcmp(name, ringEvent) == 0) this->flushRing();
+
+    /* Refresh any registered feature that this event invalidates */
+    size_t nameLen = strlen(name);
+    for (unsigned int i = 0; i < this->featureList->len; i++) {
+        struct aravis_feature *feature = (struct aravis_feature *) g_ptr_array_index(this->featureList, i);
+        const char *featureName = feature->name;
+        int depends = strncmp(featureName, "Event", 5) == 0 && strncmp(featureName + 5, name, nameLen) == 0;
+        for (unsigned int j = 0; !depends && j < sizeof(event_depends) / sizeof(event_depends[0]); j++) {
+            depends = strcmp(event_depends[j].event, name) == 0 && strcmp(event_depends[j].feature, featureName) == 0;
+        }
+        if (depends) this->getFeature(feature);
+    }
+}
 
-    /* Add exposure lookup */
-    if (tryAddFeature(&ADAcquireTime, "ExposureTime"))
-        tryAddFeature(&ADAcquireTime, "ExposureTimeAbs");
+/** Receive GVCP event packets from the message channel, acknowledge them
+  * straight away, and turn them into parameter updates */
+void aravisCamera::eventTask() {
+    unsigned char packet[576];
+    osiSockAddr from;
+    osiSocklen_t fromLen;
+    fd_set fds;
+    struct timeval timeout;
 
-    /* Add framerate lookup */
-    if (tryAddFeature(&ADAcquirePeriod, "AcquisitionFrameRate"))
-        tryAddFeature(&ADAcquirePeriod, "AcquisitionFrameRateAbs");
+    while (1) {
+        FD_ZERO(&fds);
+        FD_SET(this->eventSocket, &fds);
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 100000;
+        if (select((int) this->eventSocket + 1, &fds, NULL, NULL, &timeout) <= 0) continue;
+        fromLen = sizeof(from);
+        int len = recvfrom(this->eventSocket, (char *) packet, sizeof(packet), 0, &from.sa, &fromLen);
+        /* GVCP header is key 0x42, flags, command, length, req_id */
+        if (len < 8 || packet[0] != 0x42) continue;
+        int flags = packet[1];
+        int command = (packet[2] << 8) | packet[3];
+        int length = (packet[4] << 8) | packet[5];
+        int reqId = (packet[6] << 8) | packet[7];
+        if (command != GVCP_EVENT_CMD && command != GVCP_EVENTDATA_CMD) continue;
+
+        /* Acknowledge before doing anything slow so the camera does not resend */
+        if (flags & GVCP_FLAG_ACK) {
+            unsigned char ack[8] = { 0, 0, GVCP_EVENT_ACK >> 8, GVCP_EVENT_ACK & 0xFF, 0, 0,
+                                     (unsigned char) (reqId >> 8), (unsigned char) (reqId & 0xFF) };
+            sendto(this->eventSocket, (char *) ack, sizeof(ack), 0, &from.sa, fromLen);
+        }
 
-    /* Get all values in the hash table, note that this won't do anything that comes from db */
-    if (this->getAllFeatures()) {
+        this->lock();
+        /* a resend of a packet we have already handled */
+        if (reqId == this->lastEventReqId || this->connectionValid != 1 ||
+                !ARV_IS_GV_DEVICE(this->device)) {
+            this->unlock();
+            continue;
+        }
+        this->lastEventReqId = reqId;
+        /* Each item is reserved, event_id, stream_channel, block_id, timestamp high, timestamp low.
+         * EVENT_CMD packs several items, EVENTDATA_CMD has one followed by its data */
+        if (length > len - 8) length = len - 8;
+        for (int offset = 8; offset + 16 <= 8 + length; offset += 16) {
+            unsigned char *item = packet + offset;
+            int eventId = (item[2] << 8) | item[3];
+            guint64 timestamp = ((guint64) item[8] << 56) | ((guint64) item[9] << 48) |
+                                ((guint64) item[10] << 40) | ((guint64) item[11] << 32) |
+                                ((guint64) item[12] << 24) | ((guint64) item[13] << 16) |
+                                ((guint64) item[14] << 8) | item[15];
+            this->handleEvent(eventId, timestamp);
+            if (command == GVCP_EVENTDATA_CMD) break;
+        }
+        callParamCallbacks();
+        this->unlock();
+    }
+}
+
+/** Execute TriggerSoftware through the node resolved at connect time and
+  * remember when we sent it, so the frame it produces can be timed.
+  * lock taken */
+asynStatus aravisCamera::sendTrigger() {
+    const char *functionName = "sendTrigger";
+    GError *error = NULL;
+
+    if (this->triggerNode == NULL) {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s:%s: Unable to get all camera features\n",
+                    "%s:%s: Camera has no TriggerSoftware command\n",
                     driverName, functionName);
-        status = asynError;
+        return asynError;
+    }
+    gint64 sent = g_get_real_time();
+    arv_gc_command_execute(ARV_GC_COMMAND(this->triggerNode), &error);
+    gint64 done = g_get_real_time();
+    if (error != NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: TriggerSoftware failed: %s\n",
+                    driverName, functionName, error->message);
+        g_error_free(error);
+        return asynError;
     }
 
-    printf("aravisCamera: Done.\n");
-    return (asynStatus) status;
+    /* If the ring is full the oldest trigger never made a frame, forget it */
+    int next = (this->triggerHead + 1) % NTRIGGERS;
+    if (next == this->triggerTail) this->triggerTail = (this->triggerTail + 1) % NTRIGGERS;
+    this->triggerTimes[this->triggerHead] = sent;
+    this->triggerHead = next;
+
+    int count;
+    getIntegerParam(AravisTriggerCount, &count);
+    setIntegerParam(AravisTriggerCount, count + 1);
+    setIntegerParam(AravisTriggerPending, (this->triggerHead - this->triggerTail + NTRIGGERS) % NTRIGGERS);
+    setDoubleParam(AravisTriggerSendTime, (double) (done - sent));
+    return asynSuccess;
 }
 
-/** Called when asyn clients call pasynInt32->write().
-  * This function performs actions for some parameters, including ADAcquire, ADColorMode, etc.
-  * For all parameters it sets the value in the parameter library and calls any registered callbacks..
-  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
-  * \param[in] value Value to write. */
-asynStatus aravisCamera::writeInt32(asynUser *pasynUser, epicsInt32 value)
-{
-    int function = pasynUser->reason;
-    asynStatus status = asynSuccess;
-    epicsInt32 rbv;
-    char *featureName;
-    ArvGcNode *feature;
-    const char  *   reasonName = "unknownReason";
-    getParamName( 0, function, &reasonName );
+/** Clear the trigger latency statistics
+    lock taken */
+void aravisCamera::resetTriggerStats() {
+    this->triggerHead = this->triggerTail = 0;
+    this->triggerMatched = 0;
+    this->triggerLatencySum = 0;
+    setIntegerParam(AravisTriggerCount, 0);
+    setIntegerParam(AravisTriggerPending, 0);
+    setDoubleParam(AravisTriggerLatency, 0);
+    setDoubleParam(AravisTriggerLatencyMean, 0);
+    setDoubleParam(AravisTriggerLatencyMin, 0);
+    setDoubleParam(AravisTriggerLatencyMax, 0);
+}
 
-    /* Set the parameter and readback in the parameter library.  This may be overwritten when we read back the
-     * status at the end, but that's OK */
-    getIntegerParam(function, &rbv);
-    status = setIntegerParam(function, value);
+/** Triggered frames arrive in the order they were triggered, so the oldest
+  * trigger sent before this frame completed is the one that made it.
+  * lock taken */
+void aravisCamera::matchTrigger(NDArray *pRaw, gint64 received) {
+    double latency, latencyMin, latencyMax;
+    if (this->triggerTail == this->triggerHead || received <= 0) return;
+    gint64 sent = this->triggerTimes[this->triggerTail];
+    if (sent > received) return;
+    this->triggerTail = (this->triggerTail + 1) % NTRIGGERS;
+
+    latency = (received - sent) / 1000.0;
+    getDoubleParam(AravisTriggerLatencyMin, &latencyMin);
+    getDoubleParam(AravisTriggerLatencyMax, &latencyMax);
+    this->triggerMatched++;
+    this->triggerLatencySum += latency;
+    if (this->triggerMatched == 1 || latency < latencyMin) setDoubleParam(AravisTriggerLatencyMin, latency);
+    if (latency > latencyMax) setDoubleParam(AravisTriggerLatencyMax, latency);
+    setDoubleParam(AravisTriggerLatency, latency);
+    setDoubleParam(AravisTriggerLatencyMean, this->triggerLatencySum / this->triggerMatched);
+    setIntegerParam(AravisTriggerPending, (this->triggerHead - this->triggerTail + NTRIGGERS) % NTRIGGERS);
+    pRaw->pAttributeList->add("TriggerLatency", "Software trigger to frame received, ms", NDAttrFloat64, &latency);
+}
 
-    /* If we have no camera, then just fail */
-    if (function == AravisReset) {
-        status = this->connectToCamera();
-    } else if (this->camera == NULL || this->connectionValid != 1) {
-        if (rbv != value)
-            setIntegerParam(ADStatus, ADStatusDisconnected);
-        status = asynError;
-    } else if (function == AravisConnection) {
-        if (this->connectionValid != 1) status = asynError;
-    } else if (function == AravisLeftShift) {
+/** In ring mode frames are held in the driver instead of going to the plugins
+  * until a ring trigger, then the next RING_POST_COUNT frames pass straight through.
+  * Returns 1 if the ring has taken the frame.
+  * lock taken */
+int aravisCamera::holdFrame(NDArray *pRaw) {
+    int ringMode, preCount, postRemaining;
+    getIntegerParam(AravisRingMode, &ringMode);
+    if (!ringMode) return 0;
+
+    getIntegerParam(AravisRingPostRemaining, &postRemaining);
+    if (postRemaining > 0) {
+        setIntegerParam(AravisRingPostRemaining, postRemaining - 1);
+        return 0;
+    }
+
+    getIntegerParam(AravisRingPreCount, &preCount);
+    if (preCount <= 0) return 1;
+    /* drop the oldest frame to make room, its memory goes back to the pool */
+    while (this->ringFill >= preCount) {
+        int oldest = (this->ringHead - this->ringFill + NRING) % NRING;
+        this->ring[oldest]->release();
+        this->ringFill--;
+    }
+    pRaw->reserve();
+    this->ring[this->ringHead] = pRaw;
+    this->ringHead = (this->ringHead + 1) % NRING;
+    this->ringFill++;
+    setIntegerParam(AravisRingFill, this->ringFill);
+    return 1;
+}
+
+/** Send the held frames to the plugins, oldest first, and let the post-trigger frames through
+    lock taken */
+void aravisCamera::flushRing() {
+    int ringMode, postCount, flushes, arrayCallbacks;
+    getIntegerParam(AravisRingMode, &ringMode);
+    if (!ringMode) return;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    while (this->ringFill > 0) {
+        int oldest = (this->ringHead - this->ringFill + NRING) % NRING;
+        if (arrayCallbacks) doCallbacksGenericPointer(this->ring[oldest], NDArrayData, 0);
+        this->ring[oldest]->release();
+        this->ringFill--;
+    }
+    getIntegerParam(AravisRingPostCount, &postCount);
+    getIntegerParam(AravisRingFlushes, &flushes);
+    setIntegerParam(AravisRingPostRemaining, postCount > 0 ? postCount : 0);
+    setIntegerParam(AravisRingFlushes, flushes + 1);
+    setIntegerParam(AravisRingFill, 0);
+}
+
+/** Give the held frames back to the pool without sending them
+    lock taken */
+void aravisCamera::clearRing() {
+    while (this->ringFill > 0) {
+        int oldest = (this->ringHead - this->ringFill + NRING) % NRING;
+        this->ring[oldest]->release();
+        this->ringFill--;
+    }
+    this->ringHead = 0;
+    setIntegerParam(AravisRingFill, 0);
+    setIntegerParam(AravisRingPostRemaining, 0);
+}
+
+/** Slow the camera down when frames back up in our queue or in the plugins, and
+  * speed it up again once the backlog clears. The backlog is the larger of the
+  * fraction of our message queue in use and the fraction of the NDArray pool held
+  * by plugins; a frame dropped because the queue was full counts as a full backlog.
+  * lock taken */
+void aravisCamera::throttleFrameRate() {
+    int throttle, acquiring;
+    double minFps, fps, current, pressure;
+    epicsTimeStamp now;
+
+    getIntegerParam(AravisThrottle, &throttle);
+    getIntegerParam(ADAcquire, &acquiring);
+    if (!throttle || !acquiring) {
+        if (this->throttleRequested > 0) {
+            /* give back the rate that was asked for */
+            arv_camera_set_frame_rate(this->camera, this->throttleRequested);
+            struct aravis_feature *rate = this->findFeature(ADAcquirePeriod);
+            if (rate != NULL) this->invalidateEnums(rate->node);
+            this->throttleRequested = 0;
+            setIntegerParam(AravisThrottled, 0);
+            setDoubleParam(AravisThrottleFps, arv_camera_get_frame_rate(this->camera));
+            this->updateBandwidth();
+        }
+        setDoubleParam(AravisBackpressure, 0);
+        return;
+    }
+    epicsTimeGetCurrent(&now);
+    if (epicsTimeDiffInSeconds(&now, &this->lastThrottle) < THROTTLE_PERIOD) return;
+    this->lastThrottle = now;
+
+    pressure = (double) epicsMessageQueuePending(this->msgQId) / NRAW;
+    size_t maxMemory = this->pNDArrayPool->getMaxMemory();
+    if (maxMemory > 0 && this->payload > 0) {
+        /* the stream always has NRAW buffers and the ring holds its own */
+        double capacity = (double) maxMemory / this->payload - NRAW - this->ringFill;
+        double held = this->pNDArrayPool->getNumBuffers() - this->pNDArrayPool->getNumFree() - NRAW - this->ringFill;
+        if (capacity > 0 && held / capacity > pressure) pressure = held / capacity;
+    }
+    size_t dropped = epicsAtomicGetSizeT(&this->nDroppedQueue);
+    if (dropped > this->throttleDropped) pressure = 1;
+    this->throttleDropped = dropped;
+    if (pressure > 1) pressure = 1;
+    if (pressure < 0) pressure = 0;
+    setDoubleParam(AravisBackpressure, pressure * 100);
+    callParamCallbacks();
+
+    current = arv_camera_get_frame_rate(this->camera);
+    getDoubleParam(AravisThrottleMinFps, &minFps);
+    if (pressure > THROTTLE_HIGH) {
+        /* cut the rate in proportion to how far over we are, up to half per period */
+        fps = current * (1 - 0.5 * (pressure - THROTTLE_HIGH) / (1 - THROTTLE_HIGH));
+        if (fps < minFps) fps = minFps;
+        if (fps >= current) return;
+        if (this->throttleRequested <= 0) this->throttleRequested = current;
+    } else if (pressure < THROTTLE_LOW && this->throttleRequested > 0) {
+        /* creep back up so that we don't oscillate */
+        fps = current * 1.1;
+        if (fps >= this->throttleRequested) {
+            fps = this->throttleRequested;
+            this->throttleRequested = 0;
+        }
+    } else {
+        return;
+    }
+    arv_camera_set_frame_rate(this->camera, fps);
+    struct aravis_feature *rate = this->findFeature(ADAcquirePeriod);
+    if (rate != NULL) this->invalidateEnums(rate->node);
+    setIntegerParam(AravisThrottled, this->throttleRequested > 0);
+    setDoubleParam(AravisThrottleFps, arv_camera_get_frame_rate(this->camera));
+    this->updateBandwidth();
+    callParamCallbacks();
+}
+
+/** Print a summary of frames lost since the last one, at most once every
+  * LOG_PERIOD seconds, so that a flood of drops can't stall the stream thread */
+void aravisCamera::logTask() {
+    size_t lastNewest = 0, lastOldest = 0, lastDecimated = 0, lastBad = 0;
+    while (1) {
+        epicsThreadSleep(LOG_PERIOD);
+        size_t newest = epicsAtomicGetSizeT(&this->nDroppedNewest);
+        size_t oldest = epicsAtomicGetSizeT(&this->nDroppedOldest);
+        size_t decimated = epicsAtomicGetSizeT(&this->nDecimated);
+        size_t bad = epicsAtomicGetSizeT(&this->nBadFrames);
+        /* counters go back to 0 when acquisition starts */
+        if (newest < lastNewest) lastNewest = 0;
+        if (oldest < lastOldest) lastOldest = 0;
+        if (decimated < lastDecimated) lastDecimated = 0;
+        if (bad < lastBad) lastBad = 0;
+        if (newest != lastNewest || oldest != lastOldest || decimated != lastDecimated) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: message queue full, dropped %lu newest, %lu oldest, skipped %lu\n",
+                        driverName, this->portName, (unsigned long) (newest - lastNewest),
+                        (unsigned long) (oldest - lastOldest), (unsigned long) (decimated - lastDecimated));
+        }
+        if (bad != lastBad) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: %lu bad frames, last status: %s\n",
+                        driverName, this->portName, (unsigned long) (bad - lastBad),
+                        ArvBufferStatusToString((ArvBufferStatus) epicsAtomicGetIntT(&this->lastBadStatus)));
+        }
+        lastNewest = newest;
+        lastOldest = oldest;
+        lastDecimated = decimated;
+        lastBad = bad;
+    }
+}
+
+/** Open ARAVIS_RECORD_FILE and start writing every frame's payload to it
+    lock taken */
+asynStatus aravisCamera::startRecording() {
+    const char *functionName = "startRecording";
+    char fileName[256];
+
+    if (this->recorder != NULL) return asynSuccess;
+    getStringParam(AravisRecordFile, sizeof(fileName), fileName);
+    if (fileName[0] == '\0') {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: No record file set\n",
+                    driverName, functionName);
+        return asynError;
+    }
+    this->recorder = aravisRecorderOpen(fileName, arv_camera_get_payload(this->camera));
+    if (this->recorder == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Unable to record to %s\n",
+                    driverName, functionName, fileName);
+        return asynError;
+    }
+    this->recordPreviewCount = 0;
+    this->reportRecording();
+    return asynSuccess;
+}
+
+/** Flush and close the record file, leaving its final statistics on display
+    lock taken */
+asynStatus aravisCamera::stopRecording() {
+    const char *functionName = "stopRecording";
+    if (this->recorder == NULL) return asynSuccess;
+    this->reportRecording();
+    int error = aravisRecorderClose(this->recorder);
+    this->recorder = NULL;
+    setDoubleParam(AravisRecordBacklog, 0);
+    if (error) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Error writing record file: %s\n",
+                    driverName, functionName, strerror(error));
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Publish the recording statistics
+    lock taken */
+void aravisCamera::reportRecording() {
+    aravisRecorderStats stats;
+    if (this->recorder == NULL) return;
+    aravisRecorderGetStats(this->recorder, &stats);
+    setIntegerParam(AravisRecordFrames, (epicsInt32) stats.frames);
+    setIntegerParam(AravisRecordDropped, (epicsInt32) stats.dropped);
+    setDoubleParam(AravisRecordRate, stats.rate);
+    setDoubleParam(AravisRecordBacklog, stats.backlog / 1e6);
+    setIntegerParam(AravisRecordDirect, stats.direct);
+}
+
+/** Create the shared memory ring ARAVIS_SHM_NAME with slots for the current
+  * payload, or remove it if ARAVIS_SHM is off. Readers of an old ring are told
+  * it has closed so that they open the new one.
+  * lock taken */
+asynStatus aravisCamera::setShm() {
+    const char *functionName = "setShm";
+    int enable, nSlots;
+    char name[64];
+
+    if (this->shm != NULL) {
+        aravisShmDestroy(this->shm);
+        this->shm = NULL;
+    }
+    getIntegerParam(AravisShm, &enable);
+    if (!enable) return asynSuccess;
+
+    getIntegerParam(AravisShmSlots, &nSlots);
+    getStringParam(AravisShmName, sizeof(name), name);
+    this->shm = aravisShmCreate(name, nSlots, arv_camera_get_payload(this->camera));
+    if (this->shm == NULL) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Unable to create shared memory %s\n",
+                    driverName, functionName, name);
+        setIntegerParam(AravisShm, 0);
+        return asynError;
+    }
+    setIntegerParam(AravisShmFrames, 0);
+    return asynSuccess;
+}
+
+/** Build the attributes that processBuffer adds to frames. Frames update the
+  * values through the pointers we keep here rather than looking them up by name,
+  * then take a copy. The pool clears each frame's list, so the copy still
+  * allocates every attribute; only the chunk attributes are skipped on frames
+  * without chunk data.
+  * lock taken */
+void aravisCamera::buildFrameAttributes() {
+    epicsInt32 zero = 0;
+    epicsInt64 zero64 = 0;
+    epicsFloat64 zeroFloat = 0;
+
+    if (this->frameAttributes == NULL) {
+        this->frameAttributes = new NDAttributeList();
+        this->chunkAttributes = new NDAttributeList();
+    } else {
+        this->frameAttributes->clear();
+        this->chunkAttributes->clear();
+    }
+    this->attrBayerPattern = this->frameAttributes->add("BayerPattern", "Bayer Pattern", NDAttrInt32, &zero);
+    this->attrColorMode = this->frameAttributes->add("ColorMode", "Color Mode", NDAttrInt32, &zero);
+    this->attrFrameId = this->frameAttributes->add("FrameID", "Camera frame (GVSP block) ID", NDAttrInt32, &zero);
+    for (int i = 0; i < this->nChunks; i++) {
+        if (this->chunks[i].isFloat) {
+            this->chunks[i].attr = this->chunkAttributes->add(this->chunks[i].feature, this->chunks[i].name,
+                                                              NDAttrFloat64, &zeroFloat);
+        } else {
+            this->chunks[i].attr = this->chunkAttributes->add(this->chunks[i].feature, this->chunks[i].name,
+                                                              NDAttrInt64, &zero64);
+        }
+    }
+}
+
+/** Compute the frame statistics, shifting 16 bit pixels in the same pass, and
+  * publish them as parameters and as attributes of the frame. Returns the mean
+    this->statsWork allocated, lock taken */
+double aravisCamera::computeStatistics(NDArray *pRaw, size_t nsamples, int bits, int shift) {
+    aravisStatsResult result;
+    epicsTimeStamp start, end;
+    double saturated;
+
+    epicsTimeGetCurrent(&start);
+    aravisStatsCompute(pRaw->pData, nsamples, pRaw->dataType == NDUInt16 ? 2 : 1, bits, shift,
+                       this->statsWork, &result);
+    epicsTimeGetCurrent(&end);
+
+    saturated = (double) result.saturated;
+    setDoubleParam(AravisStatsMin, result.min);
+    setDoubleParam(AravisStatsMax, result.max);
+    setDoubleParam(AravisStatsMean, result.mean);
+    setDoubleParam(AravisStatsSigma, result.sigma);
+    setIntegerParam(AravisStatsSaturated, (int) result.saturated);
+    setDoubleParam(AravisStatsTime, 1e6 * epicsTimeDiffInSeconds(&end, &start));
+    doCallbacksInt32Array(result.histogram, ARAVIS_STATS_BINS, AravisStatsHistogram, 0);
+
+    /* only frames that were counted get these */
+    double values[NSTATS_ATTRS] = {result.min, result.max, result.mean, result.sigma, saturated};
+    for (int i = 0; i < NSTATS_ATTRS; i++) {
+        pRaw->pAttributeList->add(statsAttrs[i].name, statsAttrs[i].description, statsAttrs[i].type, &values[i]);
+    }
+    return result.mean;
+}
+
+/** Drive exposure time, then gain, towards the target mean intensity of the
+  * metering region. Changes are proportional to the error, limited to a factor
+  * of AE_MAX_STEP, and the next AE_SETTLE frames, which were already exposed
+  * with the old settings, are not metered. Gain is taken to be in dB. The
+  * writes always go to the command thread, so the frame thread never does the
+  * GVCP round trip or the dependent feature reads that follow it.
+    lock taken */
+void aravisCamera::autoExposure(NDArray *pRaw, int width, int height, int samplesPerPixel,
+                                double fullScale, double frameMean) {
+    int mode, settle, roiX, roiY, roiW, roiH, adjustments, state;
+    double target, tolerance, maxStep, exposureMin, exposureMax, gainMin, gainMax;
+    double exposure, gain, measured, ratio, total, newExposure, newGain;
+
+    getIntegerParam(AravisAEMode, &mode);
+    if (mode == ARAVIS_AE_OFF) return;
+    if (this->aeSettle > 0) {
+        this->aeSettle--;
+        this->aeFrames++;
+        return;
+    }
+
+    /* meter the region, the frame statistics already have the mean of the whole frame */
+    getIntegerParam(AravisAERoiX, &roiX);
+    getIntegerParam(AravisAERoiY, &roiY);
+    getIntegerParam(AravisAERoiW, &roiW);
+    getIntegerParam(AravisAERoiH, &roiH);
+    if (roiX < 0 || roiX >= width) roiX = 0;
+    if (roiY < 0 || roiY >= height) roiY = 0;
+    if (roiW <= 0 || roiX + roiW > width) roiW = width - roiX;
+    if (roiH <= 0 || roiY + roiH > height) roiH = height - roiY;
+    if (frameMean >= 0 && roiX == 0 && roiY == 0 && roiW == width && roiH == height) {
+        measured = frameMean;
+    } else {
+        measured = aravisStatsRegionMean(pRaw->pData, pRaw->dataType == NDUInt16 ? 2 : 1, samplesPerPixel,
+                                         width, roiX, roiY, roiW, roiH, AE_METER_STEP);
+    }
+    measured = 100 * measured / fullScale;
+
+    getDoubleParam(AravisAETarget, &target);
+    getDoubleParam(AravisAETolerance, &tolerance);
+    if (target <= 0 || target > 100) target = 50;
+    setDoubleParam(AravisAEMeasured, measured);
+    setDoubleParam(AravisAEError, 100 * (measured - target) / target);
+    if (this->aeState == ARAVIS_AE_STATE_CONVERGED || this->aeState == ARAVIS_AE_STATE_OFF) this->aeFrames = 0;
+    this->aeFrames++;
+    if (fabs(measured - target) <= target * tolerance / 100) {
+        if (this->aeState != ARAVIS_AE_STATE_CONVERGED) setIntegerParam(AravisAEFrames, this->aeFrames);
+        this->aeState = ARAVIS_AE_STATE_CONVERGED;
+        setIntegerParam(AravisAEState, this->aeState);
+        return;
+    }
+
+    /* a black frame says nothing about how far to go, so take the largest step */
+    getDoubleParam(AravisAEMaxStep, &maxStep);
+    if (maxStep < 1.01) maxStep = 1.01;
+    ratio = target / (measured > 0.01 ? measured : 0.01);
+    if (ratio > maxStep) ratio = maxStep;
+    if (ratio < 1 / maxStep) ratio = 1 / maxStep;
+
+    /* exposure takes the change first, gain only covers what exposure can't */
+    getDoubleParam(ADAcquireTime, &exposure);
+    getDoubleParam(ADGain, &gain);
+    getDoubleParam(AravisAEExposureMin, &exposureMin);
+    getDoubleParam(AravisAEExposureMax, &exposureMax);
+    getDoubleParam(AravisAEGainMin, &gainMin);
+    getDoubleParam(AravisAEGainMax, &gainMax);
+    if (mode == ARAVIS_AE_GAIN) exposureMin = exposureMax = exposure;
+    if (mode == ARAVIS_AE_EXPOSURE) gainMin = gainMax = gain;
+    if (exposure < exposureMin) exposure = exposureMin;
+    if (exposure > exposureMax) exposure = exposureMax;
+    if (gain < gainMin) gain = gainMin;
+    if (gain > gainMax) gain = gainMax;
+    total = exposure * pow(10, (gain - gainMin) / 20) * ratio;
+    newExposure = total < exposureMin ? exposureMin : (total > exposureMax ? exposureMax : total);
+    newGain = newExposure > 0 ? gainMin + 20 * log10(total / newExposure) : gainMin;
+    if (newGain < gainMin) newGain = gainMin;
+    if (newGain > gainMax) newGain = gainMax;
+
+    state = ARAVIS_AE_STATE_ADJUSTING;
+    if (fabs(newExposure - exposure) > 0.001 * exposure) {
+        setDoubleParam(ADAcquireTime, newExposure);
+        this->queueFeature(ADAcquireTime, 1, newExposure);
+    } else if (fabs(newGain - gain) < 0.01) {
+        /* pinned at the limits, keep metering in case the scene changes */
+        state = ARAVIS_AE_STATE_LIMITED;
+    }
+    if (fabs(newGain - gain) >= 0.01) {
+        setDoubleParam(ADGain, newGain);
+        this->queueFeature(ADGain, 1, newGain);
+        state = ARAVIS_AE_STATE_ADJUSTING;
+    }
+    if (state == ARAVIS_AE_STATE_ADJUSTING) {
+        getIntegerParam(AravisAESettle, &settle);
+        getIntegerParam(AravisAEAdjustments, &adjustments);
+        setIntegerParam(AravisAEAdjustments, adjustments + 1);
+        this->aeSettle = settle > 0 ? settle : 0;
+        if (this->aeSettle > 0) state = ARAVIS_AE_STATE_SETTLING;
+    }
+    this->aeState = state;
+    setIntegerParam(AravisAEState, state);
+}
+
+/** The correction stages that have been asked for, not counting the shift
+    lock taken */
+int aravisCamera::preprocessStages() {
+    int dark, flat, flipX, flipY;
+    getIntegerParam(AravisPreDark, &dark);
+    getIntegerParam(AravisPreFlat, &flat);
+    getIntegerParam(AravisPreFlipX, &flipX);
+    getIntegerParam(AravisPreFlipY, &flipY);
+    return (dark ? ARAVIS_PRE_DARK : 0) | (flat ? ARAVIS_PRE_FLAT : 0) |
+           (flipX ? ARAVIS_PRE_FLIP_X : 0) | (flipY ? ARAVIS_PRE_FLIP_Y : 0);
+}
+
+/** Shift, dark subtract, flat-field and flip a mono frame in one pass
+    lock taken */
+void aravisCamera::preprocessFrame(NDArray *pRaw, int width, int height, int stages, int shift) {
+    int bytesPerSample = pRaw->dataType == NDUInt16 ? 2 : 1;
+    size_t scratchSize = 2 * (size_t) width * bytesPerSample;
+    epicsTimeStamp start, end;
+    int applied;
+
+    if (scratchSize > this->preScratchSize) {
+        free(this->preScratch);
+        this->preScratch = malloc(scratchSize);
+        this->preScratchSize = this->preScratch != NULL ? scratchSize : 0;
+        if (this->preScratch == NULL) return;
+    }
+    epicsTimeGetCurrent(&start);
+    applied = aravisPreprocess(pRaw->pData, bytesPerSample, width, height, stages | ARAVIS_PRE_SHIFT, shift,
+                               &this->darkCal, &this->flatCal, this->preScratch);
+    epicsTimeGetCurrent(&end);
+    setDoubleParam(AravisPreTime, 1e6 * epicsTimeDiffInSeconds(&end, &start));
+
+    /* only say so when a correction starts or stops being possible, not every frame */
+    applied &= ARAVIS_PRE_DARK | ARAVIS_PRE_FLAT;
+    if (applied != this->preApplied) {
+        char msg[256];
+        if ((stages & ARAVIS_PRE_DARK) && !(applied & ARAVIS_PRE_DARK)) {
+            epicsSnprintf(msg, sizeof(msg), "No %dx%d dark frame, not subtracting", width, height);
+        } else if ((stages & ARAVIS_PRE_FLAT) && !(applied & ARAVIS_PRE_FLAT)) {
+            epicsSnprintf(msg, sizeof(msg), "No %dx%d flat frame, not correcting", width, height);
+        } else {
+            epicsSnprintf(msg, sizeof(msg), "Correcting %dx%d frames", width, height);
+        }
+        setStringParam(AravisPreMsg, msg);
+        this->preApplied = applied;
+    }
+}
+
+/** Average this frame into the dark or flat frame being captured
+    lock taken */
+void aravisCamera::captureCalibration(NDArray *pRaw, int width, int height) {
+    int flat = this->preCapture == ARAVIS_PRE_CAPTURE_FLAT;
+    aravisCalibration *cal = flat ? &this->flatCal : &this->darkCal;
+    int bytesPerSample = pRaw->dataType == NDUInt16 ? 2 : 1;
+    char msg[256];
+    int frames, done;
+
+    if (!this->preCaptureStarted) {
+        getIntegerParam(AravisPreCaptureFrames, &frames);
+        aravisCalibrationStart(cal, width, height, bytesPerSample, frames);
+        this->preCaptureStarted = 1;
+    }
+    done = aravisCalibrationAdd(cal, pRaw->pData, bytesPerSample, width, height, flat ? &this->darkCal : NULL);
+    setIntegerParam(AravisPreCaptured, cal->frames);
+    if (done == 0) return;
+    if (done < 0) {
+        if (cal->bytesPerSample != bytesPerSample) {
+            epicsSnprintf(msg, sizeof(msg), "%s capture failed, data type changed", flat ? "Flat" : "Dark");
+        } else if (cal->width != width || cal->height != height) {
+            epicsSnprintf(msg, sizeof(msg), "%s capture failed, frame size changed from %dx%d to %dx%d",
+                          flat ? "Flat" : "Dark", cal->width, cal->height, width, height);
+        } else {
+            epicsSnprintf(msg, sizeof(msg), "%s capture failed, out of memory", flat ? "Flat" : "Dark");
+        }
+        aravisCalibrationFree(cal);
+    } else {
+        if (flat) aravisCalibrationMakeGain(cal);
+        epicsSnprintf(msg, sizeof(msg), "Captured %dx%d %s from %d frames", width, height,
+                      flat ? "flat" : "dark", cal->frames);
+    }
+    setStringParam(AravisPreMsg, msg);
+    this->preCapture = ARAVIS_PRE_CAPTURE_NONE;
+    this->preApplied = -1;
+    setIntegerParam(AravisPreCapture, ARAVIS_PRE_CAPTURE_NONE);
+}
+
+/** Read the dark or flat frame from ARAVIS_PRE_DARK_FILE or ARAVIS_PRE_FLAT_FILE
+    lock taken */
+asynStatus aravisCamera::loadCalibration(int flat) {
+    const char *functionName = "loadCalibration";
+    aravisCalibration *cal = flat ? &this->flatCal : &this->darkCal;
+    char fileName[256], msg[512];
+
+    getStringParam(flat ? AravisPreFlatFile : AravisPreDarkFile, sizeof(fileName), fileName);
+    if (aravisCalibrationLoad(cal, fileName) != 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Unable to read a calibration frame from %s\n",
+                    driverName, functionName, fileName);
+        epicsSnprintf(msg, sizeof(msg), "Unable to read %s", fileName);
+        setStringParam(AravisPreMsg, msg);
+        return asynError;
+    }
+    if (flat) aravisCalibrationMakeGain(cal);
+    epicsSnprintf(msg, sizeof(msg), "Loaded %dx%d %s", cal->width, cal->height, flat ? "flat" : "dark");
+    setStringParam(AravisPreMsg, msg);
+    this->preApplied = -1;
+    return asynSuccess;
+}
+
+/** Write the dark or flat frame to ARAVIS_PRE_DARK_FILE or ARAVIS_PRE_FLAT_FILE
+    lock taken */
+asynStatus aravisCamera::saveCalibration(int flat) {
+    const char *functionName = "saveCalibration";
+    aravisCalibration *cal = flat ? &this->flatCal : &this->darkCal;
+    char fileName[256], msg[512];
+
+    getStringParam(flat ? AravisPreFlatFile : AravisPreDarkFile, sizeof(fileName), fileName);
+    if (aravisCalibrationSave(cal, fileName) != 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Unable to write the %s frame to %s\n",
+                    driverName, functionName, flat ? "flat" : "dark", fileName);
+        epicsSnprintf(msg, sizeof(msg), "Unable to write %s", fileName);
+        setStringParam(AravisPreMsg, msg);
+        return asynError;
+    }
+    epicsSnprintf(msg, sizeof(msg), "Saved %dx%d %s", cal->width, cal->height, flat ? "flat" : "dark");
+    setStringParam(AravisPreMsg, msg);
+    return asynSuccess;
+}
+
+/** Centroid the region and publish it straight away, stamped with the frame's
+  * time stamp, rather than after the plugins have had the frame. Only mono and
+  * raw bayer frames are centroided.
+    lock taken */
+void aravisCamera::publishCentroid(NDArray *pRaw, int width, int height, gint64 received) {
+    int enable, roiX, roiY, roiW, roiH;
+    double threshold, latency, latencyMax;
+    aravisCentroidResult result;
+    gint64 start, end;
+
+    getIntegerParam(AravisCentroid, &enable);
+    if (!enable || pRaw->ndims != 2) return;
+    getIntegerParam(AravisCentroidRoiX, &roiX);
+    getIntegerParam(AravisCentroidRoiY, &roiY);
+    getIntegerParam(AravisCentroidRoiW, &roiW);
+    getIntegerParam(AravisCentroidRoiH, &roiH);
+    getDoubleParam(AravisCentroidThreshold, &threshold);
+    if (roiX < 0 || roiX >= width) roiX = 0;
+    if (roiY < 0 || roiY >= height) roiY = 0;
+    if (roiW <= 0 || roiX + roiW > width) roiW = width - roiX;
+    if (roiH <= 0 || roiY + roiH > height) roiH = height - roiY;
+
+    start = g_get_real_time();
+    if (aravisStatsCentroid(pRaw->pData, pRaw->dataType == NDUInt16 ? 2 : 1, width,
+                            roiX, roiY, roiW, roiH, threshold, &result)) {
+        setDoubleParam(AravisCentroidX, result.x);
+        setDoubleParam(AravisCentroidY, result.y);
+        setDoubleParam(AravisCentroidSigmaX, result.sigmaX);
+        setDoubleParam(AravisCentroidSigmaY, result.sigmaY);
+    }
+    setDoubleParam(AravisCentroidTotal, result.total);
+    end = g_get_real_time();
+    setDoubleParam(AravisCentroidTime, (double) (end - start));
+    callParamCallbacks();
+
+    /* buffer completed to the position posted, the records scan I/O Intr on their own */
+    if (received > 0) {
+        latency = (double) (g_get_real_time() - received);
+        getDoubleParam(AravisCentroidLatencyMax, &latencyMax);
+        setDoubleParam(AravisCentroidLatency, latency);
+        if (latency > latencyMax) setDoubleParam(AravisCentroidLatencyMax, latency);
+    }
+}
+
+/** Take the device lock and then the port lock, so that everything holding the
+  * port lock may also talk to the camera. The command thread holds only the
+  * device lock for a feature write's round trip, and the frame thread only the
+  * port lock, so frames are processed while a write is in flight */
+asynStatus aravisCamera::lock() {
+    epicsMutexMustLock(this->deviceLock);
+    return ADDriver::lock();
+}
+
+asynStatus aravisCamera::unlock() {
+    asynStatus status = ADDriver::unlock();
+    epicsMutexUnlock(this->deviceLock);
+    return status;
+}
+
+/** Take just the port lock, for the parameter library. Never take the device
+  * lock while holding only this one, lock() takes them the other way round */
+void aravisCamera::lockPort() {
+    ADDriver::lock();
+}
+
+void aravisCamera::unlockPort() {
+    ADDriver::unlock();
+}
+
+/** Send a software trigger from an iocsh command or another thread */
+asynStatus aravisCamera::softwareTrigger() {
+    asynStatus status;
+    this->lock();
+    if (this->camera == NULL || this->connectionValid != 1) {
+        status = asynError;
+    } else {
+        status = this->sendTrigger();
+    }
+    callParamCallbacks();
+    this->unlock();
+    return status;
+}
+
+/** Start a new auto-tuning window from the current stream statistics.
+    Called when the stream is rebuilt, as aravis restarts its counters with it.
+    lock taken */
+void aravisCamera::resetStreamTuning() {
+    guint64 n_completed_buffers, n_underruns;
+    this->tuneFrames = 0;
+    this->tuneCompletionSum = 0;
+    this->tuneCompletionMax = 0;
+    this->tuneResent = 0;
+    this->tuneMissing = 0;
+    this->tuneFailures = 0;
+    if (this->stream != NULL) {
+        arv_stream_get_statistics(this->stream, &n_completed_buffers, &this->tuneFailures, &n_underruns);
+        if (ARV_IS_GV_STREAM(this->stream)) {
+            arv_gv_stream_get_statistics(ARV_GV_STREAM(this->stream), &this->tuneResent, &this->tuneMissing);
+        }
+    }
+    epicsTimeGetCurrent(&this->lastTune);
+}
+
+/** Closed loop adjustment of packet-timeout and frame-retention.
+  *
+  * Once a second, look at how many packets were resent, how many were still
+  * missing after the resend, and how long frames took from their first packet
+  * to completion:
+  *  - packets lost after resend mean we asked too late or gave up too soon,
+  *    so shorten packet-timeout and lengthen frame-retention
+  *  - frequent resends that all succeed mean packets were only late, so
+  *    lengthen packet-timeout to stop asking for packets already on their way
+  *  - a clean window lets both converge on targets derived from the measured
+  *    inter-packet gap and frame completion time, which releases buffers sooner
+  * Every change is bounded by the _MIN/_MAX parameters and logged with its reason.
+  * lock taken */
+void aravisCamera::autoTuneStream() {
+    int autoTune, pktTimeout, frameRetention, timeoutMin, timeoutMax, retentionMin, retentionMax;
+    guint64 n_completed_buffers, n_failures, n_underruns, n_resent_pkts = 0, n_missing_pkts = 0;
+    double meanCompletion, gap, packetsPerFrame;
+    epicsTimeStamp now;
+    char reason[128];
+
+    epicsTimeGetCurrent(&now);
+    if (epicsTimeDiffInSeconds(&now, &this->lastTune) < TUNE_PERIOD) return;
+    if (this->stream == NULL || !ARV_IS_GV_STREAM(this->stream)) return;
+    if (this->tuneFrames < TUNE_MIN_FRAMES) return;
+
+    arv_stream_get_statistics(this->stream, &n_completed_buffers, &n_failures, &n_underruns);
+    arv_gv_stream_get_statistics(ARV_GV_STREAM(this->stream), &n_resent_pkts, &n_missing_pkts);
+    guint64 dResent  = n_resent_pkts  - this->tuneResent;
+    guint64 dMissing = n_missing_pkts - this->tuneMissing;
+    guint64 dFailed  = n_failures     - this->tuneFailures;
+
+    /* Publish what we measured, whether or not we act on it */
+    meanCompletion = this->tuneCompletionSum / this->tuneFrames;
+    packetsPerFrame = 1;
+    if (ARV_IS_GV_DEVICE(this->device)) {
+        int pktSize = arv_gv_device_get_packet_size(ARV_GV_DEVICE(this->device));
+        if (pktSize > 36) packetsPerFrame = ceil(this->payload / (pktSize - 36.0));
+    }
+    gap = meanCompletion / packetsPerFrame;
+    setDoubleParam(AravisFrameCompletion, meanCompletion);
+    setDoubleParam(AravisPktGap, gap);
+
+    getIntegerParam(AravisAutoTune, &autoTune);
+    getIntegerParam(AravisPktTimeout, &pktTimeout);
+    getIntegerParam(AravisFrameRetention, &frameRetention);
+    getIntegerParam(AravisPktTimeoutMin, &timeoutMin);
+    getIntegerParam(AravisPktTimeoutMax, &timeoutMax);
+    getIntegerParam(AravisFrameRetentionMin, &retentionMin);
+    getIntegerParam(AravisFrameRetentionMax, &retentionMax);
+
+    int newTimeout = pktTimeout, newRetention = frameRetention;
+    reason[0] = 0;
+    if (dMissing > 0 || dFailed > 0) {
+        newTimeout = (int) (pktTimeout * 0.8);
+        newRetention = (int) (frameRetention * 1.5);
+        epicsSnprintf(reason, sizeof(reason), "%d pkts lost after resend, %d frames failed",
+                      (int) dMissing, (int) dFailed);
+    } else if (dResent > 0 && dResent * 1000 > this->tuneFrames * packetsPerFrame) {
+        newTimeout = (int) (pktTimeout * 1.25);
+        epicsSnprintf(reason, sizeof(reason), "%d pkts resent and all recovered",
+                      (int) dResent);
+    } else {
+        /* Ten packet gaps is plenty of jitter, and a frame needs its own
+         * transmission time plus a resend round trip on top */
+        int targetTimeout = (int) (10 * gap);
+        int targetRetention = (int) (2 * this->tuneCompletionMax + 2 * pktTimeout);
+        if (abs(targetTimeout - pktTimeout) * 10 > pktTimeout) {
+            newTimeout = pktTimeout + (targetTimeout - pktTimeout) / 4;
+        }
+        if (abs(targetRetention - frameRetention) * 10 > frameRetention) {
+            newRetention = frameRetention + (targetRetention - frameRetention) / 4;
+        }
+        epicsSnprintf(reason, sizeof(reason), "clean, pkt gap %.0fus, frame completion max %.0fus",
+                      gap, this->tuneCompletionMax);
+    }
+
+    /* Apply bounds, and never let a frame expire before its packets could be resent */
+    if (newTimeout < timeoutMin) newTimeout = timeoutMin;
+    if (newTimeout > timeoutMax) newTimeout = timeoutMax;
+    if (newRetention < 2 * newTimeout) newRetention = 2 * newTimeout;
+    if (newRetention < retentionMin) newRetention = retentionMin;
+    if (newRetention > retentionMax) newRetention = retentionMax;
+
+    if (autoTune && (newTimeout != pktTimeout || newRetention != frameRetention)) {
+        setIntegerParam(AravisPktTimeout, newTimeout);
+        setIntegerParam(AravisFrameRetention, newRetention);
+        setStringParam(AravisAutoTuneMsg, reason);
+        this->setStreamProperties();
+        /* log what the stream read back, not what we asked for */
+        getIntegerParam(AravisPktTimeout, &newTimeout);
+        getIntegerParam(AravisFrameRetention, &newRetention);
+        printf("aravisCamera: %s: packet-timeout %d -> %d us, frame-retention %d -> %d us: %s\n",
+               this->portName, pktTimeout, newTimeout, frameRetention, newRetention, reason);
+    }
+
+    /* Start the next window */
+    this->tuneFrames = 0;
+    this->tuneCompletionSum = 0;
+    this->tuneCompletionMax = 0;
+    this->tuneResent = n_resent_pkts;
+    this->tuneMissing = n_missing_pkts;
+    this->tuneFailures = n_failures;
+    this->lastTune = now;
+}
+
+/** Read back the negotiated packet size and inter-packet delay
+    this->camera exists, lock taken */
+asynStatus aravisCamera::getTransport() {
+    if (!ARV_IS_GV_DEVICE(this->device)) return asynSuccess;
+    setIntegerParam(AravisPktSize, (epicsInt32) arv_gv_device_get_packet_size(ARV_GV_DEVICE(this->device)));
+    if (this->hasFeature("GevSCPD")) {
+        setIntegerParam(AravisPktDelay, (epicsInt32) arv_camera_gv_get_packet_delay(this->camera));
+    }
+    return asynSuccess;
+}
+
+/** Apply packet size and inter-packet delay. Most cameras lock GevSCPS while
+    streaming, so stop and restart the acquisition around the change.
+    this->camera exists, lock taken */
+asynStatus aravisCamera::setTransport() {
+    asynStatus status = asynSuccess;
+    int acquiring, autoPktSize, pktSize, pktDelay;
+
+    if (!ARV_IS_GV_DEVICE(this->device)) return asynSuccess;
+
+    getIntegerParam(AravisAutoPktSize, &autoPktSize);
+    getIntegerParam(AravisPktSize, &pktSize);
+    getIntegerParam(AravisPktDelay, &pktDelay);
+
+    /* stop acquiring if we are acquiring */
+    getIntegerParam(ADAcquire, &acquiring);
+    if (acquiring && this->stream != NULL) this->stop();
+
+    if (autoPktSize) {
+        // Automatically determine optimum packet size
+        arv_gv_device_auto_packet_size(ARV_GV_DEVICE(this->device));
+    } else {
+        // 576 is the smallest IPv4 datagram, 9000 a standard jumbo frame
+        if (pktSize < 576 || pktSize > 9000) {
+            status = asynError;
+        } else {
+            arv_gv_device_set_packet_size(ARV_GV_DEVICE(this->device), pktSize);
+            if ((int) arv_gv_device_get_packet_size(ARV_GV_DEVICE(this->device)) != pktSize) status = asynError;
+        }
+    }
+    if (this->hasFeature("GevSCPD")) {
+        if (pktDelay < 0) {
+            status = asynError;
+        } else {
+            /* units are ns, aravis converts to ticks using the timestamp frequency */
+            arv_camera_gv_set_packet_delay(this->camera, pktDelay);
+        }
+    }
+    this->invalidateEnums("GevSCPSPacketSize");
+    this->invalidateEnums("GevSCPD");
+
+    /* Read back values */
+    this->getTransport();
+
+    /* Start camera again */
+    if (acquiring && this->stream != NULL) this->start();
+    this->updateBandwidth();
+    return status;
+}
+
+/** Tell the bandwidth allocator what we are streaming, nothing if we are idle
+    this->camera exists, lock taken */
+void aravisCamera::updateBandwidth() {
+    int acquiring;
+    double fps = 0;
+    if (this->bandwidth == NULL) return;
+    getIntegerParam(ADAcquire, &acquiring);
+    if (acquiring) fps = arv_camera_get_frame_rate(this->camera);
+    aravisBandwidthUpdate(this->bandwidth, this->payload, fps,
+                          arv_gv_device_get_packet_size(ARV_GV_DEVICE(this->device)));
+}
+
+/** Publish our share of the link and, if pacing is enabled, program GevSCPD and
+    GevSCFTD to match it and hold the frame rate to the share's ceiling. The
+    rate that was asked for is remembered and given back as the share grows,
+    or when pacing is turned off.
+    this->camera exists, lock taken */
+void aravisCamera::applyBandwidthShare(int force) {
+    const char *functionName = "applyBandwidthShare";
+    aravisBandwidthShare share;
+    int pacing;
+    double current, fps;
+    if (this->bandwidth == NULL) return;
+    if (!force && aravisBandwidthGeneration(this->bandwidth) == this->bandwidthGeneration) return;
+    this->bandwidthGeneration = aravisBandwidthGetShare(this->bandwidth, &share);
+    setDoubleParam(AravisBwBudget, share.budget * 8 / 1e6);
+    setDoubleParam(AravisBwUtilisation, share.utilisation * 100);
+    setDoubleParam(AravisBwAllocated, share.allocated * 8 / 1e6);
+    setDoubleParam(AravisBwFpsMax, share.fpsMax);
+    setIntegerParam(AravisBwFrameDelay, (epicsInt32) share.frameDelay);
+    getIntegerParam(AravisBwPacing, &pacing);
+    if (pacing && share.allocated > 0) {
+        if (this->hasFeature("GevSCPD")) {
+            arv_camera_gv_set_packet_delay(this->camera, (gint64) share.packetDelay);
+        }
+        if (this->hasFeature("GevSCFTD")) {
+            /* GevSCFTD is in timestamp ticks */
+            guint64 freq = arv_gv_device_get_timestamp_tick_frequency(ARV_GV_DEVICE(this->device));
+            if (freq > 0) {
+                arv_device_set_integer_feature_value(this->device, "GevSCFTD",
+                                                     (gint64) (share.frameDelay * freq / 1e9));
+            }
+        }
+        this->invalidateEnums("GevSCPD");
+        this->invalidateEnums("GevSCFTD");
+        this->getTransport();
+    }
+
+    current = arv_camera_get_frame_rate(this->camera);
+    fps = current;
+    if (pacing && share.fpsMax > 0 && current > share.fpsMax * (1 + BW_FPS_TOLERANCE)) {
+        /* over our share, packet delays alone would only back frames up in the camera */
+        if (this->paceRequested <= 0) this->paceRequested = current;
+        fps = share.fpsMax;
+    } else if (this->paceRequested > 0 && (!pacing || share.fpsMax <= 0 || share.fpsMax > current)) {
+        /* the share has grown, or pacing is off, so head back to what was asked for */
+        fps = this->paceRequested;
+        if (pacing && share.fpsMax > 0 && fps > share.fpsMax) fps = share.fpsMax;
+        else this->paceRequested = 0;
+    }
+    if (fps != current) {
+        arv_camera_set_frame_rate(this->camera, fps);
+        struct aravis_feature *rate = this->findFeature(ADAcquirePeriod);
+        if (rate != NULL) this->invalidateEnums(rate->node);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+              "%s:%s: frame rate %g -> %g for a %g fps bandwidth share\n",
+              driverName, functionName, current,
+              arv_camera_get_frame_rate(this->camera), share.fpsMax);
+        /* our demand has changed, so the shares will be recomputed and seen next time */
+        this->updateBandwidth();
+    }
+    setIntegerParam(AravisBwLimited, this->paceRequested > 0);
+    callParamCallbacks();
+}
+
+
+asynStatus aravisCamera::connectToCamera() {
+    const char *functionName = "connectToCamera";
+    int status = asynSuccess;
+    int w, h;
+    const char *vendor, *model, *deviceID, *firmwareVersion;
+
+    /* stop old camera if it exists */
+    this->connectionValid = 0;
+    if (this->camera != NULL) {
+        arv_camera_stop_acquisition(this->camera);
+    }
+
+    /* Tell areaDetector it is no longer acquiring */
+    setIntegerParam(ADAcquire, 0);
+
+    /* make the camera object, any trigger node and block plan belonged to the old one */
+    this->triggerNode = NULL;
+    this->blockPlanValid = 0;
+    status = this->makeCameraObject();
+    if (status) return (asynStatus) status;
+
+    /* Make sure it's stopped */
+    arv_camera_stop_acquisition(this->camera);
+    status |= setIntegerParam(ADStatus, ADStatusIdle);
+    
+    /* Check the tick frequency */
+    if (ARV_IS_GV_DEVICE(this->device)) {
+        guint64 freq = arv_gv_device_get_timestamp_tick_frequency(ARV_GV_DEVICE(this->device));
+        printf("aravisCamera: Your tick frequency is %" G_GUINT64_FORMAT "\n", freq);
+        if (freq > 0) {
+            printf("So your timestamp resolution is %f ns\n", 1.e9/freq);
+        } else {
+            printf("So your camera doesn't provide timestamps. Using system clock instead\n");
+        }
+    }
+    
+    /* Make the stream */
+    status = this->makeStreamObject();
+    if (status) return (asynStatus) status;    
+    
+    /* connect connection lost signal to camera */
+    g_signal_connect (this->device, "control-lost", G_CALLBACK (controlLostCallback), this);
+
+    /* Share the bandwidth of the host interface with any other cameras on it */
+    if (this->bandwidth != NULL) {
+        aravisBandwidthDetach(this->bandwidth);
+        this->bandwidth = NULL;
+    }
+    if (ARV_IS_GV_DEVICE(this->device)) {
+        GSocketAddress *ifAddress = arv_gv_device_get_interface_address(ARV_GV_DEVICE(this->device));
+        if (ifAddress != NULL) {
+            char *link = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(ifAddress)));
+            this->bandwidth = aravisBandwidthAttach(link, this->portName);
+            setStringParam(AravisBwLink, link);
+            g_free(link);
+        }
+        GSocketAddress *devAddress = arv_gv_device_get_device_address(ARV_GV_DEVICE(this->device));
+        if (devAddress != NULL) {
+            char *address = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(devAddress)));
+            setStringParam(AravisAddress, address);
+            g_free(address);
+        }
+    }
+
+    /* Set vendor and model number */
+    vendor = arv_camera_get_vendor_name(this->camera);
+    if (vendor) status |= setStringParam (ADManufacturer, vendor);
+    model = arv_camera_get_model_name(this->camera);
+    if (model) status |= setStringParam (ADModel, model);
+    deviceID = arv_camera_get_device_id(this->camera);
+    if (deviceID) status |= setStringParam (ADSerialNumber, deviceID);
+    firmwareVersion = arv_device_get_string_feature_value(this->device, "DeviceFirmwareVersion");
+    if (firmwareVersion) status |= setStringParam (ADFirmwareVersion, firmwareVersion);
+
+    /* Get sensor size */
+    arv_camera_get_sensor_size(this->camera, &w, &h);
+    status |= setIntegerParam(ADMaxSizeX, w);
+    status |= setIntegerParam(ADMaxSizeY, h);
+
+    /* Get geometry */
+    if(this->getGeometry()) {
+        /* If getting geometry failed, set some safe defaults */
+        setIntegerParam(ADBinX, 1);
+        setIntegerParam(ADBinY, 1);
+        setIntegerParam(NDColorMode, NDColorModeMono);
+        setIntegerParam(NDDataType, NDUInt8);
+        this->setGeometry();
+    }
+
+    /* Report if anything has failed */
+    if (status) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Unable to get all camera parameters\n",
+                    driverName, functionName);
+    }
+
+    /* For Baumer cameras, AcquisitionFrameRate will not do anything until we set this
+     * NOTE: *no* d in AcquisitionFrameRateEnable */
+    if (this->hasFeature("AcquisitionFrameRateEnable")) {
+        arv_device_set_integer_feature_value (this->device, "AcquisitionFrameRateEnable", 1);
+    }
+
+    /* For Point Grey cameras, AcquisitionFrameRate will not do anything until we set this
+     * NOTE: there is a d in AcquisitionFrameRateEnabled */
+    if (this->hasFeature("AcquisitionFrameRateEnabled")) {
+        arv_device_set_integer_feature_value (this->device, "AcquisitionFrameRateEnabled", 1);
+    }
+    /* Mark connection valid again */
+    this->connectionValid = 1;
+    printf("aravisCamera: Done.\n");
+
+    printf("aravisCamera: Getting feature list...\n");
+    /* Add gain lookup */
+    if (tryAddFeature(ADGain, "Gain"))
+        if (tryAddFeature(ADGain, "GainRaw"))
+            tryAddFeature(ADGain, "GainRawChannelA");
+
+    /* Add exposure lookup */
+    if (tryAddFeature(ADAcquireTime, "ExposureTime"))
+        tryAddFeature(ADAcquireTime, "ExposureTimeAbs");
+
+    /* Add framerate lookup */
+    if (tryAddFeature(ADAcquirePeriod, "AcquisitionFrameRate"))
+        tryAddFeature(ADAcquirePeriod, "AcquisitionFrameRateAbs");
+
+    /* Get all values in the hash table, note that this won't do anything that comes from db */
+    if (this->getAllFeatures()) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Unable to get all camera features\n",
+                    driverName, functionName);
+        status = asynError;
+    }
+
+    /* Reapply the chunk selection, any old parser belonged to the old camera */
+    if (this->setChunks()) {
+        status = asynError;
+    }
+
+    /* Resolve the software trigger now so that firing it is a single GVCP write */
+    ArvGcNode *triggerNode = arv_device_get_feature(this->device, "TriggerSoftware");
+    if (ARV_IS_GC_COMMAND(triggerNode)) this->triggerNode = triggerNode;
+
+    /* Point the new camera at our event socket */
+    if (this->setEvents()) {
+        status = asynError;
+    }
+
+    /* Time from starting to look for the camera to having it ready */
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    setDoubleParam(AravisConnectTime, epicsTimeDiffInSeconds(&now, &this->connectStart));
+    callParamCallbacks();
+
+    printf("aravisCamera: Done.\n");
+    return (asynStatus) status;
+}
+
+/** Open the camera outside the lock, which is where discovery and genicam
+  * download spend their time, then take the lock to finish connecting */
+void aravisCamera::connectTask() {
+    ArvCamera *camera;
+
+    epicsTimeGetCurrent(&this->connectStart);
+    printf("aravisCamera: Looking for camera '%s'... \n", this->cameraName);
+    camera = aravisDiscoveryOpen(this->cameraName);
+
+    this->lock();
+    this->openedCamera = camera;
+    if (camera == NULL || this->connectToCamera()) {
+        setIntegerParam(ADStatus, ADStatusError);
+        setStringParam(ADStatusMessage, "Connect failed");
+    } else {
+        setStringParam(ADStatusMessage, "Connected");
+    }
+    this->connecting = 0;
+    /* connectToCamera read every feature back from the camera, so put back what was asked for */
+    this->replayWrites();
+    callParamCallbacks();
+    this->unlock();
+}
+
+/** Keep a write made while the connect thread is still connecting, such as
+  * from PINI records or autosave at iocInit. Only the last value for each
+  * parameter is kept, in the order the parameters were first written.
+  * lock taken */
+void aravisCamera::deferWrite(int function, int isFloat, epicsFloat64 value) {
+    struct feature_cmd *cmd;
+    GList *iter;
+    for (iter = this->pendingWrites; iter != NULL; iter = iter->next) {
+        cmd = (struct feature_cmd *) iter->data;
+        if (cmd->function == function) {
+            cmd->value = value;
+            return;
+        }
+    }
+    cmd = (struct feature_cmd *) calloc(1, sizeof(struct feature_cmd));
+    cmd->function = function;
+    cmd->isFloat = isFloat;
+    cmd->value = value;
+    epicsTimeGetCurrent(&cmd->queued);
+    this->pendingWrites = g_list_append(this->pendingWrites, cmd);
+}
+
+/** Write everything deferWrite kept, now that the camera is connected. If
+  * the connect failed they fail as they would have done anyway.
+  * lock taken */
+void aravisCamera::replayWrites() {
+    int reason = this->pasynUserSelf->reason;
+    GList *writes = this->pendingWrites;
+    GList *iter;
+
+    this->pendingWrites = NULL;
+    if (writes != NULL) {
+        printf("aravisCamera: %s: Applying %u setting(s) written while connecting\n",
+               this->portName, g_list_length(writes));
+    }
+    for (iter = writes; iter != NULL; iter = iter->next) {
+        struct feature_cmd *cmd = (struct feature_cmd *) iter->data;
+        this->pasynUserSelf->reason = cmd->function;
+        if (cmd->isFloat) {
+            this->writeFloat64(this->pasynUserSelf, cmd->value);
+        } else {
+            this->writeInt32(this->pasynUserSelf, (epicsInt32) cmd->value);
+        }
+        free(cmd);
+    }
+    g_list_free(writes);
+    this->pasynUserSelf->reason = reason;
+}
+
+/** Called when asyn clients call pasynInt32->write().
+  * This function performs actions for some parameters, including ADAcquire, ADColorMode, etc.
+  * For all parameters it sets the value in the parameter library and calls any registered callbacks..
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Value to write. */
+asynStatus aravisCamera::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    epicsInt32 rbv;
+    const char  *   reasonName = "unknownReason";
+    getParamName( 0, function, &reasonName );
+
+    /* Set the parameter and readback in the parameter library.  This may be overwritten when we read back the
+     * status at the end, but that's OK */
+    getIntegerParam(function, &rbv);
+    status = setIntegerParam(function, value);
+
+    /* If we have no camera, then just fail */
+    if (function == AravisReset) {
+        epicsTimeGetCurrent(&this->connectStart);
+        status = this->connectToCamera();
+    } else if (function == AravisShm && !value) {
+        /* always allow the region to be removed */
+        status = this->setShm();
+    } else if (function == AravisRecord && !value) {
+        /* always allow the file to be closed */
+        status = this->stopRecording();
+    } else if (this->connecting) {
+        /* apply it when the connect thread has finished */
+        this->deferWrite(function, 0, value);
+    } else if (this->camera == NULL || this->connectionValid != 1) {
+        if (rbv != value)
+            setIntegerParam(ADStatus, ADStatusDisconnected);
+        status = asynError;
+    } else if (function == AravisConnection) {
+        if (this->connectionValid != 1) status = asynError;
+    } else if (function == AravisLeftShift) {
         if (value < 0 || value > 1) {
             setIntegerParam(function, rbv);
             status = asynError;
         }
     } else if (function == ADAcquire) {
         if (value) {
-            /* This was a command to start acquisition */
+            /* This was a command to start acquisition, count lost frames from here */
+            epicsAtomicSetIntT(&this->lastMissingId, 0);
+            epicsAtomicSetSizeT(&this->nDroppedWire, 0);
+            epicsAtomicSetSizeT(&this->nDroppedQueue, 0);
+            epicsAtomicSetSizeT(&this->nBadFrames, 0);
+            epicsAtomicSetSizeT(&this->nDroppedNewest, 0);
+            epicsAtomicSetSizeT(&this->nDroppedOldest, 0);
+            epicsAtomicSetSizeT(&this->nDecimated, 0);
+            this->resetTriggerStats();
+            /* feature writes queued before the start must land before it */
+            this->drainCommands();
             status = this->start();
         } else {
             /* This was a command to stop acquisition */
@@ -696,23 +3129,119 @@ asynStatus aravisCamera::writeInt32(asynUser *pasynUser, epicsInt32 value)
             setIntegerParam(ADNumExposures, 1);
             status = asynError;
         }
-    } else if (function == AravisGetFeatures || function == AravisFrameRetention
-            || function == AravisPktResend   || function == AravisPktTimeout 
-            || function == AravisHWImageMode) {
+    } else if (function == AravisFrameRetention || function == AravisPktResend
+            || function == AravisPktTimeout     || function == AravisSocketBuffer
+            || function == AravisSocketBufferSize) {
+        /* these can be changed on a running stream */
+        status = this->setStreamProperties();
+    } else if (function == AravisAutoPktSize || function == AravisPktSize || function == AravisPktDelay) {
+        status = this->setTransport();
+    } else if (function == AravisAutoTune || function == AravisPktTimeoutMin || function == AravisPktTimeoutMax
+            || function == AravisFrameRetentionMin || function == AravisFrameRetentionMax) {
+        /* start a new tuning window with the new bounds */
+        this->resetStreamTuning();
+    } else if (function == AravisChunkMode) {
+        status = this->setChunks();
+    } else if (function == AravisEventMode) {
+        status = this->setEvents();
+    } else if (function == AravisRingMode || function == AravisRingPreCount) {
+        if (value < 0 || (function == AravisRingPreCount && value > NRING)) {
+            setIntegerParam(function, rbv);
+            status = asynError;
+        }
+        /* the held frames no longer match what was asked for */
+        this->clearRing();
+    } else if (function == AravisRingTrigger) {
+        if (value) this->flushRing();
+        setIntegerParam(AravisRingTrigger, 0);
+    } else if (function == AravisOverflowPolicy) {
+        if (value < ARAVIS_OVERFLOW_DROP_NEWEST || value > ARAVIS_OVERFLOW_KEEP_NTH) {
+            setIntegerParam(function, rbv);
+            status = asynError;
+        } else {
+            epicsAtomicSetIntT(&this->overflowPolicy, value);
+        }
+    } else if (function == AravisKeepNth) {
+        if (value < 1) {
+            setIntegerParam(function, rbv);
+            status = asynError;
+        } else {
+            epicsAtomicSetIntT(&this->keepNth, value);
+        }
+    } else if (function == AravisRecord) {
+        status = this->startRecording();
+        if (status) setIntegerParam(AravisRecord, 0);
+    } else if (function == AravisShm || function == AravisShmSlots) {
+        if (function == AravisShmSlots && value < 1) {
+            setIntegerParam(function, rbv);
+            status = asynError;
+        }
+        status = (asynStatus) (status | this->setShm());
+    } else if (function == AravisRecordPreview) {
+        if (value < 0) {
+            setIntegerParam(function, rbv);
+            status = asynError;
+        }
+    } else if (function == AravisThrottle) {
+        /* restores the requested frame rate if turned off */
+        this->throttleFrameRate();
+    } else if (function == AravisTrigger) {
+        if (value) status = this->sendTrigger();
+        setIntegerParam(AravisTrigger, 0);
+    } else if (function == AravisBwPacing) {
+        this->applyBandwidthShare(1);
+    } else if (function == AravisBlockReads) {
+        this->blockPlanValid = 0;
+    } else if (function == AravisAsyncWrites) {
+        /* anything still queued runs now, in order, before writes go direct */
+        if (!value) this->drainCommands();
+        else setDoubleParam(AravisCmdLatencyMax, 0);
+    } else if (function == AravisAEMode) {
+        /* the camera's own auto modes would fight us */
+        if (value != ARAVIS_AE_OFF) {
+            if (arv_device_get_feature(this->device, "ExposureAuto") != NULL)
+                arv_device_set_string_feature_value(this->device, "ExposureAuto", "Off");
+            if (arv_device_get_feature(this->device, "GainAuto") != NULL)
+                arv_device_set_string_feature_value(this->device, "GainAuto", "Off");
+            this->invalidateEnums("ExposureAuto");
+            this->invalidateEnums("GainAuto");
+        }
+        this->aeSettle = 0;
+        this->aeFrames = 0;
+        this->aeState = value != ARAVIS_AE_OFF ? ARAVIS_AE_STATE_ADJUSTING : ARAVIS_AE_STATE_OFF;
+        setIntegerParam(AravisAEState, this->aeState);
+    } else if (function == AravisPreLoadDark || function == AravisPreLoadFlat) {
+        status = this->loadCalibration(function == AravisPreLoadFlat);
+    } else if (function == AravisPreSaveDark || function == AravisPreSaveFlat) {
+        status = this->saveCalibration(function == AravisPreSaveFlat);
+    } else if (function == AravisPreCapture) {
+        if (value != ARAVIS_PRE_CAPTURE_NONE && value != ARAVIS_PRE_CAPTURE_DARK &&
+                value != ARAVIS_PRE_CAPTURE_FLAT) {
+            setIntegerParam(function, rbv);
+            status = asynError;
+        } else {
+            /* the capture starts on the next frame, when its size is known */
+            this->preCapture = value;
+            this->preCaptureStarted = 0;
+            setIntegerParam(AravisPreCaptured, 0);
+        }
+    } else if (function == AravisCentroid) {
+        /* start the worst case again with the new setting */
+        setDoubleParam(AravisCentroidLatencyMax, 0);
+    } else if (function == AravisGetFeatures || function == AravisHWImageMode || function == AravisStats ||
+               function == AravisAERoiX || function == AravisAERoiY || function == AravisAERoiW ||
+               function == AravisAERoiH || function == AravisAESettle ||
+               function == AravisCentroidRoiX || function == AravisCentroidRoiY ||
+               function == AravisCentroidRoiW || function == AravisCentroidRoiH || function == AravisTimingAttrs ||
+               function == AravisPreDark || function == AravisPreFlat || function == AravisPreFlipX ||
+               function == AravisPreFlipY || function == AravisPreCaptureFrames) {
         /* just write the value for these as they get fetched via getIntegerParam when needed */
     } else if (function < FIRST_ARAVIS_CAMERA_PARAM) {
         /* If this parameter belongs to a base class call its method */
         status = ADDriver::writeInt32(pasynUser, value);
     /* generic feature lookup */
-    } else if (g_hash_table_lookup_extended(this->featureLookup, &function, NULL, NULL)) {
-        featureName = (char *) g_hash_table_lookup(this->featureLookup, &function);
-        feature = arv_device_get_feature(this->device, featureName);
-        if (ARV_IS_GC_COMMAND(feature)) {
-            arv_gc_command_execute(ARV_GC_COMMAND(feature), NULL);
-        } else {
-            status = this->setIntegerValue(featureName, value, &rbv);
-            if (status) setIntegerParam(function, rbv);
-        }
+    } else if (this->findFeature(function) != NULL) {
+        status = this->writeFeature(function, 0, value);
     } else {
            status = asynError;
     }
@@ -745,8 +3274,6 @@ asynStatus aravisCamera::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
     int function = pasynUser->reason;
     double rbv = 0;
     asynStatus status = asynSuccess;
-    char *featureName;
-    ArvGcNode *feature;
     const char  *   reasonName = "unknownReason";
     getParamName( 0, function, &reasonName );
 
@@ -755,47 +3282,232 @@ asynStatus aravisCamera::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
     getDoubleParam(function, &rbv);
     status = setDoubleParam(function, value);
 
-    /* If we have no camera, then just fail */
+    /* Apply it when the connect thread has finished, or fail if we have no camera */
+    if (this->connecting) {
+        this->deferWrite(function, 1, value);
+    } else if (this->camera == NULL || this->connectionValid != 1) {
+        status = asynError;
+    /* Gain, exposure, frame rate and the generic feature lookup */
+    } else if (function == ADGain || function == ADAcquireTime || function == ADAcquirePeriod ||
+            this->findFeature(function) != NULL) {
+        status = this->writeFeature(function, 1, value);
+    } else {
+        /* If this parameter belongs to a base class call its method */
+        if (function < FIRST_ARAVIS_CAMERA_PARAM) status = ADDriver::writeFloat64(pasynUser, value);
+    }
+
+    /* A failed feature write leaves the readback in the parameter */
+    if (status) getDoubleParam(function, &rbv);
+
+    /* Do callbacks so higher layers see any changes */
+    callParamCallbacks();
+    if (status)
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+              "%s:writeFloat64 error, status=%d function=%d %s, value=%f, rbv=%f\n",
+              driverName, status, function, reasonName, value, rbv);
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "%s:writeFloat64: function=%d %s, value=%f\n",
+              driverName, function, reasonName, value);
+    return status;
+}
+
+/** Write a camera feature, either now or through the command thread
+    lock taken */
+asynStatus aravisCamera::writeFeature(int function, int isFloat, epicsFloat64 value) {
+    struct feature_cmd cmd;
+    int asyncWrites;
+
+    getIntegerParam(AravisAsyncWrites, &asyncWrites);
+    if (asyncWrites) {
+        return this->queueFeature(function, isFloat, value);
+    }
+    cmd.function = function;
+    cmd.isFloat = isFloat;
+    cmd.value = value;
+    epicsTimeGetCurrent(&cmd.queued);
+    return this->executeFeature(&cmd);
+}
+
+/** Queue a camera feature write for the command thread, whatever ASYNC_WRITES says
+    lock taken */
+asynStatus aravisCamera::queueFeature(int function, int isFloat, epicsFloat64 value) {
+    const char *functionName = "queueFeature";
+    struct feature_cmd cmd;
+
+    cmd.function = function;
+    cmd.isFloat = isFloat;
+    cmd.value = value;
+    epicsTimeGetCurrent(&cmd.queued);
+    /* The parameter already holds the new value, so the record completes now and
+     * the readback follows when the command thread has written it */
+    if (epicsMessageQueueTrySend(this->cmdQId, &cmd, sizeof(cmd)) != 0) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: Command queue full, increase NCOMMANDS\n",
+                    driverName, functionName);
+        return asynError;
+    }
+    setIntegerParam(AravisCmdQueue, epicsMessageQueuePending(this->cmdQId));
+    epicsEventSignal(this->cmdEvent);
+    return asynSuccess;
+}
+
+/** Perform a feature write and time it. The parameter library is only
+  * touched with the port lock, so the command thread can call this without it
+    device lock taken */
+asynStatus aravisCamera::executeFeature(struct feature_cmd *cmd) {
+    asynStatus status;
+    epicsTimeStamp start, end;
+    double latency, latencyMax;
+
+    epicsTimeGetCurrent(&start);
+    ARAVIS_TRACE3(feature_write, this->portName, cmd->function, cmd->isFloat);
     if (this->camera == NULL || this->connectionValid != 1) {
         status = asynError;
+    } else if (cmd->isFloat) {
+        status = this->writeFloatFeature(cmd->function, cmd->value);
+    } else {
+        status = this->writeIntegerFeature(cmd->function, (epicsInt32) cmd->value);
+    }
+    epicsTimeGetCurrent(&end);
+    ARAVIS_TRACE3(feature_write_done, this->portName, cmd->function, status);
+    /* the write itself, and the write plus any time spent waiting in the queue */
+    latency = 1000 * epicsTimeDiffInSeconds(&end, &cmd->queued);
+    this->lockPort();
+    setDoubleParam(AravisCmdWriteTime, 1000 * epicsTimeDiffInSeconds(&end, &start));
+    getDoubleParam(AravisCmdLatencyMax, &latencyMax);
+    setDoubleParam(AravisCmdLatency, latency);
+    if (latency > latencyMax) setDoubleParam(AravisCmdLatencyMax, latency);
+    this->unlockPort();
+    /* Anything that depends on what we wrote is stale now, don't wait for the poller */
+    if (status == asynSuccess) {
+        struct aravis_feature *entry = this->findFeature(cmd->function);
+        if (entry != NULL) this->refreshDependents(&entry->node, 1, entry);
+    }
+    return status;
+}
+
+/** Run every queued feature write now, in order
+    lock taken */
+void aravisCamera::drainCommands() {
+    const char *functionName = "drainCommands";
+    struct feature_cmd cmd;
+    const char *reasonName;
+
+    while (epicsMessageQueueTryReceive(this->cmdQId, &cmd, sizeof(cmd)) == (int) sizeof(cmd)) {
+        if (this->executeFeature(&cmd)) {
+            reasonName = "unknownReason";
+            getParamName(0, cmd.function, &reasonName);
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: error writing %s, value=%f\n",
+                        driverName, functionName, reasonName, cmd.value);
+        }
+    }
+    setIntegerParam(AravisCmdQueue, 0);
+}
+
+/** Feature writes wait here so that the record writing them doesn't block on GVCP.
+  * Each write holds the device lock for its round trip but not the port lock, so
+  * the frame thread and parameter-only writes carry on, and anything else that
+  * talks to the camera waits for it. The device lock is let go in between.
+  * Commands are only taken off the queue with the device lock held, so
+  * drainCommands sees every write that hasn't happened yet */
+void aravisCamera::commandTask() {
+    const char *functionName = "commandTask";
+    struct feature_cmd cmd;
+    const char *reasonName;
+    asynStatus status;
+
+    while (1) {
+        epicsEventWait(this->cmdEvent);
+        epicsMutexMustLock(this->deviceLock);
+        while (epicsMessageQueueTryReceive(this->cmdQId, &cmd, sizeof(cmd)) == (int) sizeof(cmd)) {
+            status = this->executeFeature(&cmd);
+            this->lockPort();
+            if (status) {
+                reasonName = "unknownReason";
+                getParamName(0, cmd.function, &reasonName);
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                            "%s:%s: error writing %s, value=%f\n",
+                            driverName, functionName, reasonName, cmd.value);
+            }
+            setIntegerParam(AravisCmdQueue, epicsMessageQueuePending(this->cmdQId));
+            callParamCallbacks();
+            this->unlockPort();
+            /* let the rest of the driver at the camera in between commands */
+            epicsMutexUnlock(this->deviceLock);
+            epicsMutexMustLock(this->deviceLock);
+        }
+        epicsMutexUnlock(this->deviceLock);
+    }
+}
+
+/** Write an integer feature, or execute a command feature
+    device lock taken */
+asynStatus aravisCamera::writeIntegerFeature(int function, epicsInt32 value) {
+    asynStatus status = asynSuccess;
+    epicsInt32 rbv = value;
+    struct aravis_feature *entry = this->findFeature(function);
+    char *featureName;
+    ArvGcNode *feature;
+
+    if (entry == NULL || entry->node == NULL) return asynError;
+    featureName = entry->name;
+    feature = entry->node;
+    if (ARV_IS_GC_COMMAND(feature)) {
+        arv_gc_command_execute(ARV_GC_COMMAND(feature), NULL);
+    } else {
+        status = this->setIntegerValue(featureName, value, &rbv);
+        if (status) {
+            this->lockPort();
+            setIntegerParam(function, rbv);
+            this->unlockPort();
+        }
+    }
+    return status;
+}
+
+/** Write a float feature, converting units for gain, exposure and frame rate
+    device lock taken */
+asynStatus aravisCamera::writeFloatFeature(int function, epicsFloat64 value) {
+    asynStatus status = asynSuccess;
+    double rbv = value;
+    struct aravis_feature *entry = this->findFeature(function);
+    char *featureName;
+    ArvGcNode *feature;
+
+    if (entry == NULL || entry->node == NULL) return asynError;
+    featureName = entry->name;
+    feature = entry->node;
+
     /* Gain */
-    } else if (function == ADGain) {
-        featureName = (char *) g_hash_table_lookup(this->featureLookup, &function);
-        if (featureName == NULL) {
-            status = asynError;
+    if (function == ADGain) {
+        if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(feature)) == G_TYPE_DOUBLE) {
+            status = this->setFloatValue(featureName, value, &rbv);
         } else {
-            feature = arv_device_get_feature(this->device, featureName);
-            if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(feature)) == G_TYPE_DOUBLE) {
-                status = this->setFloatValue(featureName, value, &rbv);
-            } else {
-                epicsInt32 i_rbv, i_value = (epicsInt32) value;
-                status = this->setIntegerValue(featureName, i_value, &i_rbv);
-                if (strcmp("GainRawChannelA", featureName) == 0) this->setIntegerValue("GainRawChannelB", i_value, NULL);
-                rbv = i_rbv;
-            }
-            if (status) setDoubleParam(function, rbv);
+            epicsInt32 i_rbv, i_value = (epicsInt32) value;
+            status = this->setIntegerValue(featureName, i_value, &i_rbv);
+            if (strcmp("GainRawChannelA", featureName) == 0) this->setIntegerValue("GainRawChannelB", i_value, NULL);
+            rbv = i_rbv;
         }
+        this->lockPort();
+        if (status) setDoubleParam(function, rbv);
+        this->unlockPort();
     /* Acquire time / exposure */
     } else if (function == ADAcquireTime) {
-        featureName = (char *) g_hash_table_lookup(this->featureLookup, &function);
-        if (featureName == NULL) {
-            status = asynError;
+        if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(feature)) == G_TYPE_DOUBLE) {
+          status = this->setFloatValue(featureName, value * 1000000, &rbv);
         } else {
-          feature = arv_device_get_feature(this->device, featureName);
-          if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(feature)) == G_TYPE_DOUBLE) {
-            status = this->setFloatValue(featureName, value * 1000000, &rbv);
-          } else {
-            epicsInt32 i_rbv, i_value = (epicsInt32) (value * 1000000);
-            status = this->setIntegerValue(featureName, i_value, &i_rbv);
-            rbv = i_rbv;
-          }
-          if (status) setDoubleParam(function, rbv / 1000000);
+          epicsInt32 i_rbv, i_value = (epicsInt32) (value * 1000000);
+          status = this->setIntegerValue(featureName, i_value, &i_rbv);
+          rbv = i_rbv;
         }
+        this->lockPort();
+        if (status) setDoubleParam(function, rbv / 1000000);
+        this->unlockPort();
     /* Acquire period / framerate */
     } else if (function == ADAcquirePeriod) {
-        featureName = (char *) g_hash_table_lookup(this->featureLookup, &function);
         if (value <= 0.0) value = 0.1;
-        feature = arv_device_get_feature(this->device, featureName);
         if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(feature)) == G_TYPE_DOUBLE) {
           status = this->setFloatValue(featureName, 1/value, &rbv);
         } else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(feature)) == G_TYPE_INT64) {
@@ -807,27 +3519,66 @@ asynStatus aravisCamera::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
         } else {
           status = asynError;
         }
+        this->lockPort();
         if (status) setDoubleParam(function, 1/rbv);
+        /* this is the new rate to return to, the throttle and pacing start again from it */
+        this->throttleRequested = 0;
+        this->paceRequested = 0;
+        setIntegerParam(AravisThrottled, 0);
+        setIntegerParam(AravisBwLimited, 0);
+        this->updateBandwidth();
+        this->unlockPort();
     /* generic feature lookup */
-    } else if (g_hash_table_lookup_extended(this->featureLookup, &function, NULL, NULL)) {
-        featureName = (char *) g_hash_table_lookup(this->featureLookup, &function);
+    } else {
         status = this->setFloatValue(featureName, value, &rbv);
+        this->lockPort();
         if (status) setDoubleParam(function, rbv);
-    } else {
+        this->unlockPort();
+    }
+    return status;
+}
+
+/** Called when asyn clients call pasynOctet->write().
+  * This function performs actions for ARAVIS_CHUNKS and ARAVIS_EVENTS, other parameters are passed to the base class.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Address of the string to write.
+  * \param[in] nChars Number of characters to write.
+  * \param[out] nActual Number of characters actually written. */
+asynStatus aravisCamera::writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    const char  *   reasonName = "unknownReason";
+    getParamName( 0, function, &reasonName );
+
+    if (function != AravisChunks && function != AravisEvents) {
         /* If this parameter belongs to a base class call its method */
-        if (function < FIRST_ARAVIS_CAMERA_PARAM) status = ADDriver::writeFloat64(pasynUser, value);
+        return ADDriver::writeOctet(pasynUser, value, nChars, nActual);
+    }
+
+    /* Set the parameter in the parameter library. */
+    status = setStringParam(function, value);
+    if (this->connecting) {
+        /* connectToCamera applies the chunk and event selection from the parameter */
+    } else if (this->camera == NULL || this->connectionValid != 1) {
+        status = asynError;
+    } else if (function == AravisChunks) {
+        status = this->setChunks();
+    } else {
+        status = this->setEvents();
     }
 
     /* Do callbacks so higher layers see any changes */
     callParamCallbacks();
     if (status)
         asynPrint(pasynUser, ASYN_TRACE_ERROR,
-              "%s:writeFloat64 error, status=%d function=%d %s, value=%f, rbv=%f\n",
-              driverName, status, function, reasonName, value, rbv);
+              "%s:writeOctet error, status=%d function=%d %s, value=%s\n",
+              driverName, status, function, reasonName, value);
     else
         asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
-              "%s:writeFloat64: function=%d %s, value=%f\n",
+              "%s:writeOctet: function=%d %s, value=%s\n",
               driverName, function, reasonName, value);
+    *nActual = nChars;
     return status;
 }
 
@@ -835,9 +3586,8 @@ asynStatus aravisCamera::readEnum(asynUser *pasynUser, char *strings[], int valu
                                   size_t nElements, size_t *nIn)
 {
     int function = pasynUser->reason;
-    guint numEnums;
-    unsigned int i;
-    char *featureName;
+    size_t i;
+    struct aravis_feature *entry;
     ArvGcNode *feature;
     //static const char *functionName = "readEnum";
 
@@ -848,21 +3598,13 @@ asynStatus aravisCamera::readEnum(asynUser *pasynUser, char *strings[], int valu
         return asynError;
     }
     
-    featureName = (char *) g_hash_table_lookup(this->featureLookup, &function);
-    if (featureName == NULL) {
+    entry = this->findFeature(function);
+    if (entry == NULL || entry->node == NULL) {
         return asynError;
     }
-    feature = arv_device_get_feature(this->device, featureName);
+    feature = entry->node;
     if (!ARV_IS_GC_ENUMERATION (feature)) {
-        return asynError;
-    }
-    if ((!arv_gc_feature_node_is_available(ARV_GC_FEATURE_NODE(feature), NULL)) ||
-        (arv_gc_feature_node_is_locked(ARV_GC_FEATURE_NODE(feature), NULL))) {
-        if (strings[0]) free(strings[0]);
-        strings[0] = epicsStrDup("N.A.");
-        values[0] = 0;
-        *nIn = 1;
-        return asynSuccess;
+        return asynError;
     }
     // There are a few enums we don't want to autogenerate the values
     //    if ((function == SPConvertPixelFormat) ||
@@ -870,17 +3612,15 @@ asynStatus aravisCamera::readEnum(asynUser *pasynUser, char *strings[], int valu
     //        return asynError;
     //    }
 
-    ArvGcEnumeration *enumeration = (ARV_GC_ENUMERATION (feature));
-    gint64 *enumValues = arv_gc_enumeration_get_available_int_values(enumeration, &numEnums, NULL);
-    const char **enumStrings = arv_gc_enumeration_get_available_string_values(enumeration, &numEnums, NULL);
-    for (i=0; ((i<numEnums) && (i<nElements)); i++) {
+    /* Serve the cached choices, telling other clients too if they have just changed */
+    this->updateEnumChoices(entry);
+    for (i=0; ((i<entry->nEnums) && (i<nElements)); i++) {
         if (strings[i]) free(strings[i]);
-        strings[i] = epicsStrDup(enumStrings[i]);
-        values[i] = enumValues[i];
+        strings[i] = epicsStrDup(entry->enumStrings[i]);
+        values[i] = entry->enumValues[i];
         severities[i] = 0;
         *nIn = i+1;
     }
-    g_free(enumStrings);
     return asynSuccess;
 }
 
@@ -901,6 +3641,15 @@ void aravisCamera::report(FILE *fp, int details)
         getIntegerParam(NDDataType, &dataType);
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
         fprintf(fp, "  Data type:         %d\n", dataType);
+        fprintf(fp, "  Features:          %u\n", this->featureList->len);
+    }
+    if (details > 1) {
+        static const char *pollClasses[] = {"single", "block", "never"};
+        for (unsigned int i = 0; i < this->featureList->len; i++) {
+            struct aravis_feature *feature = (struct aravis_feature *) g_ptr_array_index(this->featureList, i);
+            fprintf(fp, "    %4d %-40s %-6s %s\n", feature->reason, feature->name,
+                    pollClasses[feature->pollClass], feature->node ? "" : "(not on camera)");
+        }
     }
     /* Invoke the base class method */
     ADDriver::report(fp, details);
@@ -923,7 +3672,9 @@ asynStatus aravisCamera::allocBuffer() {
         return asynError;
     }
 
+    ARAVIS_TRACE2(alloc_buffer, this->portName, this->payload);
     pRaw = this->pNDArrayPool->alloc(2, bufferDims, NDInt8, this->payload, NULL);
+    ARAVIS_TRACE2(alloc_buffer_done, this->portName, pRaw != NULL);
     if (pRaw==NULL) {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                     "%s:%s: error allocating raw buffer\n",
@@ -940,8 +3691,9 @@ asynStatus aravisCamera::allocBuffer() {
     this->camera exists, lock not taken */
 void aravisCamera::run() {
     epicsTimeStamp lastFeatureGet, now;
-    int getFeatures, numImagesCounter, imageMode, numImages, acquire;
+    int getFeatures, numImagesCounter, imageMode, numImages, acquire, done;
     const char *functionName = "run";
+    struct frame_msg msg;
     ArvBuffer *buffer;
 
     /* Wait for database to be up */
@@ -953,7 +3705,7 @@ void aravisCamera::run() {
     epicsTimeGetCurrent(&lastFeatureGet);
     while (1) {
         /* Wait 5ms for an array to arrive from the queue */
-        if (epicsMessageQueueReceiveWithTimeout(this->msgQId, &buffer, sizeof(&buffer), 0.005) == -1) {
+        if (epicsMessageQueueReceiveWithTimeout(this->msgQId, &msg, sizeof(msg), 0.005) == -1) {
             /* No array, so if there is a camera, get the next feature*/
             if (this->camera != NULL && this->connectionValid == 1) {
                 /* We only want to get a feature once every 25ms (max 40 features/s)
@@ -967,15 +3719,26 @@ void aravisCamera::run() {
                         this->getNextFeature();
                         callParamCallbacks();
                     }
+                    /* Pick up any change to our share of the link bandwidth */
+                    this->applyBandwidthShare(0);
+                    this->throttleFrameRate();
                     this->unlock();
                 }
             }
         } else {
-            /* Got a buffer, so lock up and process it */
-            this->lock();
+            /* Got a buffer, so lock up and process it. Only the port lock is
+             * needed for that, so a feature write in flight doesn't hold it up */
+            buffer = msg.buffer;
+            ARAVIS_TRACE3(queue_receive, this->portName, arv_buffer_get_frame_id(buffer),
+                          g_get_real_time() - msg.received);
+            this->lockPort();
             getIntegerParam(ADAcquire, &acquire);
+            done = 0;
             if (acquire) {
-                this->processBuffer(buffer);
+                ARAVIS_TRACE2(process_start, this->portName, arv_buffer_get_frame_id(buffer));
+                int processStatus = this->processBuffer(buffer, msg.received, msg.monotonic);
+                ARAVIS_TRACE3(process_done, this->portName, arv_buffer_get_frame_id(buffer), processStatus);
+                (void) processStatus;
                 /* free memory */
                 g_object_unref(buffer);
                 /* See if acquisition is done */
@@ -985,12 +3748,7 @@ void aravisCamera::run() {
                 if ((imageMode == ADImageSingle) ||
                     ((imageMode == ADImageMultiple) &&
                      (numImagesCounter >= numImages))) {
-                    this->stop();
-                    // Want to make sure we're idle before we callback on ADAcquire
-                    callParamCallbacks();
-                    setIntegerParam(ADAcquire, 0);
-                    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                          "%s:%s: acquisition completed\n", driverName, functionName);
+                    done = 1;
                 } else {
                     /* Allocate the new raw buffer we use to compute images. */
                     this->allocBuffer();
@@ -999,21 +3757,46 @@ void aravisCamera::run() {
                 // We recieved a buffer that we didn't request
                 g_object_unref(buffer);
             }
-            this->unlock();
+            this->unlockPort();
+            if (done) {
+                /* stopping talks to the camera, so wait for any write in flight */
+                this->lock();
+                getIntegerParam(ADAcquire, &acquire);
+                if (acquire) {
+                    this->stop();
+                    // Want to make sure we're idle before we callback on ADAcquire
+                    callParamCallbacks();
+                    setIntegerParam(ADAcquire, 0);
+                    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                          "%s:%s: acquisition completed\n", driverName, functionName);
+                }
+                this->unlock();
+            } else if (acquire && epicsMutexTryLock(this->deviceLock) == epicsMutexLockOK) {
+                /* the queue is never empty when we are behind, so check the backlog and
+                 * the bandwidth share here too, unless a write has the camera */
+                this->lockPort();
+                this->applyBandwidthShare(0);
+                this->throttleFrameRate();
+                this->unlockPort();
+                epicsMutexUnlock(this->deviceLock);
+            }
         }
     }
 }
 
-asynStatus aravisCamera::processBuffer(ArvBuffer *buffer) {
+asynStatus aravisCamera::processBuffer(ArvBuffer *buffer, gint64 received, gint64 monotonic) {
     int arrayCallbacks, imageCounter, numImages, numImagesCounter, imageMode;
     int colorMode, dataType, bayerFormat;
     size_t expected_size;
-    int xDim=0, yDim=1, binX, binY, left_shift;
+    int xDim=0, yDim=1, binX, binY, left_shift, timing;
     double acquirePeriod;
     const char *functionName = "processBuffer";
-    guint64 n_completed_buffers, n_failures, n_underruns;
     NDArray *pRaw;
 
+    /* Monotonic clock, so the frame timings are immune to NTP steps */
+    getIntegerParam(AravisTimingAttrs, &timing);
+    gint64 processStart = timing ? g_get_monotonic_time() : 0;
+
     /* Get the current parameters */
     getIntegerParam(NDArrayCounter, &imageCounter);
     getIntegerParam(ADNumImages, &numImages);
@@ -1047,6 +3830,8 @@ asynStatus aravisCamera::processBuffer(ArvBuffer *buffer) {
     /* Put the frame number and time stamp into the buffer */
     pRaw->uniqueId = imageCounter;
     pRaw->timeStamp = arv_buffer_get_timestamp(buffer) / 1.e9;
+    epicsInt32 frameId = (epicsInt32) arv_buffer_get_frame_id(buffer);
+    setIntegerParam(AravisFrameId, frameId);
 
     /* Update the areaDetector timeStamp */
     updateTimeStamp(&pRaw->epicsTS);
@@ -1054,6 +3839,25 @@ asynStatus aravisCamera::processBuffer(ArvBuffer *buffer) {
     /* Get any attributes that have been defined for this driver */
     this->getAttributes(pRaw->pAttributeList);
 
+    /* Pair the frame with the oldest software trigger still waiting */
+    this->matchTrigger(pRaw, received);
+
+    /* Parse per-frame metadata from the chunk trailer; this reads the buffer, not the camera */
+    int hasChunks = this->chunkParser != NULL && arv_buffer_has_chunks(buffer);
+    if (hasChunks) {
+        for (int i = 0; i < this->nChunks; i++) {
+            if (this->chunks[i].isFloat) {
+                epicsFloat64 value = arv_chunk_parser_get_float_value(this->chunkParser, buffer, this->chunks[i].feature);
+                this->chunks[i].attr->setValue(&value);
+            } else {
+                epicsInt64 value = arv_chunk_parser_get_integer_value(this->chunkParser, buffer, this->chunks[i].feature);
+                this->chunks[i].attr->setValue(&value);
+            }
+        }
+    }
+
+    ARAVIS_TRACE3(process_stage, this->portName, frameId, "attributes");
+
     /* Annotate it with its dimensions */
     int pixel_format = arv_buffer_get_image_pixel_format(buffer);
     if (this->lookupColorMode(pixel_format, &colorMode, &dataType, &bayerFormat) != asynSuccess) {
@@ -1062,8 +3866,12 @@ asynStatus aravisCamera::processBuffer(ArvBuffer *buffer) {
                     driverName, functionName, pixel_format);
         return asynError;
     }
-    pRaw->pAttributeList->add("BayerPattern", "Bayer Pattern", NDAttrInt32, &bayerFormat);
-    pRaw->pAttributeList->add("ColorMode", "Color Mode", NDAttrInt32, &colorMode);
+    this->attrBayerPattern->setValue(&bayerFormat);
+    this->attrColorMode->setValue(&colorMode);
+    this->attrFrameId->setValue(&frameId);
+    this->frameAttributes->copy(pRaw->pAttributeList);
+    /* not on frames from before chunk mode took effect */
+    if (hasChunks) this->chunkAttributes->copy(pRaw->pAttributeList);
     pRaw->dataType = (NDDataType_t) dataType;
     int width = arv_buffer_get_image_width(buffer);
     int height = arv_buffer_get_image_height(buffer);
@@ -1101,40 +3909,107 @@ asynStatus aravisCamera::processBuffer(ArvBuffer *buffer) {
     pRaw->dims[yDim].offset  = y_offset;
     pRaw->dims[yDim].binning = binY;
 
-    /* If we are 16 bit, shift by the correct amount */
+    /* Write the raw payload, before it is shifted, straight to disk */
+    int preview = 1;
+    if (this->recorder != NULL) {
+        aravisRecordHeader header;
+        int previewNth;
+        memset(&header, 0, sizeof(header));
+        header.magic = ARAVIS_RECORD_MAGIC;
+        header.headerSize = sizeof(header);
+        header.dataSize = (uint32_t) size;
+        header.frameId = (uint32_t) frameId;
+        header.timestamp = arv_buffer_get_timestamp(buffer);
+        header.received = received;
+        header.width = width;
+        header.height = height;
+        header.xOffset = x_offset;
+        header.yOffset = y_offset;
+        header.pixelFormat = pixel_format;
+        header.uniqueId = imageCounter;
+        aravisRecorderWrite(this->recorder, &header, pRaw->pData);
+        ARAVIS_TRACE3(process_stage, this->portName, frameId, "record");
+        /* only every Nth recorded frame goes to the plugins, none if N is 0 */
+        getIntegerParam(AravisRecordPreview, &previewNth);
+        preview = previewNth > 0 && (this->recordPreviewCount++ % previewNth) == 0;
+    }
+
+    /* If we are 16 bit, find how many bits are significant and the shift that fills them */
+    size_t nsamples = expected_size;
+    int bits = 8, shift = 0, stats;
     if (pRaw->dataType == NDUInt16) {
         expected_size *= 2;
-        if (left_shift) {
-            int shift = 0;
-            switch (pixel_format) {
-                case ARV_PIXEL_FORMAT_MONO_14:
-                    shift = 2;
-                    break;
-                case ARV_PIXEL_FORMAT_MONO_12:
-                    shift = 4;
-                    break;
-                case ARV_PIXEL_FORMAT_MONO_10:
-                    shift = 6;
-                    break;
-                default:
-                    break;
-            }
-            if (shift != 0) {
-                //printf("Shift by %d\n", shift);
-                uint16_t *array = (uint16_t *) pRaw->pData;
-                for (unsigned int ib = 0; ib < size / 2; ib++) {
-                    array[ib] = array[ib] << shift;
-                }
-            }
+        switch (pixel_format) {
+            case ARV_PIXEL_FORMAT_MONO_14:
+                bits = 14;
+                break;
+            case ARV_PIXEL_FORMAT_MONO_12:
+                bits = 12;
+                break;
+            case ARV_PIXEL_FORMAT_MONO_10:
+                bits = 10;
+                break;
+            default:
+                bits = 16;
+                break;
         }
+        if (left_shift) shift = 16 - bits;
     }
 
-    if (expected_size != size) {
+    /* chunk data follows the image, so the buffer is bigger */
+    if (hasChunks ? expected_size > size : expected_size != size) {
         asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
                     "%s:%s: w: %d, h: %d, size: %zu, expected_size: %zu\n",
                     driverName, functionName, width, height, size, expected_size);
         return asynError;
     }
+
+    /* Only the image is shifted or counted, not any chunk data after it. The shift
+     * goes in the first pass over the pixels: statistics if they are on, which then
+     * describe the sensor data before any correction, or else the preprocessing */
+    double frameMean = -1;
+    int stages = pRaw->ndims == 2 ? this->preprocessStages() : 0;
+    int pendingShift = shift;
+    getIntegerParam(AravisStats, &stats);
+    if (stats && this->statsWork == NULL) {
+        this->statsWork = (uint32_t *) malloc(ARAVIS_STATS_WORK * sizeof(uint32_t));
+        if (this->statsWork == NULL) {
+            /* turn them off rather than fail every frame */
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                        "%s:%s: Unable to allocate the statistics histogram, statistics disabled\n",
+                        driverName, functionName);
+            setIntegerParam(AravisStats, 0);
+            stats = 0;
+        }
+    }
+    if (stats) {
+        frameMean = this->computeStatistics(pRaw, nsamples, bits, shift);
+        pendingShift = 0;
+    } else {
+        if (shift != 0 && (stages == 0 || this->preCapture != ARAVIS_PRE_CAPTURE_NONE)) {
+            uint16_t *array = (uint16_t *) pRaw->pData;
+            for (size_t ib = 0; ib < nsamples; ib++) {
+                array[ib] = array[ib] << shift;
+            }
+            pendingShift = 0;
+        }
+    }
+
+    /* Calibration frames are averaged from the shifted, uncorrected pixels */
+    if (this->preCapture != ARAVIS_PRE_CAPTURE_NONE && pRaw->ndims == 2) {
+        this->captureCalibration(pRaw, width, height);
+    }
+    if (stages) this->preprocessFrame(pRaw, width, height, stages, pendingShift);
+
+    ARAVIS_TRACE3(process_stage, this->portName, frameId, "pixels");
+
+    /* Meter the frame and correct exposure for the next one */
+    this->autoExposure(pRaw, width, height, colorMode == NDColorModeRGB1 ? 3 : 1,
+                       pRaw->dataType == NDUInt16 ? (double) (((1 << bits) - 1) << shift) : 255, frameMean);
+
+    /* Beam position goes out before the frame is exported or handed to the plugins */
+    this->publishCentroid(pRaw, width, height, received);
+    ARAVIS_TRACE3(process_stage, this->portName, frameId, "metering");
 /*
     for (int ib = 0; ib<10; ib++) {
         unsigned char *ix = ((unsigned char *)pRaw->pData) + ib;
@@ -1142,28 +4017,65 @@ asynStatus aravisCamera::processBuffer(ArvBuffer *buffer) {
     }
     printf("\n");
 */
-    /* this is a good image, so callback on it */
-    if (arrayCallbacks) {
+    /* Export it to local processes; the slot is big enough for the payload we started with */
+    if (this->shm != NULL) {
+        aravisShmSlot meta;
+        int shmFrames;
+        memset(&meta, 0, sizeof(meta));
+        meta.timestamp = arv_buffer_get_timestamp(buffer);
+        meta.received = received;
+        meta.frameId = frameId;
+        meta.uniqueId = imageCounter;
+        meta.width = width;
+        meta.height = height;
+        meta.pixelFormat = pixel_format;
+        meta.colorMode = colorMode;
+        meta.dataType = dataType;
+        meta.dataSize = (uint32_t) expected_size;
+        if (aravisShmPublish(this->shm, &meta, pRaw->pData) == 0) {
+            getIntegerParam(AravisShmFrames, &shmFrames);
+            setIntegerParam(AravisShmFrames, shmFrames + 1);
+        }
+        ARAVIS_TRACE3(process_stage, this->portName, frameId, "shm");
+    }
+
+    /* Record where the frame has spent its time, up to the plugins getting it */
+    if (timing) {
+        epicsInt64 cameraTimestamp = (epicsInt64) arv_buffer_get_timestamp(buffer);
+        epicsInt64 receiveTime = monotonic;
+        epicsInt64 callbackStart = g_get_monotonic_time();
+        double queueWait = (double) (processStart - monotonic);
+        double processTime = (double) (callbackStart - processStart);
+        void *values[NTIMING_ATTRS] = {&cameraTimestamp, &receiveTime, &queueWait, &processTime, &callbackStart};
+        for (int i = 0; i < NTIMING_ATTRS; i++) {
+            pRaw->pAttributeList->add(timingAttrs[i].name, timingAttrs[i].description, timingAttrs[i].type, values[i]);
+        }
+    }
+
+    /* this is a good image, so callback on it, unless the pre-trigger ring keeps it */
+    if (arrayCallbacks && preview && !this->holdFrame(pRaw)) {
         /* Call the NDArray callback */
         asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
              "%s:%s: calling imageData callback\n", driverName, functionName);
+        ARAVIS_TRACE2(callbacks_start, this->portName, frameId);
         doCallbacksGenericPointer(pRaw, NDArrayData, 0);
+        ARAVIS_TRACE2(callbacks_done, this->portName, frameId);
     }
 
     /* Report statistics */
-    if (this->stream != NULL) {
-        arv_stream_get_statistics(this->stream, &n_completed_buffers, &n_failures, &n_underruns);
-        setDoubleParam(AravisCompleted, (double) n_completed_buffers);
-        setDoubleParam(AravisFailures, (double) n_failures);
-        setDoubleParam(AravisUnderruns, (double) n_underruns);
-
-        if (ARV_IS_GV_DEVICE(this->stream)) {
-            guint64 n_resent_pkts, n_missing_pkts;
-            arv_gv_stream_get_statistics(ARV_GV_STREAM(this->stream), &n_resent_pkts, &n_missing_pkts);
-            setIntegerParam(AravisResentPkts,  (epicsInt32) n_resent_pkts);
-            setIntegerParam(AravisMissingPkts, (epicsInt32) n_missing_pkts);
+    this->reportStatistics();
+
+    /* Time from the first packet of the frame to the stream handing it to us */
+    guint64 system_timestamp = arv_buffer_get_system_timestamp(buffer);
+    if (system_timestamp > 0 && received > 0) {
+        double completion = received - system_timestamp / 1000.0;
+        if (completion >= 0) {
+            this->tuneFrames++;
+            this->tuneCompletionSum += completion;
+            if (completion > this->tuneCompletionMax) this->tuneCompletionMax = completion;
         }
     }
+    this->autoTuneStream();
 
     /* Call the callbacks to update any changes */
     callParamCallbacks();
@@ -1174,6 +4086,11 @@ asynStatus aravisCamera::stop() {
     /* Stop the camera */
     arv_camera_stop_acquisition(this->camera);
     setIntegerParam(ADStatus, ADStatusIdle);
+    /* Release our share of the link; ADAcquire is still set if we are restarting */
+    if (this->bandwidth != NULL) {
+        aravisBandwidthUpdate(this->bandwidth, this->payload, 0,
+                              arv_gv_device_get_packet_size(ARV_GV_DEVICE(this->device)));
+    }
     /* Tear down the old stream and make a new one */
     return this->makeStreamObject();
 }
@@ -1194,11 +4111,27 @@ asynStatus aravisCamera::start() {
     } else {
         arv_camera_set_acquisition_mode(this->camera, ARV_ACQUISITION_MODE_CONTINUOUS);
     }
+    this->invalidateEnums("AcquisitionMode");
+    this->invalidateEnums("AcquisitionFrameCount");
     setIntegerParam(ADNumImagesCounter, 0);
     setIntegerParam(ADStatus, ADStatusAcquire);
 
+    /* The stream is new, so don't look for a gap before its first frame */
+    this->isGigE = ARV_IS_GV_DEVICE(this->device);
+    this->frameIdValid = 0;
+
+    /* Frames from a previous acquisition may have a different geometry */
+    this->clearRing();
+
+    /* Triggers sent before now will never get a frame */
+    this->triggerHead = this->triggerTail = 0;
+    setIntegerParam(AravisTriggerPending, 0);
+
     /* fill the queue */
     this->payload = arv_camera_get_payload(this->camera);
+
+    /* The frames may be bigger than the shared memory slots now */
+    if (this->shm != NULL && aravisShmSlotSize(this->shm) < (size_t) this->payload) this->setShm();
     for (int i=0; i<NRAW; i++) {
         if (this->allocBuffer() != asynSuccess) {
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
@@ -1210,6 +4143,7 @@ asynStatus aravisCamera::start() {
 
     // Start the camera acquiring
     arv_camera_start_acquisition (this->camera);
+    this->updateBandwidth();
     return asynSuccess;
 }
 
@@ -1350,6 +4284,9 @@ asynStatus aravisCamera::setGeometry() {
         arv_camera_set_region(this->camera, x, y, w, h);
     }
 
+    /* Limits, frame rate and payload follow the geometry */
+    this->refreshDependents(geometryFeatures, sizeof(geometryFeatures) / sizeof(geometryFeatures[0]));
+
     /* Read back values */
     if (this->getGeometry()) {
         status = asynError;
@@ -1455,6 +4392,7 @@ asynStatus aravisCamera::setIntegerValue(const char *feature, epicsInt32 value,
                 "%s:%s: arv_device_set_integer_feature_value %s value %d\n",
                 driverName, functionName, feature, value );
     arv_device_set_integer_feature_value (this->device, feature, value);
+    this->invalidateEnums(feature);
     if (rbv != NULL) {
         *rbv = arv_device_get_integer_feature_value (this->device, feature);
         if (value != *rbv) {
@@ -1480,6 +4418,7 @@ asynStatus aravisCamera::setFloatValue(const char *feature, epicsFloat64 value,
             "%s:%s: arv_device_set_float_feature_value %s value %f\n",
             driverName, functionName, feature, value );
     arv_device_set_float_feature_value (this->device, feature, value);
+    this->invalidateEnums(feature);
     if (rbv != NULL) {
         *rbv = arv_device_get_float_feature_value (this->device, feature);
         epicsFloat64 denom = value;
@@ -1494,143 +4433,745 @@ asynStatus aravisCamera::setFloatValue(const char *feature, epicsFloat64 value,
     return asynSuccess;
 }
 
+/** Publish the stream and frame accounting statistics
+    lock taken */
+asynStatus aravisCamera::reportStatistics() {
+    int status = asynSuccess;
+    guint64 n_completed_buffers, n_failures, n_underruns;
+    if (this->stream != NULL) {
+        arv_stream_get_statistics(this->stream, &n_completed_buffers, &n_failures, &n_underruns);
+        status |= setDoubleParam(AravisCompleted, (double) n_completed_buffers);
+        status |= setDoubleParam(AravisFailures, (double) n_failures);
+        status |= setDoubleParam(AravisUnderruns, (double) n_underruns);
+
+        if (ARV_IS_GV_STREAM(this->stream)) {
+            guint64 n_resent_pkts, n_missing_pkts;
+            arv_gv_stream_get_statistics(ARV_GV_STREAM(this->stream), &n_resent_pkts, &n_missing_pkts);
+            setIntegerParam(AravisResentPkts,  (epicsInt32) n_resent_pkts);
+            setIntegerParam(AravisMissingPkts, (epicsInt32) n_missing_pkts);
+        }
+    }
+
+    /* Where frames were lost, counted by the stream thread */
+    status |= setIntegerParam(AravisDroppedWire,  (epicsInt32) epicsAtomicGetSizeT(&this->nDroppedWire));
+    status |= setIntegerParam(AravisDroppedQueue, (epicsInt32) epicsAtomicGetSizeT(&this->nDroppedQueue));
+    status |= setIntegerParam(AravisBadFrames,    (epicsInt32) epicsAtomicGetSizeT(&this->nBadFrames));
+    status |= setIntegerParam(AravisDroppedNewest,(epicsInt32) epicsAtomicGetSizeT(&this->nDroppedNewest));
+    status |= setIntegerParam(AravisDroppedOldest,(epicsInt32) epicsAtomicGetSizeT(&this->nDroppedOldest));
+    status |= setIntegerParam(AravisDecimated,    (epicsInt32) epicsAtomicGetSizeT(&this->nDecimated));
+    this->reportRecording();
+    status |= setIntegerParam(AravisLastMissingId,(epicsInt32) epicsAtomicGetIntT(&this->lastMissingId));
+    return (asynStatus) status;
+}
+
 /* Get all features, called with lock taken */
 asynStatus aravisCamera::getAllFeatures() {
     int status = asynSuccess;
     /* ensure we go back to the beginning */
-    if (this->featureKeys != NULL) {
-        g_list_free(this->featureKeys);
-        this->featureKeys = NULL;
-    }
+    this->polling = 0;
     /* Get the first features */
     status |= this->getNextFeature();
     /* Get the rest of the features */
-    while (this->featureKeys != NULL) status |= this->getNextFeature();
+    while (this->polling) status |= this->getNextFeature();
     return (asynStatus) status;
 }
 
-asynStatus aravisCamera::getNextFeature() {
-    //const char *functionName = "getNextFeature";
+/** Read a single feature from the camera into its parameter
+    device lock taken */
+asynStatus aravisCamera::getFeature(struct aravis_feature *feature) {
     int status = asynSuccess;
-    const char *featureName;
-    ArvGcNode *node;
-    int *index;
+    int index = feature->reason;
+    const char *featureName = feature->name;
+    ArvGcNode *node = feature->node;
     epicsFloat64 floatValue;
     epicsInt32 integerValue;
     const char *stringValue;
-    guint64 n_completed_buffers, n_failures, n_underruns;
 
-    /* Get geometry on first run */
-    if (this->featureKeys == NULL) {
-        this->featureKeys = g_hash_table_get_keys(this->featureLookup);
-        this->featureIndex = 0;
-        return (asynStatus) this->getGeometry();
+    //printf("Get %p %s %d\n", node, featureName, index);
+    ARAVIS_TRACE2(feature_read, this->portName, featureName);
+    if (node == NULL) {
+        status = asynError;
+    } else if (ARV_IS_GC_ENUMERATION(node)) {
+        integerValue = arv_device_get_integer_feature_value (this->device, featureName);
+        this->lockPort();
+        status |= setIntegerParam(index, integerValue);
+        this->unlockPort();
+        feature->lastValue = integerValue;
+        feature->lastValid = 1;
+        this->updateEnumChoices(feature);
+    } else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(node)) == G_TYPE_DOUBLE) {
+        floatValue = arv_device_get_float_feature_value (this->device, featureName);
+        this->lockPort();
+        status |= this->setFloatFeatureParam(index, floatValue);
+        this->unlockPort();
+        feature->lastValue = floatValue;
+        feature->lastValid = 1;
+    } else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(node)) == G_TYPE_STRING) {
+        stringValue = arv_device_get_string_feature_value(this->device, featureName);
+        if (stringValue == NULL) {
+            //printf("aravisCamera: Feature %s has NULL value\n", featureName);
+            status = asynError;
+        } else {
+            this->lockPort();
+            status |= setStringParam(index, stringValue);
+            this->unlockPort();
+        }
+    //} else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(node)) == G_TYPE_INT64) {
+    } else if (!ARV_IS_GC_COMMAND(node)) {
+        integerValue = arv_device_get_integer_feature_value (this->device, featureName);
+        this->lockPort();
+        status |= this->setIntegerFeatureParam(index, integerValue);
+        this->unlockPort();
+        feature->lastValue = integerValue;
+        feature->lastValid = 1;
     }
+    ARAVIS_TRACE3(feature_read_done, this->portName, featureName, status);
+    return (asynStatus) status;
+}
 
-    /* Then iterate through keys */
-    if (this->featureIndex < g_list_length(this->featureKeys)) {
-        index = (int *) g_list_nth_data(this->featureKeys, this->featureIndex);
-        featureName = (const char *) g_hash_table_lookup(this->featureLookup, index);
-        node = arv_device_get_feature(this->device, featureName);
-        //printf("Get %p %s %d\n", node, featureName, *index);
-        if (node == NULL) {
-            status = asynError;
-        } else if (ARV_IS_GC_ENUMERATION(node)) {
-            integerValue = arv_device_get_integer_feature_value (this->device, featureName);
-            status |= setIntegerParam(*index, integerValue);
-            // Generate enum choices because they might have changed
-            if ((!arv_gc_feature_node_is_available(ARV_GC_FEATURE_NODE(node), NULL)) ||
-                (arv_gc_feature_node_is_locked(ARV_GC_FEATURE_NODE(node), NULL))) {
-                char *enumStrings = epicsStrDup("N.A.");
-                int enumValues = 0;
-                int enumSeverities = 0;
-                doCallbacksEnum(&enumStrings, &enumValues, &enumSeverities, 1, *index, 0);
-            } else {
-                guint numEnums;
-                ArvGcEnumeration *enumeration = (ARV_GC_ENUMERATION (node));
-                gint64 *arvEnumValues = arv_gc_enumeration_get_available_int_values(enumeration, &numEnums, NULL);
-                const char **enumStrings = arv_gc_enumeration_get_available_string_values(enumeration, &numEnums, NULL);
-                int *enumValues = new int[numEnums];
-                int *enumSeverities = new int[numEnums];
-                for (unsigned int i=0; i<numEnums; i++) {
-                    enumValues[i] = (int)arvEnumValues[i];
-                    enumSeverities[i] = 0;
-                }
-                doCallbacksEnum((char **)enumStrings, enumValues, enumSeverities, numEnums, *index, 0);
-                g_free(enumStrings);
-                delete [] enumValues; delete [] enumSeverities;
-            }
-            
-        } else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(node)) == G_TYPE_DOUBLE) {
-            floatValue = arv_device_get_float_feature_value (this->device, featureName);
-            /* special cases for exposure and frame rate */
-            if (*index == ADAcquireTime) floatValue /= 1000000;
-            if (*index == ADAcquirePeriod && floatValue > 0) floatValue = 1/floatValue;
-            status |= setDoubleParam(*index, floatValue);
-        } else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(node)) == G_TYPE_STRING) {
-            stringValue = arv_device_get_string_feature_value(this->device, featureName);
-            if (stringValue == NULL) {
-                //printf("aravisCamera: Feature %s has NULL value\n", featureName);
-                status = asynError;
-            } else {
-                status |= setStringParam(*index, stringValue);
-            }
-        //} else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(node)) == G_TYPE_INT64) {
-        } else if (!ARV_IS_GC_COMMAND(node)) {
-            integerValue = arv_device_get_integer_feature_value (this->device, featureName);
-            if (*index == ADGain) {
-                /* Gain is sometimes an integer */
-                status |= setDoubleParam(*index, integerValue);
-            } else if (*index == ADAcquireTime) {
-                /* Exposure time is an integer for JAI CM series */
-                status |= setDoubleParam(*index, integerValue / 1000000.0);
-            } else if (*index == ADAcquirePeriod) {
-                /* For JAI CM this is an enum. This should prevent an error 
-                   message in that case, and also work correctly if this 
-                   camera uses an integer FPS rate.*/
-                floatValue = (epicsFloat64) integerValue; 
-                if (floatValue > 0) 
-                    floatValue = 1/floatValue;
-                
-                status |= setDoubleParam(*index, floatValue);
-            } else {
-                status |= setIntegerParam(*index, integerValue);
+/** Forget the cached enum choices of a feature
+    lock taken */
+void aravisCamera::freeEnumChoices(struct aravis_feature *feature) {
+    for (size_t i = 0; i < feature->nEnums; i++) free(feature->enumStrings[i]);
+    free(feature->enumStrings);
+    free(feature->enumValues);
+    free(feature->enumSeverities);
+    feature->enumStrings = NULL;
+    feature->enumValues = NULL;
+    feature->enumSeverities = NULL;
+    feature->nEnums = 0;
+    feature->enumValid = 0;
+}
+
+/** Bring the cached enum choices of a feature up to date. They are only
+  * rebuilt when availability or lock state has changed, or a node they depend
+  * on in the genicam (a selector, an entry's pIsAvailable) has been written.
+  * Returns 1 if the choices differ from those last sent to clients
+    lock taken */
+int aravisCamera::refreshEnumChoices(struct aravis_feature *feature) {
+    ArvGcNode *node = feature->node;
+    int available;
+    guint numEnums = 0;
+    gint64 *arvEnumValues = NULL;
+    const char **arvEnumStrings = NULL;
+    int changed;
+
+    available = arv_gc_feature_node_is_available(ARV_GC_FEATURE_NODE(node), NULL) &&
+                !arv_gc_feature_node_is_locked(ARV_GC_FEATURE_NODE(node), NULL);
+    if (feature->enumValid && available == feature->enumAvailable && !feature->enumStale) {
+        return 0;
+    }
+    feature->enumAvailable = available;
+    feature->enumStale = 0;
+    this->nEnumRebuilds++;
+
+    if (available) {
+        ArvGcEnumeration *enumeration = (ARV_GC_ENUMERATION (node));
+        arvEnumValues = arv_gc_enumeration_get_available_int_values(enumeration, &numEnums, NULL);
+        arvEnumStrings = arv_gc_enumeration_get_available_string_values(enumeration, &numEnums, NULL);
+        if (arvEnumValues == NULL || arvEnumStrings == NULL) numEnums = 0;
+    }
+
+    /* Compare against what clients already have */
+    if (!available) {
+        changed = !feature->enumValid || feature->nEnums != 1 || strcmp(feature->enumStrings[0], "N.A.") != 0;
+    } else {
+        changed = !feature->enumValid || feature->nEnums != numEnums;
+        for (guint i = 0; !changed && i < numEnums; i++) {
+            changed = feature->enumValues[i] != (int) arvEnumValues[i] ||
+                      strcmp(feature->enumStrings[i], arvEnumStrings[i]) != 0;
+        }
+    }
+
+    if (changed) {
+        this->freeEnumChoices(feature);
+        if (!available) {
+            feature->nEnums = 1;
+            feature->enumStrings = (char **) calloc(1, sizeof(char *));
+            feature->enumValues = (int *) calloc(1, sizeof(int));
+            feature->enumSeverities = (int *) calloc(1, sizeof(int));
+            feature->enumStrings[0] = epicsStrDup("N.A.");
+        } else {
+            feature->nEnums = numEnums;
+            feature->enumStrings = (char **) calloc(numEnums + 1, sizeof(char *));
+            feature->enumValues = (int *) calloc(numEnums + 1, sizeof(int));
+            feature->enumSeverities = (int *) calloc(numEnums + 1, sizeof(int));
+            for (guint i = 0; i < numEnums; i++) {
+                feature->enumStrings[i] = epicsStrDup(arvEnumStrings[i]);
+                feature->enumValues[i] = (int) arvEnumValues[i];
             }
         }
-        this->featureIndex++;
+    }
+    feature->enumValid = 1;
+    g_free(arvEnumValues);
+    g_free(arvEnumStrings);
+    return changed;
+}
+
+/** Send enum choices to clients if they have changed
+    device lock taken */
+void aravisCamera::updateEnumChoices(struct aravis_feature *feature) {
+    if (this->refreshEnumChoices(feature)) {
+        this->lockPort();
+        doCallbacksEnum(feature->enumStrings, feature->enumValues, feature->enumSeverities,
+                        feature->nEnums, feature->reason, 0);
+        this->unlockPort();
+        this->nEnumCallbacks++;
+    }
+}
+
+/** Store a float feature value in its parameter
+    lock taken */
+asynStatus aravisCamera::setFloatFeatureParam(int index, epicsFloat64 floatValue) {
+    /* special cases for exposure and frame rate */
+    if (index == ADAcquireTime) floatValue /= 1000000;
+    if (index == ADAcquirePeriod && floatValue > 0) floatValue = 1/floatValue;
+    return setDoubleParam(index, floatValue);
+}
+
+/** Store an integer feature value in its parameter
+    lock taken */
+asynStatus aravisCamera::setIntegerFeatureParam(int index, epicsInt32 integerValue) {
+    epicsFloat64 floatValue;
+    if (index == ADGain) {
+        /* Gain is sometimes an integer */
+        return setDoubleParam(index, integerValue);
+    } else if (index == ADAcquireTime) {
+        /* Exposure time is an integer for JAI CM series */
+        return setDoubleParam(index, integerValue / 1000000.0);
+    } else if (index == ADAcquirePeriod) {
+        /* For JAI CM this is an enum. This should prevent an error 
+           message in that case, and also work correctly if this 
+           camera uses an integer FPS rate.*/
+        floatValue = (epicsFloat64) integerValue; 
+        if (floatValue > 0) 
+            floatValue = 1/floatValue;
+        
+        return setDoubleParam(index, floatValue);
+    }
+    return setIntegerParam(index, integerValue);
+}
+
+asynStatus aravisCamera::getNextFeature() {
+    //const char *functionName = "getNextFeature";
+    int status = asynSuccess;
+    struct aravis_feature *feature;
+    int blockReads;
+    epicsTimeStamp now;
+
+    /* Get geometry on first run */
+    if (!this->polling) {
+        this->polling = 1;
+        this->pollIndex = 0;
+        this->sweepRoundTrips = 0;
+        this->sweepBlocks = 0;
+        this->sweepBlockFeatures = 0;
+        epicsTimeGetCurrent(&this->sweepStart);
+        return (asynStatus) this->getGeometry();
+    }
+
+    /* Read whole register blocks on the first feature tick */
+    getIntegerParam(AravisBlockReads, &blockReads);
+    if (this->pollIndex == 0 && blockReads) {
+        if (!this->blockPlanValid) this->planBlocks();
+        status |= this->readBlocks();
+    }
+
+    /* Then iterate through the registry, skipping those the blocks have covered */
+    while (this->pollIndex < this->featureList->len) {
+        feature = (struct aravis_feature *) g_ptr_array_index(this->featureList, this->pollIndex);
+        this->pollIndex++;
+        if (feature->pollClass == ARAVIS_POLL_NEVER) continue;
+        if (blockReads && feature->pollClass == ARAVIS_POLL_BLOCK && !this->blocks[feature->reg->block].failed) continue;
+        status |= this->getFeature(feature);
+        /* at least one ReadReg, more for features that aren't a plain register */
+        this->sweepRoundTrips++;
         return (asynStatus) status;
     }
 
     /* On last tick report statistics */
-    if (this->stream != NULL) {
-        arv_stream_get_statistics(this->stream, &n_completed_buffers, &n_failures, &n_underruns);
-        status |= setDoubleParam(AravisCompleted, (double) n_completed_buffers);
-        status |= setDoubleParam(AravisFailures, (double) n_failures);
-        status |= setDoubleParam(AravisUnderruns, (double) n_underruns);
-        if (ARV_IS_GV_DEVICE(this->stream)) {
-            guint64 n_resent_pkts, n_missing_pkts;
-            arv_gv_stream_get_statistics(ARV_GV_STREAM(this->stream), &n_resent_pkts, &n_missing_pkts);
-            setIntegerParam(AravisResentPkts,  (epicsInt32) n_resent_pkts);
-            setIntegerParam(AravisMissingPkts, (epicsInt32) n_missing_pkts);
-        }
-    }
+    epicsTimeGetCurrent(&now);
+    setIntegerParam(AravisSweepRoundTrips, this->sweepRoundTrips);
+    setIntegerParam(AravisSweepBlocks, this->sweepBlocks);
+    setIntegerParam(AravisSweepBlockFeatures, this->sweepBlockFeatures);
+    setDoubleParam(AravisSweepTime, epicsTimeDiffInSeconds(&now, &this->sweepStart));
+    setIntegerParam(AravisEnumRebuilds, this->nEnumRebuilds);
+    setIntegerParam(AravisEnumCallbacks, this->nEnumCallbacks);
+    status |= this->reportStatistics();
 
     /* ensure we go back to the beginning */
-    g_list_free(this->featureKeys);
-    this->featureKeys = NULL;
+    this->polling = 0;
     return (asynStatus) status;
 }
 
+/** Find a child element of a genicam node by its tag */
+static ArvDomNode *findChild(ArvGcNode *node, const char *name) {
+    ArvDomNode *child;
+    for (child = arv_dom_node_get_first_child(ARV_DOM_NODE(node)); child != NULL;
+            child = arv_dom_node_get_next_sibling(child)) {
+        if (strcmp(arv_dom_node_get_node_name(child), name) == 0) return child;
+    }
+    return NULL;
+}
+
+/** The text of a child property of a genicam node, or NULL if it has none */
+static const char *childString(ArvGcNode *node, const char *name) {
+    ArvDomNode *child = findChild(node, name);
+    if (child == NULL) return NULL;
+    return arv_gc_property_node_get_string(ARV_GC_PROPERTY_NODE(child), NULL);
+}
+
+/** Work out whether a feature is a plain register we can decode ourselves,
+  * an Integer, Float or Enumeration whose pValue is an IntReg, MaskedIntReg
+  * or FloatReg at a fixed address on the device port, or one of those
+  * registers itself. Anything with a converter, a computed address or a
+  * selector index is left to aravis.
+    lock taken */
+int aravisCamera::resolveRegister(ArvGcNode *node, struct block_reg *reg) {
+    ArvGcNode *regNode, *port;
+    ArvDomNode *child;
+    const char *type, *str;
+    GError *error = NULL;
+    int lsb, msb;
+
+    if (node == NULL) return 0;
+    type = arv_dom_node_get_node_name(ARV_DOM_NODE(node));
+    if (strcmp(type, "Integer") == 0 || strcmp(type, "Float") == 0 || strcmp(type, "Enumeration") == 0) {
+        child = findChild(node, "pValue");
+        if (child == NULL) return 0;
+        regNode = arv_gc_property_node_get_linked_node(ARV_GC_PROPERTY_NODE(child));
+        if (regNode == NULL) return 0;
+    } else {
+        regNode = node;
+    }
+    type = arv_dom_node_get_node_name(ARV_DOM_NODE(regNode));
+    if (strcmp(type, "IntReg") != 0 && strcmp(type, "MaskedIntReg") != 0 && strcmp(type, "FloatReg") != 0) return 0;
+    if (findChild(regNode, "pAddress") || findChild(regNode, "IntSwissKnife") || findChild(regNode, "pIndex")) return 0;
+    child = findChild(regNode, "pPort");
+    if (child == NULL) return 0;
+    port = arv_gc_property_node_get_linked_node(ARV_GC_PROPERTY_NODE(child));
+    if (port == NULL || strcmp(arv_gc_feature_node_get_name(ARV_GC_FEATURE_NODE(port)), "Device") != 0) return 0;
+
+    memset(reg, 0, sizeof(*reg));
+    reg->node = node;
+    reg->address = arv_gc_register_get_address(ARV_GC_REGISTER(regNode), &error);
+    if (error == NULL) reg->length = (int) arv_gc_register_get_length(ARV_GC_REGISTER(regNode), &error);
+    if (error != NULL) {
+        g_clear_error(&error);
+        return 0;
+    }
+    /* GenICam defaults are little endian and unsigned */
+    str = childString(regNode, "Endianess");
+    reg->bigEndian = str != NULL && strcmp(str, "BigEndian") == 0;
+    str = childString(regNode, "Sign");
+    reg->isSigned = str != NULL && strcmp(str, "Signed") == 0;
+    reg->isFloat = strcmp(type, "FloatReg") == 0;
+    if (reg->isFloat) {
+        if (reg->length != 4 && reg->length != 8) return 0;
+    } else if (reg->length < 1 || reg->length > 8) {
+        return 0;
+    }
+    if (strcmp(type, "MaskedIntReg") == 0) {
+        if ((str = childString(regNode, "Bit")) != NULL) {
+            lsb = msb = atoi(str);
+        } else if ((str = childString(regNode, "LSB")) != NULL) {
+            lsb = atoi(str);
+            if ((str = childString(regNode, "MSB")) == NULL) return 0;
+            msb = atoi(str);
+        } else {
+            return 0;
+        }
+        /* Big endian registers number their bits from the most significant end */
+        if (reg->bigEndian) {
+            reg->shift = reg->length * 8 - 1 - lsb;
+            reg->width = lsb - msb + 1;
+        } else {
+            reg->shift = lsb;
+            reg->width = msb - lsb + 1;
+        }
+        if (reg->shift < 0 || reg->width < 1 || reg->shift + reg->width > reg->length * 8) return 0;
+    }
+    return 1;
+}
+
+static int compareBlockRegs(const void *a, const void *b) {
+    const struct block_reg *ra = (const struct block_reg *) a, *rb = (const struct block_reg *) b;
+    if (ra->address < rb->address) return -1;
+    return ra->address > rb->address;
+}
+
+/** Free the block read plan
+    lock taken */
+void aravisCamera::freeBlocks() {
+    free(this->blockRegs);
+    free(this->blocks);
+    this->blockRegs = NULL;
+    this->blocks = NULL;
+    this->nBlockRegs = 0;
+    this->nBlocks = 0;
+    this->blockPlanValid = 0;
+}
+
+/** Group the polled features that are plain registers into as few
+  * ReadMem transfers as possible
+    lock taken */
+void aravisCamera::planBlocks() {
+    unsigned int j;
+    int i;
+
+    this->freeBlocks();
+    this->blockRegs = (struct block_reg *) calloc(this->featureList->len + 1, sizeof(struct block_reg));
+    for (j = 0; j < this->featureList->len; j++) {
+        struct aravis_feature *feature = (struct aravis_feature *) g_ptr_array_index(this->featureList, j);
+        struct block_reg *reg = &this->blockRegs[this->nBlockRegs];
+        if (feature->pollClass == ARAVIS_POLL_BLOCK) feature->pollClass = ARAVIS_POLL_SINGLE;
+        feature->reg = NULL;
+        if (feature->pollClass == ARAVIS_POLL_SINGLE && this->resolveRegister(feature->node, reg)) {
+            reg->index = feature->reason;
+            this->nBlockRegs++;
+        }
+    }
+
+    /* Merge registers in address order while the block fits in one round trip.
+     * ReadMem wants 4 byte aligned addresses and lengths */
+    qsort(this->blockRegs, this->nBlockRegs, sizeof(struct block_reg), compareBlockRegs);
+    this->blocks = (struct block_read *) calloc(this->nBlockRegs + 1, sizeof(struct block_read));
+    for (i = 0; i < this->nBlockRegs; i++) {
+        struct block_reg *reg = &this->blockRegs[i];
+        guint64 start = reg->address & ~(guint64) 3;
+        guint64 end = (reg->address + reg->length + 3) & ~(guint64) 3;
+        struct block_read *block = this->nBlocks ? &this->blocks[this->nBlocks - 1] : NULL;
+        if (block != NULL && start <= block->address + block->length + BLOCK_GAP &&
+                end - block->address <= BLOCK_MAX) {
+            if (end > block->address + block->length) block->length = (guint32) (end - block->address);
+        } else {
+            block = &this->blocks[this->nBlocks++];
+            block->address = start;
+            block->length = (guint32) (end - start);
+            block->failed = 0;
+        }
+        reg->block = this->nBlocks - 1;
+        struct aravis_feature *feature = this->findFeature(reg->index);
+        feature->pollClass = ARAVIS_POLL_BLOCK;
+        feature->reg = reg;
+    }
+    this->blockPlanValid = 1;
+}
+
+/** Decode a register from its block and store it as getFeature would
+    lock taken */
+void aravisCamera::setBlockFeature(struct block_reg *reg, const guint8 *data) {
+    guint64 raw = 0;
+    gint64 integerValue;
+    epicsFloat64 floatValue;
+    int i, bits;
+
+    for (i = 0; i < reg->length; i++) {
+        raw = (raw << 8) | data[reg->bigEndian ? i : reg->length - 1 - i];
+    }
+    if (reg->isFloat) {
+        if (reg->length == 4) {
+            guint32 raw32 = (guint32) raw;
+            float f;
+            memcpy(&f, &raw32, sizeof(f));
+            floatValue = f;
+        } else {
+            double d;
+            memcpy(&d, &raw, sizeof(d));
+            floatValue = d;
+        }
+        integerValue = (gint64) floatValue;
+    } else {
+        bits = reg->length * 8;
+        if (reg->width) {
+            raw >>= reg->shift;
+            bits = reg->width;
+        }
+        if (bits < 64) raw &= (((guint64) 1) << bits) - 1;
+        integerValue = (gint64) raw;
+        if (reg->isSigned && bits < 64 && (raw >> (bits - 1)) & 1) {
+            integerValue -= ((gint64) 1) << bits;
+        }
+        floatValue = (epicsFloat64) integerValue;
+    }
+
+    struct aravis_feature *feature = this->findFeature(reg->index);
+    feature->lastValue = ARV_IS_GC_ENUMERATION(reg->node) ? integerValue : floatValue;
+    feature->lastValid = 1;
+    if (ARV_IS_GC_ENUMERATION(reg->node)) {
+        setIntegerParam(reg->index, (epicsInt32) integerValue);
+        this->updateEnumChoices(feature);
+    } else if (arv_gc_feature_node_get_value_type(ARV_GC_FEATURE_NODE(reg->node)) == G_TYPE_DOUBLE) {
+        this->setFloatFeatureParam(reg->index, floatValue);
+    } else {
+        this->setIntegerFeatureParam(reg->index, (epicsInt32) integerValue);
+    }
+}
+
+/** Read every block and decode the features in it. A block the camera
+  * refuses, usually because it spans an unreadable gap, is read feature by
+  * feature from then on
+    lock taken */
+asynStatus aravisCamera::readBlocks() {
+    const char *functionName = "readBlocks";
+    GError *error = NULL;
+    int b, r = 0;
+
+    for (b = 0; b < this->nBlocks; b++) {
+        struct block_read *block = &this->blocks[b];
+        if (!block->failed) {
+            ARAVIS_TRACE3(block_read, this->portName, block->address, block->length);
+            gboolean ok = arv_device_read_memory(this->device, block->address, block->length, this->blockData, &error);
+            ARAVIS_TRACE3(block_read_done, this->portName, block->address, ok);
+            if (ok) {
+                this->sweepBlocks++;
+                this->sweepRoundTrips += (block->length + BLOCK_MAX - 1) / BLOCK_MAX;
+            } else {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                            "%s:%s: ReadMem of %u bytes at 0x%llx failed (%s), reading its features one at a time\n",
+                            driverName, functionName, block->length, (unsigned long long) block->address,
+                            error ? error->message : "no error");
+                g_clear_error(&error);
+                this->sweepRoundTrips++;
+                block->failed = 1;
+            }
+        }
+        for (; r < this->nBlockRegs && this->blockRegs[r].block == b; r++) {
+            struct block_reg *reg = &this->blockRegs[r];
+            if (block->failed) continue;
+            this->setBlockFeature(reg, this->blockData + (reg->address - block->address));
+            this->sweepBlockFeatures++;
+        }
+    }
+    return asynSuccess;
+}
+
 /* Define to add feature if available */
-asynStatus aravisCamera::tryAddFeature(int *ADIdx, const char *featureString) {
+asynStatus aravisCamera::tryAddFeature(int reason, const char *featureString) {
     ArvGcNode *feature = arv_device_get_feature(this->device, featureString);
     if (feature != NULL && !ARV_IS_GC_CATEGORY(feature)) {
-        g_hash_table_insert(this->featureLookup, (gpointer)(ADIdx), (gpointer)featureString);
+        this->addFeature(reason, featureString, asynParamFloat64);
         return asynSuccess;
     }
     return asynError;
 }
 
+/* References that are not value dependencies: every register points at the
+ * device port, and the others are structure or point the other way */
+static int isDependencyLink(const char *name) {
+    return name[0] == 'p' && strcmp(name, "pPort") != 0 && strcmp(name, "pSelected") != 0 &&
+           strcmp(name, "pFeature") != 0 && strcmp(name, "pAlias") != 0 && strcmp(name, "pCastAlias") != 0 &&
+           strcmp(name, "pError") != 0;
+}
+
+static void freeDependents(gpointer data) {
+    g_ptr_array_free((GPtrArray *) data, TRUE);
+}
+
+/** Record that feature depends on node and everything node references
+    lock taken */
+void aravisCamera::addDependencies(struct aravis_feature *feature, ArvGcNode *node, GHashTable *visited, int depth) {
+    ArvDomNode *child;
+    GPtrArray *list;
+
+    if (node == NULL || depth > 32 || g_hash_table_lookup(visited, node)) return;
+    g_hash_table_insert(visited, node, node);
+    list = (GPtrArray *) g_hash_table_lookup(this->dependents, node);
+    if (list == NULL) {
+        list = g_ptr_array_new();
+        g_hash_table_insert(this->dependents, node, list);
+    }
+    g_ptr_array_add(list, feature);
+
+    for (child = arv_dom_node_get_first_child(ARV_DOM_NODE(node)); child != NULL;
+            child = arv_dom_node_get_next_sibling(child)) {
+        const char *name = arv_dom_node_get_node_name(child);
+        if (strcmp(name, "EnumEntry") == 0) {
+            /* entry availability decides the enum choices */
+            addDependencies(feature, (ArvGcNode *) child, visited, depth + 1);
+        } else if (isDependencyLink(name)) {
+            addDependencies(feature, arv_gc_property_node_get_linked_node(ARV_GC_PROPERTY_NODE(child)),
+                            visited, depth + 1);
+        }
+    }
+}
+
+/** Invert the genicam references of every registered feature, so that a write
+  * can find the features it makes stale. pInvalidator is followed like any
+  * other reference, so a register that names the written node is included
+    lock taken */
+void aravisCamera::buildDependencies() {
+    if (this->dependents != NULL) g_hash_table_destroy(this->dependents);
+    this->dependents = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, freeDependents);
+    for (unsigned int i = 0; i < this->featureList->len; i++) {
+        struct aravis_feature *feature = (struct aravis_feature *) g_ptr_array_index(this->featureList, i);
+        GHashTable *visited;
+        if (feature->node == NULL) continue;
+        visited = g_hash_table_new(g_direct_hash, g_direct_equal);
+        this->addDependencies(feature, feature->node, visited, 0);
+        g_hash_table_destroy(visited);
+    }
+    this->dependencyValid = 1;
+}
+
+/* Add a node to a refresh set unless it is already there */
+static void addChanged(ArvGcNode **changed, int *nChanged, ArvGcNode *node) {
+    for (int i = 0; i < *nChanged; i++) {
+        if (changed[i] == node) return;
+    }
+    if (*nChanged < MAX_CHANGED_NODES) changed[(*nChanged)++] = node;
+}
+
+/* The written nodes, the nodes their values land in through pValue and the
+ * features they select, deduplicated. Returns how many were put in changed */
+static int collectChanged(ArvGcNode * const *written, int nWritten, ArvGcNode **changed) {
+    int nChanged = 0;
+    for (int w = 0; w < nWritten; w++) {
+        int depth = 0;
+        for (ArvGcNode *node = written[w]; node != NULL && depth < 32; depth++) {
+            ArvGcNode *next = NULL;
+            addChanged(changed, &nChanged, node);
+            for (ArvDomNode *child = arv_dom_node_get_first_child(ARV_DOM_NODE(node)); child != NULL;
+                    child = arv_dom_node_get_next_sibling(child)) {
+                const char *name = arv_dom_node_get_node_name(child);
+                if (strcmp(name, "pSelected") == 0) {
+                    /* A selector changes which value its selected features show */
+                    ArvGcNode *selected = arv_gc_property_node_get_linked_node(ARV_GC_PROPERTY_NODE(child));
+                    if (selected != NULL) addChanged(changed, &nChanged, selected);
+                } else if (strcmp(name, "pValue") == 0 && next == NULL) {
+                    next = arv_gc_property_node_get_linked_node(ARV_GC_PROPERTY_NODE(child));
+                }
+            }
+            node = next;
+        }
+    }
+    return nChanged;
+}
+
+/** Read back, in one batch, every registered feature that depends on a node
+  * that has just been written, its pValue chain or the features it selects.
+  * A feature that depends on several of the written nodes is read once, and
+  * the enum choices of all of them are marked stale.
+    device lock taken */
+void aravisCamera::refreshDependents(ArvGcNode * const *written, int nWritten, struct aravis_feature *skip) {
+    ArvGcNode *changed[MAX_CHANGED_NODES];
+    int nChanged, nRefreshed = 0;
+    epicsTimeStamp start, end;
+
+    if (nWritten <= 0 || this->connectionValid != 1) return;
+    if (!this->dependencyValid) this->buildDependencies();
+    epicsTimeGetCurrent(&start);
+    nChanged = collectChanged(written, nWritten, changed);
+
+    this->refreshGeneration++;
+    for (int i = 0; i < nChanged; i++) {
+        GPtrArray *list = (GPtrArray *) g_hash_table_lookup(this->dependents, changed[i]);
+        if (list == NULL) continue;
+        for (unsigned int j = 0; j < list->len; j++) {
+            struct aravis_feature *feature = (struct aravis_feature *) g_ptr_array_index(list, j);
+            feature->enumStale = 1;
+            if (feature == skip || feature->pollClass == ARAVIS_POLL_NEVER ||
+                    feature->refreshStamp == this->refreshGeneration) continue;
+            feature->refreshStamp = this->refreshGeneration;
+            this->getFeature(feature);
+            nRefreshed++;
+        }
+    }
+
+    epicsTimeGetCurrent(&end);
+    this->lockPort();
+    setIntegerParam(AravisDepRefreshes, nRefreshed);
+    setDoubleParam(AravisDepRefreshTime, 1000 * epicsTimeDiffInSeconds(&end, &start));
+    this->unlockPort();
+}
+
+/** Refresh the dependents of features written outside the registry, as one batch
+    lock taken */
+void aravisCamera::refreshDependents(const char * const *featureNames, int nNames) {
+    ArvGcNode *written[MAX_CHANGED_NODES];
+    int nWritten = 0;
+    if (this->device == NULL) return;
+    for (int i = 0; i < nNames && nWritten < MAX_CHANGED_NODES; i++) {
+        ArvGcNode *node = arv_device_get_feature(this->device, featureNames[i]);
+        if (node != NULL) written[nWritten++] = node;
+    }
+    this->refreshDependents(written, nWritten, NULL);
+}
+
+/** Mark the cached enum choices that depend on a written node stale, without
+  * reading anything back. For writes the driver makes on its own account
+    device lock taken */
+void aravisCamera::invalidateEnums(ArvGcNode *written) {
+    ArvGcNode *changed[MAX_CHANGED_NODES];
+    int nChanged;
+
+    if (written == NULL || this->connectionValid != 1) return;
+    if (!this->dependencyValid) this->buildDependencies();
+    nChanged = collectChanged(&written, 1, changed);
+    for (int i = 0; i < nChanged; i++) {
+        GPtrArray *list = (GPtrArray *) g_hash_table_lookup(this->dependents, changed[i]);
+        if (list == NULL) continue;
+        for (unsigned int j = 0; j < list->len; j++) {
+            ((struct aravis_feature *) g_ptr_array_index(list, j))->enumStale = 1;
+        }
+    }
+}
+
+/** Mark the cached enum choices that depend on a feature stale
+    lock taken */
+void aravisCamera::invalidateEnums(const char *featureName) {
+    if (this->device == NULL || featureName == NULL) return;
+    this->invalidateEnums(arv_device_get_feature(this->device, featureName));
+}
+
+/** Look up the feature bound to an asyn reason, NULL if there isn't one
+    lock taken */
+struct aravis_feature *aravisCamera::findFeature(int reason) {
+    if (reason < 0 || (guint) reason >= this->featureByReason->len) return NULL;
+    return (struct aravis_feature *) g_ptr_array_index(this->featureByReason, reason);
+}
+
+/** Bind a feature to an asyn reason, or rename the feature already bound to it
+    lock taken */
+struct aravis_feature *aravisCamera::addFeature(int reason, const char *featureName, asynParamType type) {
+    struct aravis_feature *feature = this->findFeature(reason);
+    if (feature == NULL) {
+        feature = (struct aravis_feature *) calloc(1, sizeof(struct aravis_feature));
+        feature->reason = reason;
+        if ((guint) reason >= this->featureByReason->len) g_ptr_array_set_size(this->featureByReason, reason + 1);
+        g_ptr_array_index(this->featureByReason, reason) = feature;
+        g_ptr_array_add(this->featureList, feature);
+    } else if (strcmp(feature->name, featureName) == 0) {
+        return feature;
+    } else {
+        free(feature->name);
+    }
+    feature->name = epicsStrDup(featureName);
+    feature->type = type;
+    feature->lastValid = 0;
+    this->bindFeature(feature);
+    return feature;
+}
+
+/** Resolve the genicam node of a feature on the current camera
+    lock taken */
+void aravisCamera::bindFeature(struct aravis_feature *feature) {
+    feature->node = (this->device != NULL) ? arv_device_get_feature(this->device, feature->name) : NULL;
+    feature->pollClass = (feature->node == NULL || ARV_IS_GC_COMMAND(feature->node)) ? ARAVIS_POLL_NEVER : ARAVIS_POLL_SINGLE;
+    feature->reg = NULL;
+    this->freeEnumChoices(feature);
+    this->blockPlanValid = 0;
+    this->dependencyValid = 0;
+}
+
+/** Resolve every feature against a new camera, or forget them all when there is none
+    lock taken */
+void aravisCamera::bindFeatures() {
+    for (unsigned int i = 0; i < this->featureList->len; i++) {
+        this->bindFeature((struct aravis_feature *) g_ptr_array_index(this->featureList, i));
+    }
+}
+
 
 /** Configuration command, called directly or from iocsh */
 extern "C" int aravisCameraConfig(const char *portName, const char *cameraName,
@@ -1664,10 +5205,33 @@ static void configAravisCameraCallFunc(const iocshArgBuf *args)
 }
 
 
+/** Fire the software trigger of the camera on portName */
+extern "C" int aravisTrigger(const char *portName)
+{
+    for (GList *iter = cameras; iter != NULL; iter = iter->next) {
+        aravisCamera *pPvt = (aravisCamera *) iter->data;
+        if (portName != NULL && strcmp(pPvt->portName, portName) == 0) {
+            return pPvt->softwareTrigger();
+        }
+    }
+    printf("aravisTrigger: no aravisCamera port '%s'\n", portName ? portName : "");
+    return asynError;
+}
+
+static const iocshArg aravisTriggerArg0 = {"Port name", iocshArgString};
+static const iocshArg * const aravisTriggerArgs[] = {&aravisTriggerArg0};
+static const iocshFuncDef triggerAravisCamera = {"aravisTrigger", 1, aravisTriggerArgs};
+static void triggerAravisCameraCallFunc(const iocshArgBuf *args)
+{
+    aravisTrigger(args[0].sval);
+}
+
+
 static void aravisCameraRegister(void)
 {
 
     iocshRegister(&configAravisCamera, configAravisCameraCallFunc);
+    iocshRegister(&triggerAravisCamera, triggerAravisCameraCallFunc);
 }
 
 extern "C" {
@@ -0,0 +1,221 @@
+/* aravisDiscovery.cpp
+ *
+ * Camera discovery shared by every aravisCamera in the IOC.
+ *
+ * arv_camera_new() with a device id broadcasts a discovery request on every
+ * interface and waits for the replies, so an IOC with N cameras used to pay
+ * for N discovery passes, one after the other. Instead the first camera to
+ * connect runs a single arv_update_device_list() pass and caches the address
+ * of every device that answered. Later cameras look themselves up in the
+ * cache and open the device by IP address, which aravis does with a unicast
+ * locate to that one camera, so those opens can run in parallel. They do look
+ * the address up in the interface device list that a discovery pass rebuilds,
+ * so they share deviceListLock for reading and a pass takes it for writing.
+ *
+ * Cameras configured by IP address never trigger discovery at all. A camera
+ * that is missing from the cache repeats discovery if the last pass is older
+ * than ARAVIS_DISCOVERY_MAX_AGE, and otherwise falls back to letting aravis
+ * look for it by name (which is how fake and USB cameras are opened).
+ *
+ */
+
+/* System includes */
+#include <stdlib.h>
+#include <string.h>
+
+/* EPICS includes */
+#include <iocsh.h>
+#include <epicsExport.h>
+#include <epicsMutex.h>
+#include <epicsString.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+/* glib includes */
+#include <glib.h>
+
+#include "aravisDiscovery.h"
+
+/** A device that answered the last discovery pass */
+struct aravisDiscoveryEntry {
+    char *id;
+    char *physicalId;
+    char *serial;
+    char *address;
+};
+
+/* Entries are keyed by device id, physical id and serial number, so the
+ * table holds up to three keys for each entry and entries are freed from
+ * the list */
+static GHashTable *devices = NULL;
+static GList *entries = NULL;
+static epicsMutexId discoveryLock = NULL;
+static epicsThreadOnceId discoveryOnce = EPICS_THREAD_ONCE_INIT;
+static epicsTimeStamp lastDiscovery;
+static int discovered = 0;
+static double discoveryTime = 0;
+/* aravis rebuilds its interface device lists without a lock, so anything that may
+ * rebuild them takes this for writing, and opens that only read them for reading */
+static GRWLock deviceListLock;
+
+static void discoveryInit(void *arg) {
+    devices = g_hash_table_new(g_str_hash, g_str_equal);
+    discoveryLock = epicsMutexMustCreate();
+}
+
+static char *dupOrNull(const char *s) {
+    return (s != NULL && s[0] != '\0') ? epicsStrDup(s) : NULL;
+}
+
+/** Whether a camera name is an IP address that aravis can open directly */
+static int isAddress(const char *name) {
+    GInetAddress *address = g_inet_address_new_from_string(name);
+    if (address == NULL) return 0;
+    g_object_unref(address);
+    return strcmp(name, "0.0.0.0") != 0;
+}
+
+/** Run a discovery pass and rebuild the cache, called with discoveryLock taken */
+static void discover(void) {
+    epicsTimeStamp start;
+    GList *iter;
+    unsigned i, n;
+
+    g_hash_table_remove_all(devices);
+    for (iter = entries; iter != NULL; iter = iter->next) {
+        struct aravisDiscoveryEntry *entry = (struct aravisDiscoveryEntry *) iter->data;
+        free(entry->id);
+        free(entry->physicalId);
+        free(entry->serial);
+        free(entry->address);
+        free(entry);
+    }
+    g_list_free(entries);
+    entries = NULL;
+
+    epicsTimeGetCurrent(&start);
+    g_rw_lock_writer_lock(&deviceListLock);
+    arv_update_device_list();
+    n = arv_get_n_devices();
+    for (i = 0; i < n; i++) {
+        struct aravisDiscoveryEntry *entry;
+        if (arv_get_device_id(i) == NULL) continue;
+        entry = (struct aravisDiscoveryEntry *) calloc(1, sizeof(struct aravisDiscoveryEntry));
+        entry->id = epicsStrDup(arv_get_device_id(i));
+        entry->physicalId = dupOrNull(arv_get_device_physical_id(i));
+        entry->serial = dupOrNull(arv_get_device_serial_nbr(i));
+        entry->address = dupOrNull(arv_get_device_address(i));
+        entries = g_list_append(entries, entry);
+        /* Device ids win over physical ids and serials that happen to match them */
+        if (entry->serial && !g_hash_table_lookup(devices, entry->serial))
+            g_hash_table_insert(devices, entry->serial, entry);
+        if (entry->physicalId && !g_hash_table_lookup(devices, entry->physicalId))
+            g_hash_table_insert(devices, entry->physicalId, entry);
+        g_hash_table_insert(devices, entry->id, entry);
+    }
+    g_rw_lock_writer_unlock(&deviceListLock);
+    epicsTimeGetCurrent(&lastDiscovery);
+    discoveryTime = epicsTimeDiffInSeconds(&lastDiscovery, &start);
+    discovered = 1;
+    printf("aravisDiscovery: Found %u device(s) in %.2fs\n", n, discoveryTime);
+}
+
+/** Open a camera by IP address, device id, physical id or serial number.
+  * May block for seconds, so it must not be called with a port lock taken
+  * except where the caller is prepared to block that port */
+ArvCamera *aravisDiscoveryOpen(const char *cameraName) {
+    struct aravisDiscoveryEntry *entry;
+    char *address = NULL;
+    ArvCamera *camera;
+    epicsTimeStamp now;
+
+    /* Direct IP connection, no discovery needed */
+    if (cameraName != NULL && isAddress(cameraName)) {
+        g_rw_lock_reader_lock(&deviceListLock);
+        camera = arv_camera_new(cameraName);
+        g_rw_lock_reader_unlock(&deviceListLock);
+        return camera;
+    }
+
+    epicsThreadOnce(&discoveryOnce, discoveryInit, NULL);
+    epicsMutexMustLock(discoveryLock);
+    entry = cameraName ? (struct aravisDiscoveryEntry *) g_hash_table_lookup(devices, cameraName) : NULL;
+    epicsTimeGetCurrent(&now);
+    if (!discovered || (entry == NULL && cameraName != NULL &&
+                        epicsTimeDiffInSeconds(&now, &lastDiscovery) > ARAVIS_DISCOVERY_MAX_AGE)) {
+        discover();
+        entry = cameraName ? (struct aravisDiscoveryEntry *) g_hash_table_lookup(devices, cameraName) : NULL;
+    }
+    if (entry != NULL && entry->address != NULL && isAddress(entry->address)) {
+        address = epicsStrDup(entry->address);
+    }
+    epicsMutexUnlock(discoveryLock);
+
+    if (address != NULL) {
+        g_rw_lock_reader_lock(&deviceListLock);
+        camera = arv_camera_new(address);
+        g_rw_lock_reader_unlock(&deviceListLock);
+        free(address);
+        if (camera != NULL) return camera;
+    }
+
+    /* Not a GigE camera, or it did not answer, so let aravis look for it by name.
+     * This may rescan the interface device lists, so do it one camera at a time */
+    g_rw_lock_writer_lock(&deviceListLock);
+    camera = arv_camera_new(cameraName);
+    g_rw_lock_writer_unlock(&deviceListLock);
+    return camera;
+}
+
+/** Forget the cache so the next camera that connects runs a new discovery pass */
+void aravisDiscoveryRefresh(void) {
+    epicsThreadOnce(&discoveryOnce, discoveryInit, NULL);
+    epicsMutexMustLock(discoveryLock);
+    discovered = 0;
+    epicsMutexUnlock(discoveryLock);
+}
+
+/** Print every device from the last discovery pass */
+void aravisDiscoveryReport(FILE *fp) {
+    GList *iter;
+    epicsThreadOnce(&discoveryOnce, discoveryInit, NULL);
+    epicsMutexMustLock(discoveryLock);
+    if (!discovered) {
+        fprintf(fp, "No discovery pass cached\n");
+    } else {
+        char stamp[40];
+        epicsTimeToStrftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &lastDiscovery);
+        fprintf(fp, "Discovery at %s took %.2fs, %u device(s)\n", stamp, discoveryTime, g_list_length(entries));
+        for (iter = entries; iter != NULL; iter = iter->next) {
+            struct aravisDiscoveryEntry *entry = (struct aravisDiscoveryEntry *) iter->data;
+            fprintf(fp, "  %-32s %-16s %-18s %s\n", entry->id,
+                    entry->address ? entry->address : "-",
+                    entry->physicalId ? entry->physicalId : "-",
+                    entry->serial ? entry->serial : "-");
+        }
+    }
+    epicsMutexUnlock(discoveryLock);
+}
+
+/** Code for iocsh registration */
+static const iocshFuncDef reportAravisDiscovery = {"aravisDiscoveryReport", 0, NULL};
+static void reportAravisDiscoveryCallFunc(const iocshArgBuf *args)
+{
+    aravisDiscoveryReport(stdout);
+}
+
+static const iocshFuncDef refreshAravisDiscovery = {"aravisDiscoveryRefresh", 0, NULL};
+static void refreshAravisDiscoveryCallFunc(const iocshArgBuf *args)
+{
+    aravisDiscoveryRefresh();
+}
+
+static void aravisDiscoveryRegister(void)
+{
+    iocshRegister(&reportAravisDiscovery, reportAravisDiscoveryCallFunc);
+    iocshRegister(&refreshAravisDiscovery, refreshAravisDiscoveryCallFunc);
+}
+
+extern "C" {
+    epicsExportRegistrar(aravisDiscoveryRegister);
+}
@@ -0,0 +1,22 @@
+/* aravisDiscovery.h
+ *
+ * Camera discovery shared by every aravisCamera in the IOC.
+ *
+ */
+#ifndef ARAVIS_DISCOVERY_H
+#define ARAVIS_DISCOVERY_H
+
+#include <stdio.h>
+
+extern "C" {
+    #include <arv.h>
+}
+
+/** A discovery pass older than this is repeated when a camera cannot be found in it */
+#define ARAVIS_DISCOVERY_MAX_AGE 10.0
+
+ArvCamera *aravisDiscoveryOpen(const char *cameraName);
+void aravisDiscoveryRefresh(void);
+void aravisDiscoveryReport(FILE *fp);
+
+#endif
@@ -0,0 +1,216 @@
+/* aravisPreprocess.cpp
+ *
+ * Shift, dark subtraction, flat-field correction and flips applied to each
+ * frame in one pass, and the calibration frames they use.
+ *
+ * The stages are a template parameter, so each of the 32 combinations, for
+ * each pixel type, is compiled into its own kernel with the unused stages
+ * removed and an inner loop the compiler can vectorise. The frame is worked
+ * on a pair of rows at a time, the top and bottom rows that a vertical flip
+ * swaps. Each row is corrected into a scratch line that stays in cache along
+ * with its calibration rows, then copied back to where it belongs. Without
+ * flips every row is corrected in place.
+ *
+ * Calibration files are a 12 byte header (ARAVIS_CAL_MAGIC, width, height as
+ * native 32 bit integers) followed by width * height native floats.
+ *
+ */
+
+/* System includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aravisPreprocess.h"
+
+typedef void (*preprocessKernel)(void *data, int width, int height, int shift,
+                                 const float *dark, const float *gain, void *scratch);
+
+/** Correct one row from in to out, which may be the same row unless flipping X */
+template <typename T, int S>
+static inline void correctRow(const T *in, T *out, int width, int shift, const float *dark, const float *gain) {
+    const float maxValue = (float) (T) ~0;
+    for (int x = 0; x < width; x++) {
+        int ox = (S & ARAVIS_PRE_FLIP_X) ? width - 1 - x : x;
+        if (S & (ARAVIS_PRE_DARK | ARAVIS_PRE_FLAT)) {
+            float v = (S & ARAVIS_PRE_SHIFT) ? (float) (in[x] << shift) : (float) in[x];
+            if (S & ARAVIS_PRE_DARK) v -= dark[x];
+            if (S & ARAVIS_PRE_FLAT) v *= gain[x];
+            v = v < 0 ? 0 : (v > maxValue ? maxValue : v);
+            out[ox] = (T) (v + 0.5f);
+        } else if (S & ARAVIS_PRE_SHIFT) {
+            out[ox] = (T) (in[x] << shift);
+        } else {
+            out[ox] = in[x];
+        }
+    }
+}
+
+template <typename T, int S>
+static void preprocess(void *data, int width, int height, int shift,
+                       const float *dark, const float *gain, void *scratch) {
+    T *image = (T *) data;
+    T *lineA = (T *) scratch;
+    T *lineB = lineA + width;
+    size_t rowBytes = (size_t) width * sizeof(T);
+
+    if (!(S & (ARAVIS_PRE_FLIP_X | ARAVIS_PRE_FLIP_Y))) {
+        for (int y = 0; y < height; y++) {
+            size_t offset = (size_t) y * width;
+            correctRow<T, S>(image + offset, image + offset, width, shift,
+                             (S & ARAVIS_PRE_DARK) ? dark + offset : NULL,
+                             (S & ARAVIS_PRE_FLAT) ? gain + offset : NULL);
+        }
+        return;
+    }
+
+    for (int top = 0, bottom = height - 1; top <= bottom; top++, bottom--) {
+        size_t offsetA = (size_t) top * width, offsetB = (size_t) bottom * width;
+        correctRow<T, S>(image + offsetA, lineA, width, shift,
+                         (S & ARAVIS_PRE_DARK) ? dark + offsetA : NULL,
+                         (S & ARAVIS_PRE_FLAT) ? gain + offsetA : NULL);
+        if (top == bottom) {
+            memcpy(image + offsetA, lineA, rowBytes);
+            break;
+        }
+        correctRow<T, S>(image + offsetB, lineB, width, shift,
+                         (S & ARAVIS_PRE_DARK) ? dark + offsetB : NULL,
+                         (S & ARAVIS_PRE_FLAT) ? gain + offsetB : NULL);
+        memcpy(image + offsetA, (S & ARAVIS_PRE_FLIP_Y) ? lineB : lineA, rowBytes);
+        memcpy(image + offsetB, (S & ARAVIS_PRE_FLIP_Y) ? lineA : lineB, rowBytes);
+    }
+}
+
+#define ARAVIS_PRE_KERNELS4(T, n) \
+    preprocess<T, n>, preprocess<T, n + 1>, preprocess<T, n + 2>, preprocess<T, n + 3>
+#define ARAVIS_PRE_KERNELS(T) \
+    ARAVIS_PRE_KERNELS4(T, 0),  ARAVIS_PRE_KERNELS4(T, 4),  ARAVIS_PRE_KERNELS4(T, 8),  ARAVIS_PRE_KERNELS4(T, 12), \
+    ARAVIS_PRE_KERNELS4(T, 16), ARAVIS_PRE_KERNELS4(T, 20), ARAVIS_PRE_KERNELS4(T, 24), ARAVIS_PRE_KERNELS4(T, 28)
+
+static const preprocessKernel kernels8[ARAVIS_PRE_COMBINATIONS] = { ARAVIS_PRE_KERNELS(uint8_t) };
+static const preprocessKernel kernels16[ARAVIS_PRE_COMBINATIONS] = { ARAVIS_PRE_KERNELS(uint16_t) };
+
+/** Apply the stages to a mono frame in place. Dark and flat stages are dropped
+  * if their calibration is missing or a different size to the frame, and the
+  * stages actually applied are returned. scratch must hold two rows */
+int aravisPreprocess(void *data, int bytesPerSample, int width, int height, int stages, int shift,
+                     const aravisCalibration *dark, const aravisCalibration *flat, void *scratch) {
+    if (shift == 0 || bytesPerSample != 2) stages &= ~ARAVIS_PRE_SHIFT;
+    if (dark == NULL || dark->image == NULL || dark->width != width || dark->height != height)
+        stages &= ~ARAVIS_PRE_DARK;
+    if (flat == NULL || flat->gain == NULL || flat->width != width || flat->height != height)
+        stages &= ~ARAVIS_PRE_FLAT;
+    if (stages == 0) return 0;
+    (bytesPerSample == 2 ? kernels16 : kernels8)[stages](data, width, height, shift,
+            (stages & ARAVIS_PRE_DARK) ? dark->image : NULL,
+            (stages & ARAVIS_PRE_FLAT) ? flat->gain : NULL, scratch);
+    return stages;
+}
+
+void aravisCalibrationFree(aravisCalibration *cal) {
+    free(cal->image);
+    free(cal->gain);
+    free(cal->sum);
+    memset(cal, 0, sizeof(aravisCalibration));
+}
+
+/** Read a calibration file, returns 0 on success */
+int aravisCalibrationLoad(aravisCalibration *cal, const char *path) {
+    int32_t header[3];
+    size_t n;
+    float *image;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) return -1;
+    if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != ARAVIS_CAL_MAGIC ||
+            header[1] <= 0 || header[2] <= 0) {
+        fclose(fp);
+        return -1;
+    }
+    n = (size_t) header[1] * header[2];
+    image = (float *) malloc(n * sizeof(float));
+    if (image == NULL || fread(image, sizeof(float), n, fp) != n) {
+        free(image);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    aravisCalibrationFree(cal);
+    cal->width = header[1];
+    cal->height = header[2];
+    cal->image = image;
+    return 0;
+}
+
+/** Write a calibration file, returns 0 on success */
+int aravisCalibrationSave(const aravisCalibration *cal, const char *path) {
+    int32_t header[3] = {ARAVIS_CAL_MAGIC, cal->width, cal->height};
+    size_t n = (size_t) cal->width * cal->height;
+    FILE *fp;
+    int status = 0;
+
+    if (cal->image == NULL) return -1;
+    fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+    if (fwrite(header, sizeof(header), 1, fp) != 1 || fwrite(cal->image, sizeof(float), n, fp) != n) status = -1;
+    if (fclose(fp) != 0) status = -1;
+    return status;
+}
+
+/** Start averaging the next frames into a new calibration */
+void aravisCalibrationStart(aravisCalibration *cal, int width, int height, int bytesPerSample, int frames) {
+    aravisCalibrationFree(cal);
+    cal->width = width;
+    cal->height = height;
+    cal->bytesPerSample = bytesPerSample;
+    cal->target = frames > 0 ? frames : 1;
+    cal->sum = (double *) calloc((size_t) width * height, sizeof(double));
+}
+
+/** Add a shifted width x height frame to a calibration being captured, less the
+  * dark frame if there is one of the same size. Returns 1 when the last frame has
+  * been added and the average is in image, -1 if the frame is the wrong size or
+  * pixel type or there is no memory for the average, when nothing has been read
+  * from data */
+int aravisCalibrationAdd(aravisCalibration *cal, const void *data, int bytesPerSample, int width, int height,
+                         const aravisCalibration *dark) {
+    size_t n = (size_t) cal->width * cal->height;
+    const float *d = (dark != NULL && dark->image != NULL && dark->width == cal->width &&
+                      dark->height == cal->height) ? dark->image : NULL;
+
+    if (cal->sum == NULL || width != cal->width || height != cal->height ||
+            bytesPerSample != cal->bytesPerSample) return -1;
+    if (bytesPerSample == 2) {
+        const uint16_t *p = (const uint16_t *) data;
+        for (size_t i = 0; i < n; i++) cal->sum[i] += d ? p[i] - d[i] : p[i];
+    } else {
+        const uint8_t *p = (const uint8_t *) data;
+        for (size_t i = 0; i < n; i++) cal->sum[i] += d ? p[i] - d[i] : p[i];
+    }
+    if (++cal->frames < cal->target) return 0;
+
+    cal->image = (float *) malloc(n * sizeof(float));
+    if (cal->image == NULL) return -1;
+    for (size_t i = 0; i < n; i++) cal->image[i] = (float) (cal->sum[i] / cal->frames);
+    free(cal->sum);
+    cal->sum = NULL;
+    return 1;
+}
+
+/** Turn a flat frame into the gains that bring every pixel to its mean */
+void aravisCalibrationMakeGain(aravisCalibration *cal) {
+    size_t n = (size_t) cal->width * cal->height;
+    double sum = 0, mean;
+
+    free(cal->gain);
+    cal->gain = NULL;
+    if (cal->image == NULL || n == 0) return;
+    for (size_t i = 0; i < n; i++) sum += cal->image[i];
+    mean = sum / n;
+    cal->gain = (float *) malloc(n * sizeof(float));
+    if (cal->gain == NULL) return;
+    for (size_t i = 0; i < n; i++) {
+        /* dead pixels are left alone rather than amplified without limit */
+        cal->gain[i] = cal->image[i] > 0.01 * mean ? (float) (mean / cal->image[i]) : 1.0f;
+    }
+}
@@ -0,0 +1,48 @@
+/* aravisPreprocess.h
+ *
+ * Shift, dark subtraction, flat-field correction and flips applied to each
+ * frame in one pass, and the calibration frames they use.
+ *
+ */
+#ifndef ARAVIS_PREPROCESS_H
+#define ARAVIS_PREPROCESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Stages of the pipeline, every combination has its own kernel */
+#define ARAVIS_PRE_SHIFT  0x01
+#define ARAVIS_PRE_DARK   0x02
+#define ARAVIS_PRE_FLAT   0x04
+#define ARAVIS_PRE_FLIP_X 0x08
+#define ARAVIS_PRE_FLIP_Y 0x10
+#define ARAVIS_PRE_COMBINATIONS 32
+
+/** Calibration files start with this, "ARVC" little endian, then width and height */
+#define ARAVIS_CAL_MAGIC 0x43565241
+
+/** A dark or flat frame, in the units of the shifted pixels. For a flat frame
+    gain is the per pixel correction that flattens it */
+typedef struct aravisCalibration {
+    int width;
+    int height;
+    float *image;
+    float *gain;
+    double *sum;        /**< Running sum while frames are being captured */
+    int bytesPerSample; /**< Of the frames being captured */
+    int frames;         /**< Frames captured so far */
+    int target;         /**< Frames to average */
+} aravisCalibration;
+
+int aravisPreprocess(void *data, int bytesPerSample, int width, int height, int stages, int shift,
+                     const aravisCalibration *dark, const aravisCalibration *flat, void *scratch);
+
+void aravisCalibrationFree(aravisCalibration *cal);
+int aravisCalibrationLoad(aravisCalibration *cal, const char *path);
+int aravisCalibrationSave(const aravisCalibration *cal, const char *path);
+void aravisCalibrationStart(aravisCalibration *cal, int width, int height, int bytesPerSample, int frames);
+int aravisCalibrationAdd(aravisCalibration *cal, const void *data, int bytesPerSample, int width, int height,
+                         const aravisCalibration *dark);
+void aravisCalibrationMakeGain(aravisCalibration *cal);
+
+#endif
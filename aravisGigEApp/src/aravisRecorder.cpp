@@ -0,0 +1,236 @@
+/* aravisRecorder.cpp
+ *
+ * Raw frame recording straight to disk, bypassing the plugin chain.
+ *
+ * Frames are copied into one of two aligned staging buffers. When a buffer is
+ * full it is handed to a writer thread, which writes it with O_DIRECT while the
+ * other one fills, so the page cache is never involved and the caller never
+ * waits for the disk. If the disk falls behind so far that both buffers are
+ * full the frame is refused and counted, rather than blocking the driver.
+ *
+ */
+
+/* System includes */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* EPICS includes */
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include "aravisRecorder.h"
+
+struct aravisRecorder {
+    int fd;
+    int direct;
+    size_t bufferSize;
+    char *buffers[2];
+    size_t fill[2];
+    int current;            /* buffer being filled, only touched by the caller */
+    int pending;            /* buffer waiting for the writer, -1 if none */
+    int stop;
+    int error;
+    uint64_t frames, dropped, bytesQueued, bytesWritten;
+    epicsTimeStamp start;
+    epicsMutexId lock;
+    epicsEventId work, done;
+};
+
+/** Write the whole of buf, returns errno on failure */
+static int writeAll(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/** Writer thread, writes each full buffer as it is handed over */
+static void recorderTask(void *arg) {
+    aravisRecorder *rec = (aravisRecorder *) arg;
+    while (1) {
+        epicsEventMustWait(rec->work);
+        epicsMutexMustLock(rec->lock);
+        int pending = rec->pending;
+        int stop = rec->stop;
+        epicsMutexUnlock(rec->lock);
+        if (pending >= 0) {
+            int error = writeAll(rec->fd, rec->buffers[pending], rec->fill[pending]);
+            epicsMutexMustLock(rec->lock);
+            if (error && !rec->error) rec->error = error;
+            if (!error) rec->bytesWritten += rec->fill[pending];
+            rec->fill[pending] = 0;
+            rec->pending = -1;
+            epicsMutexUnlock(rec->lock);
+        }
+        if (stop) break;
+    }
+    epicsEventSignal(rec->done);
+}
+
+/** Create fileName and start a writer thread for it. frameSize is the payload
+    we expect, so that each staging buffer can hold several frames */
+aravisRecorder *aravisRecorderOpen(const char *fileName, size_t frameSize) {
+    aravisRecorder *rec = (aravisRecorder *) calloc(1, sizeof(aravisRecorder));
+    if (rec == NULL) return NULL;
+
+    rec->bufferSize = 4 * (frameSize + sizeof(aravisRecordHeader));
+    if (rec->bufferSize < ARAVIS_RECORD_BUFFER_MIN) rec->bufferSize = ARAVIS_RECORD_BUFFER_MIN;
+    rec->bufferSize = (rec->bufferSize + ARAVIS_RECORD_ALIGN - 1) / ARAVIS_RECORD_ALIGN * ARAVIS_RECORD_ALIGN;
+    for (int i = 0; i < 2; i++) {
+        void *buf = NULL;
+        if (posix_memalign(&buf, ARAVIS_RECORD_ALIGN, rec->bufferSize) != 0) {
+            free(rec->buffers[0]);
+            free(rec);
+            return NULL;
+        }
+        rec->buffers[i] = (char *) buf;
+    }
+
+#ifdef O_DIRECT
+    /* Not every filesystem supports O_DIRECT, tmpfs for one */
+    rec->fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    rec->direct = rec->fd >= 0;
+#else
+    rec->fd = -1;
+#endif
+    if (rec->fd < 0) rec->fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (rec->fd < 0) {
+        printf("aravisRecorderOpen: cannot open %s: %s\n", fileName, strerror(errno));
+        free(rec->buffers[0]);
+        free(rec->buffers[1]);
+        free(rec);
+        return NULL;
+    }
+
+    rec->pending = -1;
+    epicsTimeGetCurrent(&rec->start);
+    rec->lock = epicsMutexMustCreate();
+    rec->work = epicsEventMustCreate(epicsEventEmpty);
+    rec->done = epicsEventMustCreate(epicsEventEmpty);
+    if (epicsThreadCreate("aravisRecord", epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackSmall),
+                          (EPICSTHREADFUNC) recorderTask, rec) == NULL) {
+        /* nothing would ever write the buffers, or signal done for aravisRecorderClose */
+        printf("aravisRecorderOpen: cannot create the writer thread for %s\n", fileName);
+        close(rec->fd);
+        epicsEventDestroy(rec->work);
+        epicsEventDestroy(rec->done);
+        epicsMutexDestroy(rec->lock);
+        free(rec->buffers[0]);
+        free(rec->buffers[1]);
+        free(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+/** Queue a frame for writing. Never waits for the disk, returns -1 and
+    counts the frame as dropped if there is no room for it */
+int aravisRecorderWrite(aravisRecorder *rec, const aravisRecordHeader *header, const void *data) {
+    size_t need = sizeof(aravisRecordHeader) + header->dataSize;
+    int cur = rec->current, other = 1 - cur;
+
+    size_t space = rec->bufferSize - rec->fill[cur];
+    epicsMutexMustLock(rec->lock);
+    /* Filling this buffer hands it to the writer, so the writer must be free
+     * and the rest of the frame must fit in the other buffer without filling it */
+    if (need >= space && (rec->pending >= 0 || need - space >= rec->bufferSize)) {
+        rec->dropped++;
+        epicsMutexUnlock(rec->lock);
+        return -1;
+    }
+    rec->frames++;
+    rec->bytesQueued += need;
+    epicsMutexUnlock(rec->lock);
+
+    /* Copy outside the lock, the writer never touches the current buffer */
+    const char *pieces[2] = { (const char *) header, (const char *) data };
+    size_t sizes[2] = { sizeof(aravisRecordHeader), header->dataSize };
+    for (int i = 0; i < 2; i++) {
+        while (sizes[i] > 0) {
+            size_t n = rec->bufferSize - rec->fill[cur];
+            if (n > sizes[i]) n = sizes[i];
+            memcpy(rec->buffers[cur] + rec->fill[cur], pieces[i], n);
+            rec->fill[cur] += n;
+            pieces[i] += n;
+            sizes[i] -= n;
+            if (rec->fill[cur] == rec->bufferSize) {
+                /* full, hand it over and carry on in the other one */
+                epicsMutexMustLock(rec->lock);
+                rec->pending = cur;
+                epicsMutexUnlock(rec->lock);
+                epicsEventSignal(rec->work);
+                cur = other;
+                other = 1 - cur;
+                rec->current = cur;
+            }
+        }
+    }
+    return 0;
+}
+
+/** Copy out the progress of the recording */
+void aravisRecorderGetStats(aravisRecorder *rec, aravisRecorderStats *stats) {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    epicsMutexMustLock(rec->lock);
+    stats->frames = rec->frames;
+    stats->dropped = rec->dropped;
+    stats->bytesWritten = rec->bytesWritten;
+    stats->backlog = rec->bytesQueued - rec->bytesWritten;
+    stats->direct = rec->direct;
+    stats->error = rec->error;
+    epicsMutexUnlock(rec->lock);
+    double elapsed = epicsTimeDiffInSeconds(&now, &rec->start);
+    stats->rate = elapsed > 0 ? stats->bytesWritten / elapsed / 1e6 : 0;
+}
+
+/** Flush what is left, close the file and free everything.
+    Returns errno of the first failed write, 0 if all the data reached the disk */
+int aravisRecorderClose(aravisRecorder *rec) {
+    int error;
+    if (rec == NULL) return 0;
+
+    /* let the writer finish the buffer it has, then stop it */
+    epicsMutexMustLock(rec->lock);
+    rec->stop = 1;
+    epicsMutexUnlock(rec->lock);
+    epicsEventSignal(rec->work);
+    epicsEventMustWait(rec->done);
+
+    /* The last buffer is partly full. O_DIRECT can only write whole blocks, so
+     * pad it out and then cut the file back to the real length */
+    int cur = rec->current;
+    size_t fill = rec->fill[cur];
+    error = rec->error;
+    if (fill > 0 && !error) {
+        size_t padded = (fill + ARAVIS_RECORD_ALIGN - 1) / ARAVIS_RECORD_ALIGN * ARAVIS_RECORD_ALIGN;
+        memset(rec->buffers[cur] + fill, 0, padded - fill);
+        error = writeAll(rec->fd, rec->buffers[cur], rec->direct ? padded : fill);
+        if (!error) {
+            rec->bytesWritten += fill;
+            if (rec->direct && ftruncate(rec->fd, rec->bytesWritten) != 0) error = errno;
+        }
+    }
+    if (close(rec->fd) != 0 && !error) error = errno;
+
+    epicsEventDestroy(rec->work);
+    epicsEventDestroy(rec->done);
+    epicsMutexDestroy(rec->lock);
+    free(rec->buffers[0]);
+    free(rec->buffers[1]);
+    free(rec);
+    return error;
+}
@@ -0,0 +1,56 @@
+/* aravisRecorder.h
+ *
+ * Raw frame recording straight to disk, bypassing the plugin chain.
+ *
+ */
+#ifndef ARAVIS_RECORDER_H
+#define ARAVIS_RECORDER_H
+
+#include <stdint.h>
+
+/** Every record in the file starts with this, "ARVR" little endian */
+#define ARAVIS_RECORD_MAGIC 0x52565241
+
+/** O_DIRECT needs the buffer address, file offset and size to be multiples of this */
+#define ARAVIS_RECORD_ALIGN 4096
+
+/** Smallest size of each of the two staging buffers */
+#define ARAVIS_RECORD_BUFFER_MIN (16 * 1024 * 1024)
+
+/** Header written in front of each frame's payload. The file is a plain
+    sequence of header, payload, header, payload... */
+typedef struct aravisRecordHeader {
+    uint32_t magic;         /**< ARAVIS_RECORD_MAGIC */
+    uint32_t headerSize;    /**< sizeof(aravisRecordHeader), the payload follows */
+    uint32_t dataSize;      /**< Bytes of payload following the header */
+    uint32_t frameId;       /**< GVSP block ID */
+    uint64_t timestamp;     /**< Camera timestamp, ns */
+    int64_t  received;      /**< Host time the frame completed, us since 1970 */
+    uint32_t width;
+    uint32_t height;
+    uint32_t xOffset;
+    uint32_t yOffset;
+    uint32_t pixelFormat;   /**< GenICam PFNC pixel format */
+    uint32_t uniqueId;      /**< NDArray uniqueId the frame would have had */
+    uint32_t reserved[2];
+} aravisRecordHeader;
+
+/** Progress of a recording */
+typedef struct aravisRecorderStats {
+    uint64_t frames;        /**< Frames accepted */
+    uint64_t dropped;       /**< Frames refused because both buffers were full */
+    uint64_t bytesWritten;  /**< Bytes on disk */
+    uint64_t backlog;       /**< Bytes accepted but not yet on disk */
+    double rate;            /**< Sustained MB/s since the recording started */
+    int direct;             /**< 1 if the file is open with O_DIRECT */
+    int error;              /**< errno of the first failed write, 0 if none */
+} aravisRecorderStats;
+
+typedef struct aravisRecorder aravisRecorder;
+
+aravisRecorder *aravisRecorderOpen(const char *fileName, size_t frameSize);
+int aravisRecorderWrite(aravisRecorder *rec, const aravisRecordHeader *header, const void *data);
+void aravisRecorderGetStats(aravisRecorder *rec, aravisRecorderStats *stats);
+int aravisRecorderClose(aravisRecorder *rec);
+
+#endif
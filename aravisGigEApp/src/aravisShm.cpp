@@ -0,0 +1,114 @@
+/* aravisShm.cpp
+ *
+ * Writer side of the shared memory frame ring, see aravisShm.h for the protocol.
+ *
+ */
+
+/* System includes */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* EPICS includes */
+#include <epicsString.h>
+
+#include "aravisShm.h"
+
+struct aravisShmWriter {
+    char *name;
+    aravisShmHeader *header;
+    size_t size;
+    uint64_t seq;
+};
+
+/** Create (or replace) the shared memory region name, e.g. "/aravis_CAM" */
+aravisShmWriter *aravisShmCreate(const char *name, unsigned int nSlots, size_t slotSize) {
+    aravisShmWriter *writer;
+    uint64_t stride = (sizeof(aravisShmSlot) + slotSize + 63) / 64 * 64;
+    size_t size = sizeof(aravisShmHeader) + nSlots * stride;
+    void *addr;
+    int fd;
+
+    if (name == NULL || nSlots == 0 || slotSize == 0) return NULL;
+    /* Start from a new object, readers of an old one are told it is closed */
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("aravisShmCreate: cannot create %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, size) != 0) {
+        printf("aravisShmCreate: cannot size %s: %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        printf("aravisShmCreate: cannot map %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return NULL;
+    }
+
+    writer = (aravisShmWriter *) calloc(1, sizeof(aravisShmWriter));
+    writer->name = epicsStrDup(name);
+    writer->header = (aravisShmHeader *) addr;
+    writer->size = size;
+    memset(addr, 0, sizeof(aravisShmHeader));
+    writer->header->nSlots = nSlots;
+    writer->header->slotSize = (uint32_t) slotSize;
+    writer->header->slotStride = stride;
+    writer->header->version = ARAVIS_SHM_VERSION;
+    /* magic last, so a reader never sees a half made header */
+    ARAVIS_SHM_BARRIER();
+    writer->header->magic = ARAVIS_SHM_MAGIC;
+    return writer;
+}
+
+/** Largest frame the ring can hold */
+size_t aravisShmSlotSize(aravisShmWriter *writer) {
+    return writer->header->slotSize;
+}
+
+/** Copy a frame into the next slot and publish it. meta->seq is ignored.
+    Returns -1 if the frame is too big for a slot */
+int aravisShmPublish(aravisShmWriter *writer, const aravisShmSlot *meta, const void *data) {
+    aravisShmHeader *header = writer->header;
+    if (meta->dataSize > header->slotSize) return -1;
+
+    uint64_t n = ++writer->seq;
+    aravisShmSlot *slot = ARAVIS_SHM_SLOT(header, (n - 1) % header->nSlots);
+    slot->seq = 2 * n - 1;
+    ARAVIS_SHM_BARRIER();
+    slot->timestamp   = meta->timestamp;
+    slot->received    = meta->received;
+    slot->frameId     = meta->frameId;
+    slot->uniqueId    = meta->uniqueId;
+    slot->width       = meta->width;
+    slot->height      = meta->height;
+    slot->pixelFormat = meta->pixelFormat;
+    slot->colorMode   = meta->colorMode;
+    slot->dataType    = meta->dataType;
+    slot->dataSize    = meta->dataSize;
+    memcpy(ARAVIS_SHM_DATA(slot), data, meta->dataSize);
+    ARAVIS_SHM_BARRIER();
+    slot->seq = 2 * n;
+    header->writeSeq = n;
+    return 0;
+}
+
+/** Tell readers we have gone, then remove the region */
+void aravisShmDestroy(aravisShmWriter *writer) {
+    if (writer == NULL) return;
+    writer->header->closed = 1;
+    ARAVIS_SHM_BARRIER();
+    munmap(writer->header, writer->size);
+    shm_unlink(writer->name);
+    free(writer->name);
+    free(writer);
+}
@@ -0,0 +1,95 @@
+/* aravisShm.h
+ *
+ * Shared memory frame ring exported by aravisCamera to processes on the IOC host.
+ *
+ * The region is laid out as an aravisShmHeader followed by nSlots slots of
+ * slotStride bytes, each an aravisShmSlot followed by up to slotSize bytes of
+ * frame data. There is one writer and any number of readers, and no locks:
+ *
+ *  - The writer fills slot (n-1) % nSlots for frame n. It sets the slot's seq
+ *    to 2n-1 (odd, being written), writes the metadata and data, sets seq to
+ *    2n (even, complete) and then sets the header's writeSeq to n.
+ *  - A reader takes writeSeq, reads the slot in place, and then checks that
+ *    the slot's seq is still 2n. If not, the writer lapped it mid-read and the
+ *    frame must be discarded.
+ *  - When the writer goes away or changes geometry it sets closed; readers
+ *    should unmap and open the region again.
+ *
+ * This file is shared by the driver and the C reader library, so is plain C.
+ *
+ */
+#ifndef ARAVIS_SHM_H
+#define ARAVIS_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARAVIS_SHM_MAGIC   0x4D485341   /* "ASHM" little endian */
+#define ARAVIS_SHM_VERSION 2
+
+/** Full memory barrier between the writer's and readers' accesses */
+#define ARAVIS_SHM_BARRIER() __sync_synchronize()
+
+/** Start of the region, padded to a cache line */
+typedef struct aravisShmHeader {
+    uint32_t magic;                 /**< ARAVIS_SHM_MAGIC */
+    uint32_t version;               /**< ARAVIS_SHM_VERSION */
+    uint32_t nSlots;
+    uint32_t slotSize;              /**< Bytes of frame data each slot can hold */
+    uint64_t slotStride;            /**< Bytes from one slot to the next */
+    volatile uint64_t writeSeq;     /**< Sequence number of the newest complete frame, 0 if none */
+    volatile uint32_t closed;       /**< Set when the writer has finished with this region */
+    uint32_t reserved[7];
+} aravisShmHeader;
+
+/** Per frame metadata in front of each slot's data, padded to a cache line */
+typedef struct aravisShmSlot {
+    volatile uint64_t seq;          /**< 2n when frame n is complete, odd while being written */
+    uint64_t timestamp;             /**< Camera timestamp, ns */
+    int64_t  received;              /**< Host time the frame completed, us since 1970 */
+    uint32_t frameId;               /**< GVSP block ID */
+    uint32_t uniqueId;              /**< NDArray uniqueId */
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelFormat;           /**< GenICam PFNC pixel format */
+    uint32_t colorMode;             /**< NDColorMode_t */
+    uint32_t dataType;              /**< NDDataType_t */
+    uint32_t dataSize;              /**< Bytes of data following this header */
+    uint32_t reserved[2];
+} aravisShmSlot;
+
+/* Both headers must stay a cache line, so frame data is 64 byte aligned */
+typedef char aravisShmHeaderIs64[sizeof(aravisShmHeader) == 64 ? 1 : -1];
+typedef char aravisShmSlotIs64[sizeof(aravisShmSlot) == 64 ? 1 : -1];
+
+/** Address of slot i */
+#define ARAVIS_SHM_SLOT(hdr, i) \
+    ((aravisShmSlot *) ((char *) (hdr) + sizeof(aravisShmHeader) + (size_t) (i) * (hdr)->slotStride))
+
+/** Address of the data in a slot */
+#define ARAVIS_SHM_DATA(slot) ((void *) ((char *) (slot) + sizeof(aravisShmSlot)))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Writer, part of the aravisCamera library */
+typedef struct aravisShmWriter aravisShmWriter;
+aravisShmWriter *aravisShmCreate(const char *name, unsigned int nSlots, size_t slotSize);
+size_t aravisShmSlotSize(aravisShmWriter *writer);
+int aravisShmPublish(aravisShmWriter *writer, const aravisShmSlot *meta, const void *data);
+void aravisShmDestroy(aravisShmWriter *writer);
+
+/* Reader, in the aravisShmReader library */
+typedef struct aravisShmReader aravisShmReader;
+aravisShmReader *aravisShmOpen(const char *name);
+int aravisShmWait(aravisShmReader *reader, const aravisShmSlot **slot, double timeout);
+int aravisShmValid(aravisShmReader *reader, const aravisShmSlot *slot);
+uint64_t aravisShmMissed(aravisShmReader *reader);
+void aravisShmClose(aravisShmReader *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
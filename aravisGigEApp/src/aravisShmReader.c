@@ -0,0 +1,107 @@
+/* aravisShmReader.c
+ *
+ * Reader side of the shared memory frame ring exported by aravisCamera, see
+ * aravisShm.h for the protocol. Link against this to read frames in place
+ * from another process on the IOC host:
+ *
+ *     aravisShmReader *reader = aravisShmOpen("/aravis_CAM");
+ *     const aravisShmSlot *slot;
+ *     while (aravisShmWait(reader, &slot, 1.0) == 0) {
+ *         process(ARAVIS_SHM_DATA(slot), slot->dataSize);
+ *         if (!aravisShmValid(reader, slot)) discard the result, it was overwritten
+ *     }
+ *
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+/* System includes */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aravisShm.h"
+
+struct aravisShmReader {
+    aravisShmHeader *header;
+    size_t size;
+    uint64_t lastSeq;
+    uint64_t missed;
+};
+
+/** Map an existing region read only, NULL if there isn't one yet */
+aravisShmReader *aravisShmOpen(const char *name) {
+    aravisShmReader *reader;
+    struct stat st;
+    void *addr;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(aravisShmHeader)) {
+        close(fd);
+        return NULL;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return NULL;
+    if (((aravisShmHeader *) addr)->magic != ARAVIS_SHM_MAGIC ||
+        ((aravisShmHeader *) addr)->version != ARAVIS_SHM_VERSION) {
+        munmap(addr, st.st_size);
+        return NULL;
+    }
+    reader = (aravisShmReader *) calloc(1, sizeof(aravisShmReader));
+    reader->header = (aravisShmHeader *) addr;
+    reader->size = st.st_size;
+    /* only frames from now on */
+    reader->lastSeq = reader->header->writeSeq;
+    return reader;
+}
+
+/** Wait up to timeout seconds for a frame newer than the last one returned.
+    If the reader has fallen behind it skips to the newest frame and counts the rest as missed.
+    Returns 0 with *slot set, 1 on timeout, or -1 if the writer has closed the region */
+int aravisShmWait(aravisShmReader *reader, const aravisShmSlot **slot, double timeout) {
+    aravisShmHeader *header = reader->header;
+    struct timespec poll = { 0, 20000 };
+    double waited = 0;
+    while (1) {
+        uint64_t n;
+        if (header->closed) return -1;
+        n = header->writeSeq;
+        if (n > reader->lastSeq) {
+            ARAVIS_SHM_BARRIER();
+            reader->missed += n - reader->lastSeq - 1;
+            reader->lastSeq = n;
+            *slot = ARAVIS_SHM_SLOT(header, (n - 1) % header->nSlots);
+            /* it may already have been lapped */
+            if ((*slot)->seq == 2 * n) return 0;
+            reader->missed++;
+            continue;
+        }
+        if (waited >= timeout) return 1;
+        nanosleep(&poll, NULL);
+        waited += 20e-6;
+    }
+}
+
+/** After reading a slot in place, check the writer did not overwrite it meanwhile */
+int aravisShmValid(aravisShmReader *reader, const aravisShmSlot *slot) {
+    ARAVIS_SHM_BARRIER();
+    return slot->seq == 2 * reader->lastSeq;
+}
+
+/** Frames published that this reader never saw */
+uint64_t aravisShmMissed(aravisShmReader *reader) {
+    return reader->missed;
+}
+
+void aravisShmClose(aravisShmReader *reader) {
+    if (reader == NULL) return;
+    munmap(reader->header, reader->size);
+    free(reader);
+}
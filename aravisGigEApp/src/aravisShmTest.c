@@ -0,0 +1,82 @@
+/* aravisShmTest.c
+ *
+ * Test reader for the aravisCamera shared memory frame ring.
+ *
+ * Usage: aravisShmTest <name> [frames]
+ *
+ * Prints each frame's metadata and the time from the driver receiving it to
+ * this process seeing it, then a summary. Reopens the region if the driver
+ * recreates it.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "aravisShm.h"
+
+static int64_t now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int main(int argc, char *argv[]) {
+    aravisShmReader *reader = NULL;
+    const aravisShmSlot *slot;
+    long frames = 0, torn = 0, wanted = argc > 2 ? atol(argv[2]) : 0;
+    double latencySum = 0, latencyMax = 0;
+    struct timespec retry = { 0, 100000000 };
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <name> [frames]\n", argv[0]);
+        return 1;
+    }
+
+    while (wanted <= 0 || frames < wanted) {
+        int status;
+        if (reader == NULL) {
+            reader = aravisShmOpen(argv[1]);
+            if (reader == NULL) {
+                nanosleep(&retry, NULL);
+                continue;
+            }
+            printf("Opened %s\n", argv[1]);
+        }
+        status = aravisShmWait(reader, &slot, 1.0);
+        if (status < 0) {
+            printf("Writer closed %s, reopening\n", argv[1]);
+            aravisShmClose(reader);
+            reader = NULL;
+            continue;
+        }
+        if (status > 0) continue;
+
+        double latency = (double) (now_us() - slot->received);
+        unsigned int frameId = slot->frameId, width = slot->width, height = slot->height;
+        unsigned int dataSize = slot->dataSize;
+        /* touch the data like a real consumer would */
+        unsigned long sum = 0;
+        const unsigned char *data = (const unsigned char *) ARAVIS_SHM_DATA(slot);
+        for (unsigned int i = 0; i < dataSize; i += 4096) sum += data[i];
+        if (!aravisShmValid(reader, slot)) {
+            torn++;
+            continue;
+        }
+        frames++;
+        latencySum += latency;
+        if (latency > latencyMax) latencyMax = latency;
+        printf("frame %u %ux%u %u bytes, latency %.0f us, checksum %lu\n",
+               frameId, width, height, dataSize, latency, sum);
+    }
+
+    printf("%ld frames, mean latency %.0f us, max %.0f us, %llu missed, %ld overwritten while reading\n",
+           frames, frames ? latencySum / frames : 0, latencyMax,
+           (unsigned long long) aravisShmMissed(reader), torn);
+    aravisShmClose(reader);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/* aravisStats.cpp
+ *
+ * Single pass frame statistics computed in the driver.
+ *
+ * Rather than comparing and accumulating each pixel, the kernel counts every
+ * raw value into a histogram at full resolution, left shifting 16 bit pixels
+ * in the same pass. Min, max, mean, sigma, the saturated count and the coarse
+ * published histogram are then derived exactly from at most 65536 bins, so the
+ * cost per pixel is a load, an optional shift and store, and an increment.
+ *
+ * When the range is small enough the increments are spread over four copies
+ * of the histogram, so that the long runs of equal values in a flat image do
+ * not wait on each other. The copies are summed afterwards.
+ *
+ */
+
+/* System includes */
+#include <math.h>
+#include <string.h>
+
+#include "aravisStats.h"
+
+/** Count n samples into lanes interleaved histograms of top+1 bins each */
+template <typename T>
+static void accumulate(T *data, size_t n, int shift, uint32_t top, uint32_t *hist, int lanes) {
+    size_t bins = top + 1;
+    uint32_t *h0 = hist;
+    uint32_t *h1 = hist + (lanes > 1 ? bins : 0);
+    uint32_t *h2 = hist + (lanes > 1 ? 2 * bins : 0);
+    uint32_t *h3 = hist + (lanes > 1 ? 3 * bins : 0);
+    size_t i = 0;
+
+#define ARAVIS_STATS_SAMPLE(h, k) { \
+        uint32_t v = data[k]; \
+        if (v > top) v = top; \
+        h[v]++; \
+        if (shift) data[k] = (T) (data[k] << shift); \
+    }
+    for (; i + 4 <= n; i += 4) {
+        ARAVIS_STATS_SAMPLE(h0, i);
+        ARAVIS_STATS_SAMPLE(h1, i + 1);
+        ARAVIS_STATS_SAMPLE(h2, i + 2);
+        ARAVIS_STATS_SAMPLE(h3, i + 3);
+    }
+    for (; i < n; i++) ARAVIS_STATS_SAMPLE(h0, i);
+#undef ARAVIS_STATS_SAMPLE
+}
+
+/** Compute the statistics of n samples of bytesPerSample (1 or 2) bytes with
+  * bits significant bits, left shifting 16 bit samples by shift in place.
+  * Values above the significant bits are counted as saturated. work must hold
+  * ARAVIS_STATS_WORK entries */
+void aravisStatsCompute(void *data, size_t n, int bytesPerSample, int bits, int shift,
+                        uint32_t *work, aravisStatsResult *result) {
+    double scale, sum = 0, sumSquares = 0;
+    uint32_t top, bin;
+    int lanes, first = -1, last = -1, coarseShift;
+
+    if (bytesPerSample == 1) bits = 8;
+    if (bits <= 0 || bits > 16) bits = 16;
+    top = (1u << bits) - 1;
+    lanes = (top + 1) * 4 <= ARAVIS_STATS_WORK / 4 ? 4 : 1;
+    memset(work, 0, (top + 1) * lanes * sizeof(uint32_t));
+
+    if (bytesPerSample == 1) {
+        accumulate((uint8_t *) data, n, 0, top, work, lanes);
+    } else {
+        accumulate((uint16_t *) data, n, shift, top, work, lanes);
+    }
+
+    /* fold the lanes into the first */
+    for (int lane = 1; lane < lanes; lane++) {
+        uint32_t *h = work + lane * (top + 1);
+        for (bin = 0; bin <= top; bin++) work[bin] += h[bin];
+    }
+
+    memset(result, 0, sizeof(aravisStatsResult));
+    coarseShift = bits > 6 ? bits - 6 : 0;
+    for (bin = 0; bin <= top; bin++) {
+        uint32_t count = work[bin];
+        if (count == 0) continue;
+        if (first < 0) first = bin;
+        last = bin;
+        sum += (double) count * bin;
+        sumSquares += (double) count * bin * bin;
+        result->histogram[bin >> coarseShift] += count;
+    }
+
+    /* report in the units of the shifted pixels */
+    scale = bytesPerSample == 2 ? (double) (1 << shift) : 1;
+    result->count = n;
+    result->saturated = work[top];
+    if (n > 0) {
+        double mean = sum / n;
+        double variance = sumSquares / n - mean * mean;
+        result->min = first * scale;
+        result->max = last * scale;
+        result->mean = mean * scale;
+        result->sigma = variance > 0 ? sqrt(variance) * scale : 0;
+    }
+}
+
+/** Mean of the samples in a region of an image width pixels wide, looking at
+  * every step'th pixel of every step'th row. Used for metering, where a
+  * sparse sample of the region is as good as all of it */
+template <typename T>
+static double regionMean(const T *data, int samplesPerPixel, int width, int x, int y, int w, int h, int step) {
+    double sum = 0;
+    size_t count = 0;
+    for (int row = y; row < y + h; row += step) {
+        const T *p = data + ((size_t) row * width + x) * samplesPerPixel;
+        uint64_t rowSum = 0;
+        int n = 0;
+        for (int col = 0; col < w * samplesPerPixel; col += step * samplesPerPixel) {
+            for (int c = 0; c < samplesPerPixel; c++) rowSum += p[col + c];
+            n += samplesPerPixel;
+        }
+        sum += rowSum;
+        count += n;
+    }
+    return count > 0 ? sum / count : 0;
+}
+
+double aravisStatsRegionMean(const void *data, int bytesPerSample, int samplesPerPixel, int width,
+                             int x, int y, int w, int h, int step) {
+    if (step < 1) step = 1;
+    if (bytesPerSample == 1) {
+        return regionMean((const uint8_t *) data, samplesPerPixel, width, x, y, w, h, step);
+    }
+    return regionMean((const uint16_t *) data, samplesPerPixel, width, x, y, w, h, step);
+}
+
+/** Sum and first and second moments of a region, row by row. The inner loop has
+  * no branches and integer accumulators, so the compiler can vectorise it */
+template <typename T>
+static void centroid(const T *data, int width, int x, int y, int w, int h, uint32_t threshold,
+                     double *moments) {
+    for (int row = 0; row < h; row++) {
+        const T *p = data + (size_t) (y + row) * width + x;
+        uint64_t rowSum = 0, rowSumX = 0, rowSumXX = 0;
+        for (int col = 0; col < w; col++) {
+            uint64_t v = p[col];
+            v = v >= threshold ? v : 0;
+            rowSum += v;
+            rowSumX += v * col;
+            rowSumXX += v * col * col;
+        }
+        moments[0] += rowSum;
+        moments[1] += rowSumX;
+        moments[2] += rowSumXX;
+        moments[3] += (double) rowSum * row;
+        moments[4] += (double) rowSum * row * row;
+    }
+}
+
+/** Centroid and width of the pixels of a mono image region that are at or
+  * above threshold, weighted by their value, as the stats plugin does.
+  * Returns 0 if nothing in the region reaches the threshold */
+int aravisStatsCentroid(const void *data, int bytesPerSample, int width, int x, int y, int w, int h,
+                        double threshold, aravisCentroidResult *result) {
+    double moments[5] = {0, 0, 0, 0, 0};
+    uint32_t t = threshold > 0 ? (uint32_t) ceil(threshold) : 0;
+    double mx, my;
+
+    if (bytesPerSample == 1) {
+        centroid((const uint8_t *) data, width, x, y, w, h, t, moments);
+    } else {
+        centroid((const uint16_t *) data, width, x, y, w, h, t, moments);
+    }
+    memset(result, 0, sizeof(aravisCentroidResult));
+    result->total = moments[0];
+    if (moments[0] <= 0) return 0;
+    mx = moments[1] / moments[0];
+    my = moments[3] / moments[0];
+    result->x = x + mx;
+    result->y = y + my;
+    result->sigmaX = sqrt(fmax(moments[2] / moments[0] - mx * mx, 0));
+    result->sigmaY = sqrt(fmax(moments[4] / moments[0] - my * my, 0));
+    return 1;
+}
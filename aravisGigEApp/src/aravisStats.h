@@ -0,0 +1,45 @@
+/* aravisStats.h
+ *
+ * Single pass frame statistics computed in the driver.
+ *
+ */
+#ifndef ARAVIS_STATS_H
+#define ARAVIS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Number of bins in the published histogram, spread over the full pixel range */
+#define ARAVIS_STATS_BINS 64
+
+/** Scratch space needed by aravisStatsCompute, in uint32_t */
+#define ARAVIS_STATS_WORK 65536
+
+/** Statistics of one frame, in the units of the pixels handed to the plugins */
+typedef struct aravisStatsResult {
+    double min;
+    double max;
+    double mean;
+    double sigma;
+    size_t count;                           /**< Samples, 3 per pixel for RGB */
+    size_t saturated;                       /**< Samples at the top of the sensor range */
+    int32_t histogram[ARAVIS_STATS_BINS];
+} aravisStatsResult;
+
+/** Centroid of the pixels in a region at or above a threshold, in pixels of the frame */
+typedef struct aravisCentroidResult {
+    double total;     /**< Sum of the pixels counted */
+    double x;
+    double y;
+    double sigmaX;
+    double sigmaY;
+} aravisCentroidResult;
+
+void aravisStatsCompute(void *data, size_t n, int bytesPerSample, int bits, int shift,
+                        uint32_t *work, aravisStatsResult *result);
+double aravisStatsRegionMean(const void *data, int bytesPerSample, int samplesPerPixel, int width,
+                             int x, int y, int w, int h, int step);
+int aravisStatsCentroid(const void *data, int bytesPerSample, int width, int x, int y, int w, int h,
+                        double threshold, aravisCentroidResult *result);
+
+#endif
@@ -0,0 +1,38 @@
+/* aravisTrace.h
+ *
+ * Static tracepoints on the frame pipeline.
+ *
+ * When the driver is built with ARAVIS_USDT defined, which the Makefile does
+ * for WITH_USDT=YES in configure/CONFIG_SITE, every ARAVIS_TRACE is a USDT
+ * probe in the "aravis" provider. A probe is a single nop in the code plus a
+ * note in the ELF file, and only costs anything while bpftrace, perf or
+ * SystemTap is attached to it. Without ARAVIS_USDT the macros, and their
+ * arguments, compile to nothing.
+ *
+ * Every probe has the asyn port name as its first argument. Frame probes have
+ * the GVSP frame ID as their second, so a frame can be followed from the stream
+ * thread to the plugins. aravisTrace.bt lists the probes and their arguments.
+ *
+ */
+#ifndef ARAVIS_TRACE_H
+#define ARAVIS_TRACE_H
+
+#ifdef ARAVIS_USDT
+
+#include <sys/sdt.h>
+
+#define ARAVIS_TRACE1(probe, a)             DTRACE_PROBE1(aravis, probe, a)
+#define ARAVIS_TRACE2(probe, a, b)          DTRACE_PROBE2(aravis, probe, a, b)
+#define ARAVIS_TRACE3(probe, a, b, c)       DTRACE_PROBE3(aravis, probe, a, b, c)
+#define ARAVIS_TRACE4(probe, a, b, c, d)    DTRACE_PROBE4(aravis, probe, a, b, c, d)
+
+#else
+
+#define ARAVIS_TRACE1(probe, a)             do {} while (0)
+#define ARAVIS_TRACE2(probe, a, b)          do {} while (0)
+#define ARAVIS_TRACE3(probe, a, b, c)       do {} while (0)
+#define ARAVIS_TRACE4(probe, a, b, c, d)    do {} while (0)
+
+#endif
+
+#endif
@@ -37,6 +37,9 @@ dbLoadRecords("$(ARAVISGIGE)/db/PGR_Blackfly_20E4C.template","P=$(PREFIX),R=cam1
 #aravisCameraConfig("$(PORT)", "FLIR-18011754")
 #dbLoadRecords("$(ARAVISGIGE)/db/FLIR_ORX_10G_51S5M.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
 
+# Cameras on the same host interface share its bandwidth, set the link speed and usable percentage
+#aravisBandwidthConfig("192.168.1.1", 1000, 90)
+
 asynSetTraceMask("$(PORT)",0,0x21)
 dbLoadRecords("$(ARAVISGIGE)/db/aravisCamera.template", "P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
 